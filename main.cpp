@@ -2,6 +2,26 @@
 // =========
 
 #define SDL_MAIN_HANDLED
+// Winsock has to come before anything pulls in windows.h
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <direct.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_render.h>
 #include <SDL2/SDL_scancode.h>
@@ -18,6 +38,32 @@
 #include <rtmidi/RtMidi.h>
 #endif
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <signal.h>
+#include <new>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+#ifdef SYNTH_WITH_JACK
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#endif
+#ifdef SYNTH_WITH_ALSA
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <pthread.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#define SYNTH_SSE
+#include <immintrin.h>
+#endif
 
 
 
@@ -31,6 +77,16 @@ enum Waveform {
     W_Count
 };
 
+// What a voice is made of. Oscillators use currWaveFunc, pluck and bowed
+// are waveguide strings, and sample plays whatever --sample loaded.
+enum VoiceModel {
+    V_Oscillator,
+    V_Pluck,
+    V_Bowed,
+    V_Sample,
+    V_Count
+};
+
 enum class OctaveMode {
     Single,
     Double,
@@ -38,6 +94,42 @@ enum class OctaveMode {
     Quadruple
 };
 
+// Everything that can be changed while running. Goes through
+// setParameter so the change lands on a block boundary and gets journalled.
+enum Param {
+    P_Volume,
+    P_CrushBits,
+    P_Bitcrush,
+    P_Compressor,
+    P_Lowpass,
+    P_LowpassQ,
+    P_Unison,
+    P_UnisonAmount,
+    P_GoofyUnison,
+    P_OctaveMode,
+    P_Waveform,
+    P_VoiceModel,
+    P_PitchBend,
+    P_SeqMode,
+    P_ArpPattern,
+    P_ArpOctaves,
+    P_Tempo,
+    P_SeqSync,
+    P_InputMix,
+    P_InputEffects,
+    P_InputSidechain,
+    P_Vocoder,
+    P_VoiceSpread,
+    P_StringDecay,
+    P_Multiband,
+    P_Harmonizer,
+    P_HarmonyMode,
+    P_HarmonyVoices,
+    P_Count
+};
+
+const static int MAX_UNISON = 16;
+
 struct PolyphonicVoice {
     int note;
     bool finishedPlaying;
@@ -45,6 +137,30 @@ struct PolyphonicVoice {
     double volume;
     double pressTime;
     double releaseTime;
+    // Oscillator phase in cycles, one per unison voice
+    double phase[MAX_UNISON];
+    // Filter state, kept per voice so voices can render independently
+    float lpAccumL;
+    float lpAccumR;
+    // Where the voice sits around the listener, in degrees. 0 is straight
+    // ahead, negative is left.
+    float azimuth;
+    VoiceModel model;
+    // Set on note on, the audio thread resets the string when it sees it
+    bool stringStart;
+    // Frames into the sample, loop unrolled, and which note this is on
+    // the voice's stream
+    double samplePos;
+    uint16_t sampleGen;
+    // Per-note expression. Velocity and volume scale the voice's pan
+    // gains, the bend goes on top of the channel's.
+    float velocity;
+    float noteVolume;
+    double bendRatio;
+    // The key that started it, which octave stacking adds to, and where
+    // it was panned then, for N_Reset
+    int playedNote;
+    float startAzimuth;
 };
 
 struct ADSRCurve {
@@ -88,9 +204,207 @@ double getRAttenuation(ADSRCurve curve, double time) {
     return clamp(1.0 - (time / curve.releaseTime), 0.0, 1.0) * curve.sustainAmount;
 }
 
+// Lock-free helpers
+// =================
+
+// Single producer, single consumer queue. Neither side ever blocks, push
+// just fails when it's full. Size has to be a power of two.
+template <typename T, unsigned Size>
+struct SpscRing {
+    static_assert((Size & (Size - 1)) == 0, "ring size must be a power of two");
+
+    T items[Size];
+    std::atomic<unsigned> head { 0 };
+    std::atomic<unsigned> tail { 0 };
+
+    bool push(const T& item) {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= Size)
+            return false;
+
+        items[h % Size] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return false;
+
+        item = items[t % Size];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    unsigned size() {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+};
+
+// Same again for when more than one thread pushes. Each slot has a
+// sequence number saying whose turn it is, producers claim slots by
+// bumping head.
+template <typename T, unsigned Size>
+struct MpscRing {
+    static_assert((Size & (Size - 1)) == 0, "ring size must be a power of two");
+
+    struct Slot {
+        std::atomic<unsigned> seq;
+        T item;
+    };
+
+    Slot slots[Size];
+    std::atomic<unsigned> head { 0 };
+    // Only the consumer moves it
+    std::atomic<unsigned> tail { 0 };
+
+    MpscRing() {
+        for (unsigned i = 0; i < Size; i++) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const T& item) {
+        unsigned h = head.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[h % Size];
+            int diff = (int)(slot.seq.load(std::memory_order_acquire) - h);
+            if (diff < 0)
+                return false;
+
+            if (diff == 0 && head.compare_exchange_weak(h, h + 1, std::memory_order_relaxed)) {
+                slot.item = item;
+                slot.seq.store(h + 1, std::memory_order_release);
+                return true;
+            }
+
+            if (diff > 0)
+                h = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool pop(T& item) {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        Slot& slot = slots[t % Size];
+        if (slot.seq.load(std::memory_order_acquire) != t + 1)
+            return false;
+
+        item = slot.item;
+        slot.seq.store(t + Size, std::memory_order_release);
+        tail.store(t + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool empty() {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+    }
+
+    // Roughly, from any thread
+    unsigned size() {
+        return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed);
+    }
+};
+
+// Publishes a small struct from one thread to any number of readers
+// without anyone blocking. Readers just retry if they catch a write
+// half done.
+template <typename T>
+struct SeqLock {
+    std::atomic<unsigned> seq { 0 };
+    T value {};
+
+    void store(const T& v) {
+        unsigned s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        value = v;
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    T load() {
+        T v;
+        unsigned before, after;
+        do {
+            before = seq.load(std::memory_order_acquire);
+            v = value;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = seq.load(std::memory_order_relaxed);
+        } while (before != after || (before & 1));
+
+        return v;
+    }
+};
+
+// SIMD helpers
+// ============
+// Plain loops for when SSE isn't there
+
+// dst += l * lGain + r * rGain
+void mixStereoInto(float* dst, const float* l, const float* r, float lGain, float rGain, int frames) {
+    int i = 0;
+#ifdef SYNTH_SSE
+    __m128 lg = _mm_set1_ps(lGain);
+    __m128 rg = _mm_set1_ps(rGain);
+    for (; i + 4 <= frames; i += 4) {
+        __m128 mixed = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(l + i), lg), _mm_mul_ps(_mm_loadu_ps(r + i), rg));
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), mixed));
+    }
+#endif
+    for (; i < frames; i++) {
+        dst[i] += l[i] * lGain + r[i] * rGain;
+    }
+}
+
+// Largest absolute value in x
+float blockPeak(const float* x, int n) {
+    int i = 0;
+    float peak = 0.0f;
+#ifdef SYNTH_SSE
+    __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 peaks = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        peaks = _mm_max_ps(peaks, _mm_andnot_ps(signMask, _mm_loadu_ps(x + i)));
+    }
+
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, peaks);
+    peak = fmaxf(fmaxf(lanes[0], lanes[1]), fmaxf(lanes[2], lanes[3]));
+#endif
+    for (; i < n; i++) {
+        peak = fmaxf(peak, fabsf(x[i]));
+    }
+
+    return peak;
+}
+
+float blockSumSquares(const float* x, int n) {
+    int i = 0;
+    float sum = 0.0f;
+#ifdef SYNTH_SSE
+    __m128 sums = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(x + i);
+        sums = _mm_add_ps(sums, _mm_mul_ps(v, v));
+    }
+
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, sums);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; i++) {
+        sum += x[i] * x[i];
+    }
+
+    return sum;
+}
+
 const static int NUM_VOICES = 16;
 PolyphonicVoice voices[NUM_VOICES];
 
+const static int MAX_CHANNELS = 8;
+const static int MAX_BLOCK = 1024;
+
 // Unison settings
 bool unisonDetune = false;
 int unisonOrder = 16;
@@ -106,14 +420,36 @@ bool enableCompressor = false;
 float lpQ = 0.5f;
 bool lpEnabled = false;
 
+int currentSampleRate = 44100;
+int bufSize = 512;
+
 // DSP timer. Updated upon buffer completion 
 double timeAccumulator = 0.0;
-bool hasClipped = false;
-float maxAmplitude = 0.0f;
+// Frames rendered since startup. This is the sequencer's clock.
+uint64_t engineFrame = 0;
 float volume = 1.0f;
 double pitchBendAmt = 0.0;
 
 Waveform currWaveFunc = W_Sine;
+VoiceModel voiceModel = V_Oscillator;
+const char* voiceModelNames[V_Count] = { "oscillator", "pluck", "bowed", "sample" };
+
+// Idle settings
+// Once nothing has been audible for this long the audio device gets paused.
+// Set with --idle-suspend, negative disables suspending.
+float idleSuspendSeconds = 30.0f;
+// Anything quieter than this (about -100dBFS) counts as silence
+const float silenceThreshold = 0.00001f;
+
+SDL_AudioDeviceID audioDevice = 0;
+float lastBlockPeak = 0.0f;
+double idleTime = 0.0;
+std::atomic<bool> audioSuspendRequested { false };
+std::atomic<bool> audioSuspended { false };
+std::mutex audioSuspendMutex;
+// Set on threads with a deadline (the audio callback, JACK's process
+// thread), which must never end up waiting on audioSuspendMutex
+thread_local bool onRealtimeThread = false;
 
 float bitcrush(float value, float bits) {
     float distinctValues = powf(2.0f, bits);
@@ -131,22 +467,23 @@ float squarify(float value) {
 // Wave functions
 // ==============
 
-typedef float (*WaveFunc)(double, double);
+// Wave functions take a phase in cycles, 0-1
+typedef float (*WaveFunc)(double);
 
-float saw(double t, double freq) {
-    return (fmod(t * freq, 1.0) * 2.0) - 1.0;
+float saw(double phase) {
+    return (phase * 2.0) - 1.0;
 }
 
-float sine(double t, double freq) {
-    return sin(t * M_PI * freq * 2.0);
+float sine(double phase) {
+    return sin(phase * M_PI * 2.0);
 }
 
-float square(double t, double freq) {
-    return sine(t, freq) > 0.0f ? 1.0f : -1.0f;
+float square(double phase) {
+    return phase < 0.5 ? 1.0f : -1.0f;
 }
 
-float triangle(double t, double freq) {
-    return abs(saw(t, freq)) * 2.0f - 1.0f;
+float triangle(double phase) {
+    return abs(saw(phase)) * 2.0f - 1.0f;
 }
 
 // Maps waveform enum to wave function
@@ -160,9 +497,10 @@ WaveFunc waveFuncs[W_Count] = {
 // Utilities
 // ========
 
-// MIDI pitch to frequency
-float pitch(float p) {
-    return powf(1.059460646483f, p - 69.0f) * 440.0f;
+// MIDI pitch to 12-TET frequency. Only used to build the default tuning,
+// voices get theirs from the tuning table.
+double pitch(double p) {
+    return pow(2.0, (p - 69.0) / 12.0) * 440.0;
 }
 
 // Frequency offset for a given voice
@@ -190,19 +528,42 @@ float panToRVol(float pan) {
     return pan > 0.0f ? 1.0f : 1.0f + pan;
 }
 
-// Performs unison detuning on a given wave function
-void doUnisonDetune(float& lOut, float& rOut, double t, double freq, WaveFunc waveFunc) {
+// Per unison voice pitch ratios and pan gains. Worked out once a block
+// rather than for every sample.
+float unisonRatios[MAX_UNISON];
+float unisonLVols[MAX_UNISON];
+float unisonRVols[MAX_UNISON];
+
+void updateUnisonTables() {
+    unisonOrder = (int)clamp(unisonOrder, 1, MAX_UNISON);
+
     for (int i = 0; i < unisonOrder; i++) {
         // For the cool effect mentioned above, should be unisonDetuneAmount / unisonOrder
-        float voiceSample;
         if (!goofyUnison)
-            voiceSample = waveFunc(t, freq + (freq * getDetune(i, unisonDetuneAmount)));
+            unisonRatios[i] = 1.0f + getDetune(i, unisonDetuneAmount);
         else
-            voiceSample = waveFunc(t, freq + (freq * getDetune(i, unisonDetuneAmount / unisonOrder)));
+            unisonRatios[i] = 1.0f + getDetune(i, unisonDetuneAmount / unisonOrder);
 
         float pan = getUnisonVoicePan(i);
-        lOut += voiceSample * panToLVol(pan);
-        rOut += voiceSample * panToRVol(pan);
+        unisonLVols[i] = panToLVol(pan);
+        unisonRVols[i] = panToRVol(pan);
+    }
+}
+
+// Advances an oscillator phase by inc cycles, keeping it in 0-1
+double advancePhase(double& phase, double inc) {
+    phase += inc;
+    phase -= floor(phase);
+    return phase;
+}
+
+// Performs unison detuning on a given wave function
+void doUnisonDetune(float& lOut, float& rOut, double* phases, double inc, WaveFunc waveFunc) {
+    for (int i = 0; i < unisonOrder; i++) {
+        float voiceSample = waveFunc(advancePhase(phases[i], inc * unisonRatios[i]));
+
+        lOut += voiceSample * unisonLVols[i];
+        rOut += voiceSample * unisonRVols[i];
     }
 
     lOut /= (float)unisonOrder;
@@ -210,6 +571,436 @@ void doUnisonDetune(float& lOut, float& rOut, double t, double freq, WaveFunc wa
 }
 
 
+// Resource arena
+// ==============
+// Memory for things the audio thread reads but other threads make and
+// throw away (tuning tables now, wavetables, delay lines and samples
+// later). It's all carved out of one block that gets grabbed and touched
+// up front, so the audio thread never page faults on it.
+// The audio thread never frees anything itself. When it's done with a
+// resource it retires it, and the housekeeping thread frees it (and runs
+// its destructor) a little later.
+
+// Every block starts with one of these and is a power of two in size
+struct alignas(64) ArenaBlock {
+    int sizeClass;
+    void (*destroy)(void*);
+    ArenaBlock* nextFree;
+};
+
+const static int ARENA_MIN_CLASS = 7;
+const static int ARENA_MAX_CLASS = 40;
+// How long retired resources hang around before being freed. Threads
+// other than the audio thread can peek at them (note on reads the tuning
+// table), this gives them plenty of time to finish.
+const double ARENA_GRACE_SECONDS = 0.25;
+
+struct ResourceArena {
+    uint8_t* base = nullptr;
+    size_t size = 0;
+    size_t used = 0;
+    bool hugePages = false;
+    ArenaBlock* freeLists[ARENA_MAX_CLASS + 1] = {};
+    std::mutex mutex;
+};
+
+ResourceArena arena;
+size_t arenaMegabytes = 64;
+bool arenaHugePages = false;
+
+// Filled by the audio thread, drained by housekeeping
+SpscRing<void*, 1024> retireQueue;
+// Retired while the queue was full. They're leaked rather than freed on
+// the audio thread.
+std::atomic<int> arenaLeaks { 0 };
+
+bool arenaInit(size_t size, bool hugePages) {
+    void* mem = nullptr;
+
+#ifdef __linux__
+    if (hugePages) {
+        const size_t hugePageSize = 2 << 20;
+        size = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+        mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            arena.hugePages = true;
+        } else {
+            // None reserved, transparent huge pages are the next best thing
+            fprintf(stderr, "no huge pages reserved, asking for transparent ones\n");
+            mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem != MAP_FAILED)
+                madvise(mem, size, MADV_HUGEPAGE);
+        }
+    } else {
+        mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (mem == MAP_FAILED)
+        mem = nullptr;
+#elif defined(_WIN32)
+    mem = _aligned_malloc(size, 64);
+#else
+    mem = aligned_alloc(64, size);
+#endif
+
+    if (!mem) {
+        fprintf(stderr, "failed to allocate %zu byte arena\n", size);
+        return false;
+    }
+
+    // Touch every page now rather than on the audio thread
+    memset(mem, 0, size);
+#ifdef __linux__
+    // Not allowed much without privileges, so failing is fine
+    mlock(mem, size);
+#endif
+
+    arena.base = (uint8_t*)mem;
+    arena.size = size;
+    printf("arena: %zu MB%s\n", size >> 20, arena.hugePages ? " (huge pages)" : "");
+    return true;
+}
+
+// Not for the audio thread
+void* arenaAlloc(size_t bytes, void (*destroy)(void*) = nullptr) {
+    int sizeClass = ARENA_MIN_CLASS;
+    while (((size_t)1 << sizeClass) < bytes + sizeof(ArenaBlock)) {
+        if (++sizeClass > ARENA_MAX_CLASS)
+            return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(arena.mutex);
+    ArenaBlock* block = arena.freeLists[sizeClass];
+    if (block) {
+        arena.freeLists[sizeClass] = block->nextFree;
+    } else {
+        // Blocks are aligned to their own size so big tables sit nicely
+        // on (huge) page boundaries
+        size_t blockSize = (size_t)1 << sizeClass;
+        size_t start = (arena.used + blockSize - 1) & ~(blockSize - 1);
+        if (start + blockSize > arena.size) {
+            fprintf(stderr, "arena full, couldn't find %zu bytes\n", bytes);
+            return nullptr;
+        }
+
+        block = (ArenaBlock*)(arena.base + start);
+        block->sizeClass = sizeClass;
+        arena.used = start + blockSize;
+    }
+
+    block->destroy = destroy;
+    block->nextFree = nullptr;
+    return block + 1;
+}
+
+// Destroys and frees straight away. Not for the audio thread, which
+// should use arenaRetire.
+void arenaFree(void* p) {
+    if (!p)
+        return;
+
+    ArenaBlock* block = (ArenaBlock*)p - 1;
+    if (block->destroy)
+        block->destroy(p);
+
+    std::lock_guard<std::mutex> lock(arena.mutex);
+    block->nextFree = arena.freeLists[block->sizeClass];
+    arena.freeLists[block->sizeClass] = block;
+}
+
+template <typename T, typename... Args>
+T* arenaNew(Args&&... args) {
+    static_assert(alignof(T) <= alignof(ArenaBlock), "arena blocks are only 64 byte aligned");
+    void* p = arenaAlloc(sizeof(T), [](void* obj) { ((T*)obj)->~T(); });
+    return p ? new (p) T(std::forward<Args>(args)...) : nullptr;
+}
+
+// Audio thread only. Hands something back once nothing on the audio
+// thread points at it any more.
+void arenaRetire(void* p) {
+    if (p && !retireQueue.push(p))
+        arenaLeaks++;
+}
+
+// Frees whatever's been retired for long enough. Returns false once
+// there's nothing left waiting.
+bool arenaCollect(std::vector<std::pair<double, void*>>& waiting, double now) {
+    void* p;
+    while (retireQueue.pop(p)) {
+        waiting.push_back({ now, p });
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < waiting.size(); i++) {
+        if (now - waiting[i].first >= ARENA_GRACE_SECONDS)
+            arenaFree(waiting[i].second);
+        else
+            waiting[kept++] = waiting[i];
+    }
+
+    waiting.resize(kept);
+    return !waiting.empty();
+}
+
+// Tuning
+// ======
+// Voices read their phase increment (cycles per sample) straight out of a
+// 128 entry table. It only gets rebuilt when the tuning or sample rate
+// changes, so there's no pow() anywhere near note on or the audio loop.
+// Tunings come from Scala .scl/.kbm files, 12-TET otherwise.
+
+struct TuningTable {
+    double freq[128];
+    double increment[128];
+    // Different for every table built, so the audio thread can tell a new one
+    uint32_t serial;
+};
+
+struct ScalaTuning {
+    std::string name;
+    // Ratio of each scale degree to 1/1. The last one is the period.
+    std::vector<double> ratios;
+
+    // Keyboard mapping, .kbm style. An empty map maps keys to degrees
+    // one to one.
+    int firstNote = 0;
+    int lastNote = 127;
+    int middleNote = 60;
+    int referenceNote = 60;
+    double referenceFreq = 261.6255653;
+    int octaveDegree = 0;
+    // -1 for keys that don't sound
+    std::vector<int> keyMap;
+};
+
+// Tables live in the arena. A new one waits in pendingTuning until the
+// audio thread swaps it in at the top of a block and retires the old one.
+std::atomic<TuningTable*> currentTuning { nullptr };
+std::atomic<TuningTable*> pendingTuning { nullptr };
+std::mutex tuningMutex;
+uint32_t tuningSerial = 0;
+std::string sclPath;
+std::string kbmPath;
+
+// Pulls the next line that isn't a comment. Scala comments start with !
+bool scalaNextLine(FILE* f, char* line, int len) {
+    while (fgets(line, len, f)) {
+        if (line[0] != '!')
+            return true;
+    }
+
+    return false;
+}
+
+bool loadScl(const char* path, ScalaTuning& tuning) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "couldn't open scale %s\n", path);
+        return false;
+    }
+
+    char line[512];
+    int count = 0;
+    std::vector<double> ratios;
+
+    bool ok = scalaNextLine(f, line, sizeof(line));
+    if (ok) {
+        line[strcspn(line, "\r\n")] = 0;
+        tuning.name = line;
+        ok = scalaNextLine(f, line, sizeof(line)) && sscanf(line, "%i", &count) == 1 && count > 0;
+    }
+
+    while (ok && (int)ratios.size() < count && scalaNextLine(f, line, sizeof(line))) {
+        char* val = line + strspn(line, " \t");
+        int valLen = strcspn(val, " \t\r\n");
+
+        // Anything with a dot is in cents, otherwise it's a ratio
+        if (memchr(val, '.', valLen)) {
+            ratios.push_back(pow(2.0, atof(val) / 1200.0));
+        } else {
+            long num = 0, den = 1;
+            if (sscanf(val, "%li/%li", &num, &den) < 1 || num <= 0 || den <= 0) {
+                ok = false;
+                break;
+            }
+            ratios.push_back((double)num / den);
+        }
+    }
+
+    fclose(f);
+
+    if (!ok || (int)ratios.size() != count) {
+        fprintf(stderr, "bad scale file %s\n", path);
+        return false;
+    }
+
+    tuning.ratios = ratios;
+    return true;
+}
+
+bool loadKbm(const char* path, ScalaTuning& tuning) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "couldn't open keyboard map %s\n", path);
+        return false;
+    }
+
+    char line[512];
+    int header[7] = {};
+    double refFreq = 0.0;
+    bool ok = true;
+
+    // Map size, first note, last note, middle note, reference note,
+    // reference frequency, octave degree
+    for (int i = 0; i < 7 && ok; i++) {
+        ok = scalaNextLine(f, line, sizeof(line));
+        if (ok && i == 5)
+            ok = sscanf(line, "%lf", &refFreq) == 1;
+        else if (ok)
+            ok = sscanf(line, "%i", &header[i]) == 1;
+    }
+
+    std::vector<int> keyMap;
+    while (ok && (int)keyMap.size() < header[0] && scalaNextLine(f, line, sizeof(line))) {
+        char* val = line + strspn(line, " \t");
+        keyMap.push_back(*val == 'x' ? -1 : atoi(val));
+    }
+
+    fclose(f);
+
+    if (!ok || (int)keyMap.size() != header[0] || refFreq <= 0.0) {
+        fprintf(stderr, "bad keyboard map %s\n", path);
+        return false;
+    }
+
+    tuning.keyMap = keyMap;
+    tuning.firstNote = header[1];
+    tuning.lastNote = header[2];
+    tuning.middleNote = header[3];
+    tuning.referenceNote = header[4];
+    tuning.referenceFreq = refFreq;
+    tuning.octaveDegree = header[6];
+    return true;
+}
+
+int floorDiv(int a, int b) {
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+}
+
+// Ratio of any scale degree to 1/1, including ones past the period
+double scaleDegreeRatio(const ScalaTuning& tuning, int degree) {
+    int size = tuning.ratios.size();
+    int periods = floorDiv(degree, size);
+    int idx = degree - periods * size;
+    double ratio = idx == 0 ? 1.0 : tuning.ratios[idx - 1];
+
+    return ratio * pow(tuning.ratios[size - 1], periods);
+}
+
+// Ratio of a key to 1/1, or 0 if it's unmapped
+double keyRatio(const ScalaTuning& tuning, int note) {
+    int offset = note - tuning.middleNote;
+
+    if (tuning.keyMap.empty())
+        return scaleDegreeRatio(tuning, offset);
+
+    int mapSize = tuning.keyMap.size();
+    int repeats = floorDiv(offset, mapSize);
+    int degree = tuning.keyMap[offset - repeats * mapSize];
+    if (degree < 0)
+        return 0.0;
+
+    int octaveDegree = tuning.octaveDegree > 0 ? tuning.octaveDegree : tuning.ratios.size();
+    return scaleDegreeRatio(tuning, degree) * pow(scaleDegreeRatio(tuning, octaveDegree), repeats);
+}
+
+ScalaTuning equalTemperament() {
+    ScalaTuning tuning;
+    tuning.name = "12-TET";
+    for (int i = 1; i <= 12; i++) {
+        tuning.ratios.push_back(pow(2.0, i / 12.0));
+    }
+    tuning.referenceFreq = pitch(60);
+    return tuning;
+}
+
+ScalaTuning activeTuning = equalTemperament();
+
+// Compiles a tuning into a fresh table for the audio thread to pick up.
+// Not for the audio thread.
+void rebuildTuningTable(const ScalaTuning& tuning, int sampleRate) {
+    std::lock_guard<std::mutex> lock(tuningMutex);
+
+    TuningTable* next = arenaNew<TuningTable>();
+    if (!next)
+        return;
+    next->serial = ++tuningSerial;
+
+    double refRatio = keyRatio(tuning, tuning.referenceNote);
+    if (refRatio <= 0.0) {
+        fprintf(stderr, "tuning reference note %i isn't mapped\n", tuning.referenceNote);
+        refRatio = 1.0;
+    }
+
+    for (int n = 0; n < 128; n++) {
+        double freq = 0.0;
+        if (n >= tuning.firstNote && n <= tuning.lastNote)
+            freq = tuning.referenceFreq * keyRatio(tuning, n) / refRatio;
+
+        // Keep everything below nyquist, unmapped keys just stay silent
+        freq = min(freq, sampleRate * 0.5);
+        next->freq[n] = freq;
+        next->increment[n] = freq / sampleRate;
+    }
+
+    activeTuning = tuning;
+
+    // Before the audio starts there's nobody to hand it over to
+    if (!currentTuning) {
+        currentTuning = next;
+        return;
+    }
+
+    // One the audio thread never got round to can go straight away
+    arenaFree(pendingTuning.exchange(next));
+}
+
+// (Re)loads the tuning from sclPath and kbmPath, 12-TET if they're empty
+bool loadTuning() {
+    ScalaTuning tuning = equalTemperament();
+
+    if (!sclPath.empty() && !loadScl(sclPath.c_str(), tuning))
+        return false;
+
+    if (!kbmPath.empty() && !loadKbm(kbmPath.c_str(), tuning))
+        return false;
+
+    rebuildTuningTable(tuning, currentSampleRate);
+    printf("tuning: %s (%i notes)\n", tuning.name.c_str(), (int)tuning.ratios.size());
+    return true;
+}
+
+// Notes outside MIDI range (octave stacking can push them there) get
+// folded back in by octaves
+int tuningIndex(int note) {
+    while (note > 127)
+        note -= 12;
+    while (note < 0)
+        note += 12;
+
+    return note;
+}
+
+// Everything that depends on the sample rate gets updated from here
+void sizeStringLines(int rate);
+
+void setSampleRate(int rate) {
+    currentSampleRate = rate;
+    sizeStringLines(rate);
+    rebuildTuningTable(activeTuning, rate);
+}
+
+
 // Polyphonic voice utilities
 // ==========================
 int getFreeVoiceIdx() {
@@ -230,6 +1021,15 @@ int getVoiceWithNote(int note) {
     return -1;
 }
 
+bool anyVoiceActive() {
+    for (int i = 0; i < NUM_VOICES; i++) {
+        if (!voices[i].finishedPlaying)
+            return true;
+    }
+
+    return false;
+}
+
 bool noteAlreadyDown(int note) {
     for (int i = 0; i < NUM_VOICES; i++) {
         if (voices[i].volume > 0.0 && voices[i].note == note)
@@ -252,33 +1052,19 @@ float compressor(float& accum, float val, float magic) {
     return (1.0 - peak) * val;
 }
 
-// Core synth function!
-// Generates a pair of audio samples for a given voice index.
-float lLpAccum = 0.0f;
-float rLpAccum = 0.0f;
-void getVoiceSample(float& lOut, float& rOut, int voiceIdx, double sampleTime) {
-    auto& v = voices[voiceIdx];
-    double freq = pitch(v.note + pitchBendAmt);
-
-    lOut = 0.0f;
-    rOut = 0.0f;
-    if (v.finishedPlaying) {
-        return;
-    }
-
-    double waveSamp = 0.0;
-
-    if (unisonDetune) {
-        doUnisonDetune(lOut, rOut, sampleTime, freq, waveFuncs[currWaveFunc]);
-    } else {
-        lOut = waveFuncs[currWaveFunc](sampleTime,  freq);
-        rOut = lOut;
-    }
+// Set up at the start of every block
+TuningTable* blockTuning = nullptr;
+double blockBendRatio = 1.0;
 
+// Envelope level of a voice at sampleTime. Marks the voice finished once
+// its release is over.
+double voiceEnvelope(PolyphonicVoice& v, double sampleTime) {
     double attenuation = 1.0;
     ADSRCurve curve;
 
-    if (v.volume > 0.25) {
+    // Releases can be stamped later on in the block (sequencer steps),
+    // so keep going with the ADS part until we actually get there
+    if (v.volume > 0.25 || sampleTime < v.releaseTime) {
         attenuation = getADSAttenuation(curve, sampleTime - v.pressTime);
     } else {
         attenuation = getRAttenuation(curve, sampleTime - v.releaseTime);
@@ -287,75 +1073,2999 @@ void getVoiceSample(float& lOut, float& rOut, int voiceIdx, double sampleTime) {
         }
     }
 
-    lOut *= attenuation;
-    rOut *= attenuation;
+    return attenuation;
+}
+
+// The parameters voices read every sample, at each frame of this block.
+// Flat unless they're ramping.
+float volumeCurve[MAX_BLOCK];
+float crushCurve[MAX_BLOCK];
+float lpQCurve[MAX_BLOCK];
+double bendCurve[MAX_BLOCK];
 
-    lOut *= volume;
-    rOut *= volume;
+// Master volume and the per-voice effects, for frame i of the block
+void voiceEffects(float& lOut, float& rOut, PolyphonicVoice& v, int i) {
+    lOut *= volumeCurve[i];
+    rOut *= volumeCurve[i];
 
     if (enableBitcrush) {
-        lOut = bitcrush(lOut, crushBits);
-        rOut = bitcrush(rOut, crushBits);
+        lOut = bitcrush(lOut, crushCurve[i]);
+        rOut = bitcrush(rOut, crushCurve[i]);
     }
 
     if (lpEnabled) {
-        lOut = lowpass(lLpAccum, lOut, lpQ);
-        rOut = lowpass(rLpAccum, rOut, lpQ);
+        lOut = lowpass(v.lpAccumL, lOut, lpQCurve[i]);
+        rOut = lowpass(v.lpAccumR, rOut, lpQCurve[i]);
     }
 
     if (enableCompressor) {
-        lOut = compressor(lLpAccum, lOut, 0.05);
-        rOut = compressor(rLpAccum, rOut, 0.05);
+        lOut = compressor(v.lpAccumL, lOut, 0.05);
+        rOut = compressor(v.lpAccumR, rOut, 0.05);
     }
 }
 
-int currentSampleRate = 44100;
-int bufSize = 512;
+// Core synth function!
+// Generates a pair of audio samples for a given voice index, at frame i
+// of the block.
+void getVoiceSample(float& lOut, float& rOut, int voiceIdx, int i, double sampleTime) {
+    auto& v = voices[voiceIdx];
+
+    lOut = 0.0f;
+    rOut = 0.0f;
+    if (v.finishedPlaying) {
+        return;
+    }
+
+    double inc = blockTuning->increment[tuningIndex(v.note)] * bendCurve[i] * v.bendRatio;
+
+    if (unisonDetune) {
+        doUnisonDetune(lOut, rOut, v.phase, inc, waveFuncs[currWaveFunc]);
+    } else {
+        lOut = waveFuncs[currWaveFunc](advancePhase(v.phase[0], inc));
+        rOut = lOut;
+    }
 
-float lastBufferL[1024];
-float lastBufferR[1024];
+    double attenuation = voiceEnvelope(v, sampleTime);
+    lOut *= attenuation;
+    rOut *= attenuation;
+
+    voiceEffects(lOut, rOut, v, i);
+}
+
+// The scope shows one device buffer, up to this much of it
+const static int SCOPE_FRAMES = 1024;
+float lastBufferL[SCOPE_FRAMES];
+float lastBufferR[SCOPE_FRAMES];
 
 int nChannels = 2;
-void audioCallback(void*, Uint8* data, int len) {
-    float* stream = (float*)data;
-    int sampleLen = len / sizeof(float);
-    hasClipped = false;
-    maxAmplitude = 0.0f;
 
-    for (int i = 0; i < sampleLen; i += nChannels) {
-        double sampleTime = (i / nChannels / (double)currentSampleRate) + timeAccumulator;
-        stream[i] = 0.0;
-        stream[i + 1] = 0.0;
 
-        for (int j = 0; j < NUM_VOICES; j++) {
-            // oversampling
+// Output bus
+// ==========
+// Voices mix into a planar bus with one buffer per speaker, and only get
+// interleaved into the device's format at the very end. Each voice is
+// panned with constant power between the pair of speakers either side of
+// it, with the gains worked out once a block.
+
+float outBusStorage[MAX_CHANNELS][MAX_BLOCK];
+// Normally points at outBusStorage. Backends with planar buffers of their
+// own (JACK) point it straight at those for the length of a block.
+float* outBus[MAX_CHANNELS];
+float voiceBufL[MAX_BLOCK];
+float voiceBufR[MAX_BLOCK];
+
+struct SpeakerLayout {
+    const char* name;
+    int channels;
+    // Degrees, 0 is ahead and negative is left. Ignored for the LFE.
+    float azimuth[MAX_CHANNELS];
+    int lfe;
+    // Speakers go all the way round, so panning wraps behind the listener
+    bool ring;
+};
+
+// Indexed by channel count, in SDL's channel order
+const SpeakerLayout speakerLayouts[MAX_CHANNELS + 1] = {
+    { "none", 0, {}, -1, false },
+    { "mono", 1, { 0 }, -1, false },
+    { "stereo", 2, { -30, 30 }, -1, false },
+    { "2.1", 3, { -30, 30, 0 }, 2, false },
+    { "quad", 4, { -45, 45, -135, 135 }, -1, true },
+    { "4.1", 5, { -45, 45, 0, -135, 135 }, 2, true },
+    { "5.1", 6, { -30, 30, 0, 0, -110, 110 }, 3, true },
+    { "6.1", 7, { -30, 30, 0, 0, 180, -90, 90 }, 3, true },
+    { "7.1", 8, { -30, 30, 0, 0, -150, 150, -90, 90 }, 3, true }
+};
 
-            float l, r;
-            getVoiceSample(l, r, j, sampleTime);
-            l *= 0.25f;
-            r *= 0.25f;
-            stream[i] += l;
-            stream[i + 1] += r;
-        } 
+const SpeakerLayout* speakers = &speakerLayouts[2];
 
-        lastBufferL[i / nChannels] = stream[i];
-        lastBufferR[i / nChannels] = stream[i + 1];
+// How far apart a voice's left and right halves get spread, in degrees.
+// At 30 a centred voice lands exactly on a stereo pair.
+float stereoWidth = 30.0f;
+// Voices get dealt out over this many degrees as they start. 0 keeps them
+// all in the middle, 360 goes right round a ring.
+float voiceSpread = 0.0f;
+int nextPanSlot = 0;
 
-        if (stream[i] > 1.0 || stream[i] < -1.0) {
-            hasClipped = true;
-        }
+float wrapDegrees(float deg) {
+    return deg - 360.0f * floorf((deg + 180.0f) / 360.0f);
+}
 
-        maxAmplitude = max(abs(stream[i]), maxAmplitude);
+void setChannelCount(int channels) {
+    nChannels = channels;
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        outBus[ch] = outBusStorage[ch];
     }
 
-    timeAccumulator += sampleLen / nChannels / (double)currentSampleRate;
+    speakers = &speakerLayouts[(int)clamp(channels, 1, MAX_CHANNELS)];
+    printf("speaker layout: %s\n", speakers->name);
 }
 
-const std::unordered_map<SDL_Scancode, int> freqs = {
-    { SDL_SCANCODE_Z, 48 },
-    { SDL_SCANCODE_S, 49 },
-    { SDL_SCANCODE_X, 50 },
-    { SDL_SCANCODE_D, 51 },
+// Constant power gains for a source at the given azimuth. Only the pair of
+// speakers either side of it get any signal.
+void computePanGains(float azimuth, float* gains) {
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        gains[ch] = 0.0f;
+    }
+
+    // Fold down to mono at half gain so both halves of a voice add up to
+    // what each stereo side would have got
+    if (speakers->channels == 1) {
+        gains[0] = 0.5f;
+        return;
+    }
+
+    azimuth = wrapDegrees(azimuth);
+
+    int lower = -1, upper = -1;
+    float lowerDist = 360.0f, upperDist = 360.0f;
+
+    for (int ch = 0; ch < speakers->channels; ch++) {
+        if (ch == speakers->lfe)
+            continue;
+
+        // How far round (positive direction) this speaker is from us, and
+        // the other way
+        float ahead = speakers->ring ? wrapDegrees(speakers->azimuth[ch] - azimuth) : speakers->azimuth[ch] - azimuth;
+        if (ahead >= 0.0f && ahead < upperDist) {
+            upper = ch;
+            upperDist = ahead;
+        }
+        if (ahead <= 0.0f && -ahead < lowerDist) {
+            lower = ch;
+            lowerDist = -ahead;
+        }
+    }
+
+    // Past the end of a front-only layout, just stick to the last speaker
+    if (lower < 0 || upper < 0 || lower == upper) {
+        gains[lower >= 0 ? lower : upper] = 1.0f;
+        return;
+    }
+
+    float frac = lowerDist / (lowerDist + upperDist);
+    gains[lower] = cosf(frac * M_PI * 0.5f);
+    gains[upper] = sinf(frac * M_PI * 0.5f);
+}
+
+// String voices
+// =============
+// Plucked and bowed strings as digital waveguides. Voices are split into
+// groups of eight, and each group keeps its delay lines lane-interleaved
+// (sample n of lane k lives at [n * 8 + k]) so all eight strings advance
+// in one SIMD step. Every lane reads back from its own distance, which
+// AVX2 can gather in one go. Without AVX2 the lanes take turns.
+// Pitch comes from the delay length, with the fractional part done by a
+// first order allpass so it doesn't dull the string. The loop filter is a
+// one-pole lowpass with its cutoff a fixed number of harmonics up,
+// followed by a loss gain that makes the fundamental take stringDecay to
+// die away whatever the note.
+// Plucks get a burst of noise one period long at the note on. Bowed
+// strings split the loop at the bow into a bridge side and a neck side,
+// and use the bow table from the STK's Bowed model with the bow speed
+// following the voice's envelope.
+
+const static int STRING_LANES = 8;
+const static int STRING_GROUPS = NUM_VOICES / STRING_LANES;
+static_assert(NUM_VOICES % STRING_LANES == 0, "string groups need whole lanes");
+// Per lane, enough for MIDI note 0 (8.18Hz) at 192k. Only as much of it
+// as the rate needs is used, see sizeStringLines, so notes don't get
+// clamped short and play sharp at high rates. Bends below note 0 still do.
+const static int STRING_MAX_DELAY = 32768;
+const static int STRING_MAX_RATE = 192000;
+// Power of two in use for the current rate
+int stringDelay = 8192;
+// Where the bow sits, as a fraction of the string from the bridge
+const float BOW_POSITION = 0.127236f;
+const float EXCITE_LEVEL = 1.0f;
+// Most of a noise burst is gone after a few trips round the loop, so
+// plucks need a lift to sit level with the oscillators
+const float PLUCK_LEVEL = 3.0f;
+const float BOWED_LEVEL = 2.0f;
+
+// Seconds for a string to die away by 60dB once nothing's driving it
+float stringDecay = 4.0f;
+// Loop lowpass cutoff, in harmonics of the note
+float stringBrightness = 8.0f;
+float bowSpeed = 0.25f;
+
+// One delay line's worth of per-lane read state
+struct alignas(32) StringTap {
+    // Whole samples back, and the allpass that makes up the rest
+    int32_t whole[8];
+    float coef[8];
+    float state[8];
+};
+
+struct alignas(32) StringGroup {
+    // Bridge side of the bow, or the whole string for plucks
+    StringTap tapA;
+    // Neck side, bowed only
+    StringTap tapB;
+    float loss[8];
+    float damping[8];
+    float lpState[8];
+    // DC blocker on the way out, the noise bursts leave some in the loop
+    float dcIn[8];
+    float dcOut[8];
+    // Multiplies the lane's output, envelope included
+    float level[8];
+    uint32_t rng[8];
+    // Bursts of noise still to go into the plucks, as a range of samples
+    // from the start of the block
+    int32_t exciteStart[8];
+    int32_t exciteEnd[8];
+    int32_t bowed[8];
+    float* lineA;
+    float* lineB;
+    unsigned writePos;
+    float dcCoef;
+};
+
+StringGroup stringGroups[STRING_GROUPS];
+// Lane interleaved like the delay lines. One per group so the groups can
+// render at the same time.
+alignas(32) float stringEnv[STRING_GROUPS][MAX_BLOCK][STRING_LANES];
+alignas(32) float stringOut[STRING_GROUPS][MAX_BLOCK][STRING_LANES];
+
+// Delay lines come out of the arena, so after arenaInit
+// Smallest power of two that holds a period of note 0 at this rate, so
+// there's no more to clear at each note on than needed
+void sizeStringLines(int rate) {
+    double need = min(rate, STRING_MAX_RATE) / 8.1758 + 4.0;
+    stringDelay = 8192;
+    while (stringDelay < need && stringDelay < STRING_MAX_DELAY)
+        stringDelay *= 2;
+}
+
+void initStrings() {
+    size_t lineBytes = sizeof(float) * STRING_MAX_DELAY * STRING_LANES;
+    for (int g = 0; g < STRING_GROUPS; g++) {
+        auto& sg = stringGroups[g];
+        sg.lineA = (float*)arenaAlloc(lineBytes);
+        sg.lineB = (float*)arenaAlloc(lineBytes);
+        if (!sg.lineA || !sg.lineB) {
+            fprintf(stderr, "no room for string delay lines\n");
+            sg.lineA = sg.lineB = nullptr;
+            continue;
+        }
+
+        memset(sg.lineA, 0, lineBytes);
+        memset(sg.lineB, 0, lineBytes);
+        for (int k = 0; k < STRING_LANES; k++) {
+            sg.rng[k] = 0x9e3779b9u * (g * STRING_LANES + k + 1);
+        }
+    }
+}
+
+// Sets a tap up to read delay samples back. Keeps the allpass's part
+// between 0.5 and 1.5 samples, where it behaves.
+void setStringTap(StringTap& tap, int lane, float delay) {
+    int whole = (int)(delay - 0.5f);
+    float frac = delay - whole;
+    tap.whole[lane] = whole;
+    tap.coef[lane] = (1.0f - frac) / (1.0f + frac);
+}
+
+float stringRead(const float* line, unsigned writePos, StringTap& tap, int lane) {
+    const unsigned mask = stringDelay - 1;
+    int whole = tap.whole[lane];
+    float x0 = line[((writePos - whole) & mask) * STRING_LANES + lane];
+    float x1 = line[((writePos - whole - 1) & mask) * STRING_LANES + lane];
+    float y = tap.coef[lane] * (x0 - tap.state[lane]) + x1;
+    tap.state[lane] = y;
+    return y;
+}
+
+// Friction between the bow and string for a given difference in speed
+float bowTable(float deltaV) {
+    float x = fabsf((deltaV + 0.001f) * 3.0f) + 0.75f;
+    float x2 = x * x;
+    return fminf(1.0f / (x2 * x2), 1.0f);
+}
+
+void stringGroupRenderScalar(StringGroup& g, int frames, const float (*env)[STRING_LANES], float (*out)[STRING_LANES]) {
+    const unsigned mask = stringDelay - 1;
+    for (int i = 0; i < frames; i++) {
+        unsigned w = (g.writePos + i) & mask;
+        for (int k = 0; k < STRING_LANES; k++) {
+            uint32_t& x = g.rng[k];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            float excite = 0.0f;
+            if (i >= g.exciteStart[k] && i < g.exciteEnd[k])
+                excite = (int32_t)x * (EXCITE_LEVEL / 2147483648.0f);
+
+            float bridge = stringRead(g.lineA, w, g.tapA, k);
+            float neck = stringRead(g.lineB, w, g.tapB, k);
+            float& lp = g.lpState[k];
+            lp = bridge + g.damping[k] * (lp - bridge);
+            float filtered = lp * g.loss[k];
+
+            if (g.bowed[k]) {
+                float bridgeRefl = -filtered;
+                float nutRefl = -neck;
+                float deltaV = env[i][k] * bowSpeed - (bridgeRefl + nutRefl);
+                float newVel = deltaV * bowTable(deltaV);
+                g.lineA[w * STRING_LANES + k] = nutRefl + newVel;
+                g.lineB[w * STRING_LANES + k] = bridgeRefl + newVel;
+            } else {
+                g.lineA[w * STRING_LANES + k] = filtered + excite;
+                g.lineB[w * STRING_LANES + k] = 0.0f;
+            }
+
+            // Plucks are heard straight away, not a period later
+            float y = filtered + excite;
+            g.dcOut[k] = y - g.dcIn[k] + g.dcCoef * g.dcOut[k];
+            g.dcIn[k] = y;
+            out[i][k] = g.dcOut[k] * g.level[k] * env[i][k];
+        }
+    }
+}
+
+#ifdef __AVX2__
+__m256 stringRead8(const float* line, __m256i writePos, StringTap& tap, __m256& state) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i mask = _mm256_set1_epi32(stringDelay - 1);
+
+    __m256i whole = _mm256_load_si256((__m256i*)tap.whole);
+    __m256i p0 = _mm256_and_si256(_mm256_sub_epi32(writePos, whole), mask);
+    __m256i p1 = _mm256_and_si256(_mm256_sub_epi32(p0, _mm256_set1_epi32(1)), mask);
+    __m256 x0 = _mm256_i32gather_ps(line, _mm256_add_epi32(_mm256_slli_epi32(p0, 3), lanes), 4);
+    __m256 x1 = _mm256_i32gather_ps(line, _mm256_add_epi32(_mm256_slli_epi32(p1, 3), lanes), 4);
+
+    state = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(tap.coef), _mm256_sub_ps(x0, state)), x1);
+    return state;
+}
+
+// Same as the scalar version, all eight lanes at once
+void stringGroupRender(StringGroup& g, int frames, const float (*env)[STRING_LANES], float (*out)[STRING_LANES]) {
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+
+    __m256 loss = _mm256_load_ps(g.loss);
+    __m256 damping = _mm256_load_ps(g.damping);
+    __m256 level = _mm256_load_ps(g.level);
+    __m256 lp = _mm256_load_ps(g.lpState);
+    __m256 stateA = _mm256_load_ps(g.tapA.state);
+    __m256 stateB = _mm256_load_ps(g.tapB.state);
+    __m256 dcIn = _mm256_load_ps(g.dcIn);
+    __m256 dcOut = _mm256_load_ps(g.dcOut);
+    __m256 dcCoef = _mm256_set1_ps(g.dcCoef);
+    __m256i rng = _mm256_load_si256((__m256i*)g.rng);
+    __m256i exciteStart = _mm256_load_si256((__m256i*)g.exciteStart);
+    __m256i exciteEnd = _mm256_load_si256((__m256i*)g.exciteEnd);
+    __m256 bowed = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_load_si256((__m256i*)g.bowed), _mm256_setzero_si256()));
+
+    for (int i = 0; i < frames; i++) {
+        unsigned w = (g.writePos + i) & (stringDelay - 1);
+        __m256i wv = _mm256_set1_epi32(w);
+
+        rng = _mm256_xor_si256(rng, _mm256_slli_epi32(rng, 13));
+        rng = _mm256_xor_si256(rng, _mm256_srli_epi32(rng, 17));
+        rng = _mm256_xor_si256(rng, _mm256_slli_epi32(rng, 5));
+        __m256i iv = _mm256_set1_epi32(i);
+        __m256i inBurst = _mm256_andnot_si256(_mm256_cmpgt_epi32(exciteStart, iv), _mm256_cmpgt_epi32(exciteEnd, iv));
+        __m256 excite = _mm256_mul_ps(_mm256_cvtepi32_ps(rng), _mm256_set1_ps(EXCITE_LEVEL / 2147483648.0f));
+        excite = _mm256_and_ps(excite, _mm256_castsi256_ps(inBurst));
+
+        __m256 bridge = stringRead8(g.lineA, wv, g.tapA, stateA);
+        __m256 neck = stringRead8(g.lineB, wv, g.tapB, stateB);
+
+        lp = _mm256_add_ps(bridge, _mm256_mul_ps(damping, _mm256_sub_ps(lp, bridge)));
+        __m256 filtered = _mm256_mul_ps(lp, loss);
+
+        // Bow, worked out for every lane and only kept for bowed ones
+        __m256 envelope = _mm256_load_ps(env[i]);
+        __m256 bridgeRefl = _mm256_xor_ps(filtered, signBit);
+        __m256 nutRefl = _mm256_xor_ps(neck, signBit);
+        __m256 deltaV = _mm256_sub_ps(_mm256_mul_ps(envelope, _mm256_set1_ps(bowSpeed)), _mm256_add_ps(bridgeRefl, nutRefl));
+        __m256 x = _mm256_add_ps(_mm256_andnot_ps(signBit, _mm256_mul_ps(_mm256_add_ps(deltaV, _mm256_set1_ps(0.001f)), _mm256_set1_ps(3.0f))), _mm256_set1_ps(0.75f));
+        __m256 x2 = _mm256_mul_ps(x, x);
+        __m256 friction = _mm256_min_ps(_mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(x2, x2)), _mm256_set1_ps(1.0f));
+        __m256 newVel = _mm256_mul_ps(deltaV, friction);
+
+        __m256 intoA = _mm256_blendv_ps(_mm256_add_ps(filtered, excite), _mm256_add_ps(nutRefl, newVel), bowed);
+        __m256 intoB = _mm256_and_ps(_mm256_add_ps(bridgeRefl, newVel), bowed);
+        _mm256_store_ps(g.lineA + w * STRING_LANES, intoA);
+        _mm256_store_ps(g.lineB + w * STRING_LANES, intoB);
+
+        __m256 y = _mm256_add_ps(filtered, excite);
+        dcOut = _mm256_add_ps(_mm256_sub_ps(y, dcIn), _mm256_mul_ps(dcCoef, dcOut));
+        dcIn = y;
+        _mm256_store_ps(out[i], _mm256_mul_ps(_mm256_mul_ps(dcOut, level), envelope));
+    }
+
+    _mm256_store_ps(g.lpState, lp);
+    _mm256_store_ps(g.tapA.state, stateA);
+    _mm256_store_ps(g.tapB.state, stateB);
+    _mm256_store_ps(g.dcIn, dcIn);
+    _mm256_store_ps(g.dcOut, dcOut);
+    _mm256_store_si256((__m256i*)g.rng, rng);
+}
+#else
+void stringGroupRender(StringGroup& g, int frames, const float (*env)[STRING_LANES], float (*out)[STRING_LANES]) {
+    stringGroupRenderScalar(g, frames, env, out);
+}
+#endif
+
+// Gets one group's lanes ready for this block (new notes, pitch, envelope)
+// and runs it if anything's playing
+void renderStringGroup(int gi, int frames, double blockTime) {
+    auto& g = stringGroups[gi];
+    float (*env)[STRING_LANES] = stringEnv[gi];
+    bool anyPlaying = false;
+    if (!g.lineA)
+        return;
+
+    // About 10Hz
+    g.dcCoef = 1.0f - 2.0f * M_PI * 10.0f / currentSampleRate;
+
+    for (int k = 0; k < STRING_LANES; k++) {
+        auto& v = voices[gi * STRING_LANES + k];
+        if (v.finishedPlaying || (v.model != V_Pluck && v.model != V_Bowed)) {
+            // Let whatever's left in the line die off
+            g.loss[k] = 0.0f;
+            g.exciteStart[k] = g.exciteEnd[k] = 0;
+            for (int i = 0; i < frames; i++) {
+                env[i][k] = 0.0f;
+            }
+            continue;
+        }
+
+        anyPlaying = true;
+
+        // The line length is set once a block, so a bend ramp moves strings
+        // in block sized steps. Taken from the middle of the block so
+        // they're centred on the ramp.
+        double inc = blockTuning->increment[tuningIndex(v.note)] * bendCurve[frames / 2] * v.bendRatio;
+        float period = inc > 0.0 ? 1.0 / inc : stringDelay;
+
+        // The lowpass delays and quietens the fundamental a little on
+        // every trip round, so take that off the line length and make
+        // it up in the loss. The loss has to stay under 1 for DC, so
+        // high notes, where there's not much room between DC and the
+        // fundamental, get a gentler lowpass.
+        float w0 = 2.0f * M_PI / period;
+        float targetLoss = powf(10.0f, -3.0f / (stringDecay * currentSampleRate / period));
+        float a = expf(-min(2.0f * M_PI * stringBrightness / period, M_PI * 0.9f));
+        float lpGain = 1.0f;
+        for (int tries = 0; tries < 16; tries++) {
+            lpGain = (1.0f - a) / sqrtf(1.0f - 2.0f * a * cosf(w0) + a * a);
+            if (lpGain * 0.99999f >= targetLoss)
+                break;
+            a *= 0.7f;
+        }
+        float lpDelay = atan2f(a * sinf(w0), 1.0f - a * cosf(w0)) / w0;
+        float loop = clamp(period - lpDelay, 3.0f, stringDelay - 2.0f);
+
+        g.bowed[k] = v.model == V_Bowed;
+        g.damping[k] = a;
+        g.loss[k] = min(targetLoss / lpGain, 0.99999f);
+        g.level[k] = g.bowed[k] ? BOWED_LEVEL : PLUCK_LEVEL;
+        if (g.bowed[k]) {
+            float bridgeSide = max(loop * BOW_POSITION, 1.5f);
+            setStringTap(g.tapA, k, bridgeSide);
+            setStringTap(g.tapB, k, max(loop - bridgeSide, 1.5f));
+        } else {
+            setStringTap(g.tapA, k, loop);
+            setStringTap(g.tapB, k, 1.5f);
+        }
+
+        // A new note starts from a still string
+        if (v.stringStart) {
+            v.stringStart = false;
+            for (int n = 0; n < stringDelay; n++) {
+                g.lineA[n * STRING_LANES + k] = 0.0f;
+                g.lineB[n * STRING_LANES + k] = 0.0f;
+            }
+            g.lpState[k] = 0.0f;
+            g.tapA.state[k] = g.tapB.state[k] = 0.0f;
+            g.dcIn[k] = g.dcOut[k] = 0.0f;
+
+            int start = (int)ceil((v.pressTime - blockTime) * currentSampleRate);
+            g.exciteStart[k] = max(start, 0);
+            g.exciteEnd[k] = g.bowed[k] ? g.exciteStart[k] : g.exciteStart[k] + (int)period;
+        }
+
+        for (int i = 0; i < frames; i++) {
+            double sampleTime = blockTime + i / (double)currentSampleRate;
+            env[i][k] = voiceEnvelope(v, sampleTime);
+        }
+    }
+
+    if (!anyPlaying)
+        return;
+
+    stringGroupRender(g, frames, env, stringOut[gi]);
+
+    g.writePos = (g.writePos + frames) & (stringDelay - 1);
+    for (int k = 0; k < STRING_LANES; k++) {
+        g.exciteStart[k] = max(g.exciteStart[k] - frames, 0);
+        g.exciteEnd[k] = max(g.exciteEnd[k] - frames, 0);
+    }
+}
+
+void renderStrings(int frames, double blockTime) {
+    for (int gi = 0; gi < STRING_GROUPS; gi++) {
+        renderStringGroup(gi, frames, blockTime);
+    }
+}
+
+// Samples
+// =======
+// One sample played across the keyboard by the sample voice model
+// (--sample file.wav). It's held in memory as 16 or 24-bit PCM rather than
+// float, half to three quarters the size, and every playing voice gets a
+// small float ring that a decoder thread keeps filled ahead of it. If the
+// decoder falls behind the voice decodes what it needs itself, so the
+// output is the same either way, offline too. Ring positions count frames
+// into the note with the loop already unrolled, so loop points land on the
+// exact sample whatever the pitch.
+
+// Frames per voice, about 170ms at 48k
+const static int SAMPLE_RING = 8192;
+const static int SAMPLE_CHUNK = 1024;
+const uint64_t STREAM_FRAMES = (1ull << 48) - 1;
+
+struct SampleData {
+    int frames;
+    int channels;
+    // 2 or 3, little endian
+    int bytesPerSample;
+    int sampleRate;
+    int rootNote;
+    // One past the last frame. No loop unless it's after loopStart.
+    int loopStart;
+    int loopEnd;
+    uint8_t* pcm;
+};
+
+// Note generation in the top 16 bits and frames into the note below, so
+// nothing left over from a voice's last note gets taken for this one's
+struct SampleStream {
+    // Audio thread, the first frame it still needs
+    std::atomic<uint64_t> readFrom { 0 };
+    // Decoder, everything before this is in the ring
+    std::atomic<uint64_t> filledTo { 0 };
+    float ring[SAMPLE_RING][2];
+};
+
+const char* samplePath = nullptr;
+// -1 takes them from the file's smpl chunk
+int sampleRootArg = -1;
+int sampleLoopArg[2] = { -1, -1 };
+
+// Loaded once at startup and never changes after
+SampleData* sampleData = nullptr;
+SampleStream sampleStreams[NUM_VOICES];
+std::atomic<bool> sampleDecoderRunning { false };
+
+// The root note's frequency in blockTuning, worked out once per table. A
+// kbm that leaves the root unmapped gets it in 12-TET.
+double sampleRootFreq = 0.0;
+uint32_t sampleRootSerial = 0;
+
+void updateSampleRoot() {
+    if (!sampleData || blockTuning->serial == sampleRootSerial)
+        return;
+
+    sampleRootSerial = blockTuning->serial;
+    sampleRootFreq = blockTuning->freq[tuningIndex(sampleData->rootNote)];
+    if (sampleRootFreq <= 0.0)
+        sampleRootFreq = pitch(sampleData->rootNote);
+}
+
+uint64_t streamTag(uint16_t gen, uint64_t frame) {
+    return (uint64_t)gen << 48 | frame;
+}
+
+// Where a frame into the note comes from, or -1 once a sample with no
+// loop has run out
+int64_t sampleSourceFrame(const SampleData& s, uint64_t played) {
+    if (s.loopEnd > s.loopStart && played >= (uint64_t)s.loopEnd)
+        return s.loopStart + (played - s.loopStart) % (s.loopEnd - s.loopStart);
+    return played < (uint64_t)s.frames ? (int64_t)played : -1;
+}
+
+void decodeSampleFrame(const SampleData& s, uint64_t played, float* out) {
+    int64_t src = sampleSourceFrame(s, played);
+    if (src < 0) {
+        out[0] = out[1] = 0.0f;
+        return;
+    }
+
+    const uint8_t* frame = s.pcm + src * s.channels * s.bytesPerSample;
+    for (int ch = 0; ch < 2; ch++) {
+        // Mono goes to both sides
+        const uint8_t* p = frame + (ch < s.channels ? ch : 0) * s.bytesPerSample;
+        if (s.bytesPerSample == 2) {
+            out[ch] = (int16_t)(p[0] | p[1] << 8) * (1.0f / 32768.0f);
+        } else {
+            out[ch] = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) * (1.0f / 2147483648.0f);
+        }
+    }
+}
+
+// Keeps every voice's ring topped up to SAMPLE_RING frames past where
+// it's reading
+void sampleDecoderThread() {
+    while (sampleDecoderRunning) {
+        const SampleData& s = *sampleData;
+        for (int j = 0; j < NUM_VOICES; j++) {
+            auto& st = sampleStreams[j];
+            uint64_t from = st.readFrom.load(std::memory_order_acquire);
+            uint64_t filled = st.filledTo.load(std::memory_order_relaxed);
+            uint16_t gen = from >> 48;
+            uint64_t start = from & STREAM_FRAMES;
+            if ((filled >> 48) == gen)
+                start = std::max<uint64_t>(start, filled & STREAM_FRAMES);
+            uint64_t end = (from & STREAM_FRAMES) + SAMPLE_RING;
+
+            // Past the end of an unlooped sample there's nothing to do
+            if (s.loopEnd <= s.loopStart)
+                end = std::min<uint64_t>(end, s.frames + 1);
+
+            while (start < end) {
+                uint64_t chunkEnd = std::min<uint64_t>(end, start + SAMPLE_CHUNK);
+                for (uint64_t f = start; f < chunkEnd; f++) {
+                    decodeSampleFrame(s, f, st.ring[f % SAMPLE_RING]);
+                }
+                start = chunkEnd;
+                st.filledTo.store(streamTag(gen, start), std::memory_order_release);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Renders a sample voice's block, resampled with linear interpolation
+void renderSampleVoice(int voiceIdx, int frames, double blockTime, float* outL, float* outR) {
+    auto& v = voices[voiceIdx];
+    auto& st = sampleStreams[voiceIdx];
+    if (!sampleData) {
+        memset(outL, 0, sizeof(float) * frames);
+        memset(outR, 0, sizeof(float) * frames);
+        return;
+    }
+    const SampleData& s = *sampleData;
+
+    // Unmapped keys stay silent, same as the other voices
+    double keyFreq = blockTuning->freq[tuningIndex(v.note)];
+    if (keyFreq <= 0.0) {
+        v.finishedPlaying = true;
+        memset(outL, 0, sizeof(float) * frames);
+        memset(outR, 0, sizeof(float) * frames);
+        return;
+    }
+
+    // Plays at its own pitch on the root note, bent sample by sample
+    double inc = keyFreq / sampleRootFreq * v.bendRatio * s.sampleRate / currentSampleRate;
+
+    uint64_t filled = st.filledTo.load(std::memory_order_acquire);
+    uint64_t ringEnd = (uint16_t)(filled >> 48) == v.sampleGen ? filled & STREAM_FRAMES : 0;
+    bool looped = s.loopEnd > s.loopStart;
+
+    for (int i = 0; i < frames; i++) {
+        double sampleTime = blockTime + i / (double)currentSampleRate;
+        // Notes can start part way into the block
+        if (sampleTime < v.pressTime || v.finishedPlaying) {
+            outL[i] = outR[i] = 0.0f;
+            continue;
+        }
+
+        uint64_t f = (uint64_t)v.samplePos;
+        if (!looped && f >= (uint64_t)s.frames) {
+            v.finishedPlaying = true;
+            outL[i] = outR[i] = 0.0f;
+            continue;
+        }
+
+        float a[2], b[2];
+        if (f + 1 < ringEnd) {
+            memcpy(a, st.ring[f % SAMPLE_RING], sizeof(a));
+            memcpy(b, st.ring[(f + 1) % SAMPLE_RING], sizeof(b));
+        } else {
+            decodeSampleFrame(s, f, a);
+            decodeSampleFrame(s, f + 1, b);
+        }
+
+        float frac = (float)(v.samplePos - f);
+        float attenuation = voiceEnvelope(v, sampleTime);
+        outL[i] = (a[0] + (b[0] - a[0]) * frac) * attenuation;
+        outR[i] = (a[1] + (b[1] - a[1]) * frac) * attenuation;
+        voiceEffects(outL[i], outR[i], v, i);
+
+        v.samplePos += inc * bendCurve[i];
+    }
+
+    st.readFrom.store(streamTag(v.sampleGen, (uint64_t)v.samplePos), std::memory_order_release);
+}
+
+// Starts a voice's stream from the top. Audio thread.
+void startSampleVoice(int voiceIdx) {
+    auto& v = voices[voiceIdx];
+    v.samplePos = 0.0;
+    v.sampleGen++;
+    sampleStreams[voiceIdx].readFrom.store(streamTag(v.sampleGen, 0), std::memory_order_release);
+}
+
+// Reads a PCM or float WAV into 16-bit PCM if it's 16 bits or less, 24
+// otherwise. Loop and root note come from the smpl chunk unless they're
+// given on the command line. Goes in the arena, so after arenaInit.
+bool loadSample(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "couldn't open sample %s\n", path);
+        return false;
+    }
+
+    char riff[12];
+    if (fread(riff, 1, 12, f) != 12 || memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4)) {
+        fprintf(stderr, "%s isn't a WAV file\n", path);
+        fclose(f);
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long fileBytes = ftell(f);
+    fseek(f, 12, SEEK_SET);
+
+    int format = 0, channels = 0, rate = 0, bits = 0;
+    int rootNote = 60, loopStart = 0, loopEnd = 0;
+    std::vector<uint8_t> data;
+    char id[4];
+    uint32_t size;
+    while (fread(id, 1, 4, f) == 4 && fread(&size, 4, 1, f) == 1) {
+        // A broken size would have us allocate gigabytes for nothing
+        if (size > (uint64_t)(fileBytes - ftell(f))) {
+            fprintf(stderr, "%s is cut short\n", path);
+            break;
+        }
+        std::vector<uint8_t> chunk(size);
+        if (fread(chunk.data(), 1, size, f) != size)
+            break;
+        // Chunks are padded to an even length
+        if (size & 1)
+            fgetc(f);
+
+        auto get16 = [&](int at) { return (int)(chunk[at] | chunk[at + 1] << 8); };
+        auto get32 = [&](int at) { return (uint32_t)(chunk[at] | chunk[at + 1] << 8 | chunk[at + 2] << 16 | (uint32_t)chunk[at + 3] << 24); };
+
+        if (!memcmp(id, "fmt ", 4) && size >= 16) {
+            format = get16(0);
+            channels = get16(2);
+            rate = (int)min(get32(4), 1000000u);
+            bits = get16(14);
+            // WAVE_FORMAT_EXTENSIBLE, the real format is in the GUID
+            if (format == 0xFFFE && size >= 26)
+                format = get16(24);
+        } else if (!memcmp(id, "smpl", 4) && size >= 36) {
+            // It's looked up in the tuning every block, keep it a note
+            rootNote = (int)min(get32(12), 127u);
+            if (get32(28) > 0 && size >= 60) {
+                // Loop end is inclusive in the file. Both get clamped to the
+                // length once it's known.
+                loopStart = (int)min(get32(44), (uint32_t)INT32_MAX);
+                loopEnd = (int)min(get32(48) + (uint64_t)1, (uint64_t)INT32_MAX);
+            }
+        } else if (!memcmp(id, "data", 4)) {
+            data.swap(chunk);
+        }
+    }
+    fclose(f);
+
+    bool isFloat = format == 3 && bits == 32;
+    if (!(format == 1 && bits >= 8 && bits <= 32 && bits % 8 == 0) && !isFloat) {
+        fprintf(stderr, "%s: only PCM or 32-bit float samples\n", path);
+        return false;
+    }
+    if (channels < 1 || rate < 1 || data.empty()) {
+        fprintf(stderr, "%s has no audio in it\n", path);
+        return false;
+    }
+
+    int inBytes = bits / 8;
+    int frames = (int)(data.size() / (inBytes * channels));
+    int keepChannels = min(channels, 2);
+    int outBytes = bits <= 16 ? 2 : 3;
+    size_t pcmBytes = (size_t)frames * keepChannels * outBytes;
+
+    SampleData* s = (SampleData*)arenaAlloc(sizeof(SampleData) + pcmBytes);
+    if (!s) {
+        fprintf(stderr, "no room for %s in the arena, try a bigger --arena-mb\n", path);
+        return false;
+    }
+    s->frames = frames;
+    s->channels = keepChannels;
+    s->bytesPerSample = outBytes;
+    s->sampleRate = rate;
+    s->rootNote = sampleRootArg >= 0 ? sampleRootArg : rootNote;
+    s->loopStart = sampleLoopArg[0] >= 0 ? sampleLoopArg[0] : loopStart;
+    s->loopEnd = sampleLoopArg[1] >= 0 ? sampleLoopArg[1] : loopEnd;
+    s->loopStart = (int)clamp(s->loopStart, 0, frames);
+    s->loopEnd = (int)clamp(s->loopEnd, 0, frames);
+    s->pcm = (uint8_t*)(s + 1);
+
+    uint8_t* out = s->pcm;
+    for (int i = 0; i < frames; i++) {
+        for (int ch = 0; ch < keepChannels; ch++) {
+            const uint8_t* p = &data[((size_t)i * channels + ch) * inBytes];
+            // Everything to 32-bit first, top aligned
+            int32_t v;
+            if (isFloat) {
+                float x;
+                memcpy(&x, p, 4);
+                v = (int32_t)clamp(x * 2147483648.0, -2147483648.0, 2147483647.0);
+            } else if (inBytes == 1) {
+                // 8-bit WAV is unsigned
+                v = (int32_t)((uint32_t)(p[0] ^ 0x80) << 24);
+            } else {
+                uint32_t u = 0;
+                for (int b = 0; b < inBytes; b++) {
+                    u |= (uint32_t)p[b] << (8 * (4 - inBytes + b));
+                }
+                v = (int32_t)u;
+            }
+
+            for (int b = 0; b < outBytes; b++) {
+                *out++ = (uint8_t)((uint32_t)v >> (8 * (4 - outBytes + b)));
+            }
+        }
+    }
+
+    sampleData = s;
+    printf("sample: %s, %i frames, %i Hz, %i bit, root %i", path, frames, rate, outBytes * 8, s->rootNote);
+    if (s->loopEnd > s->loopStart)
+        printf(", loop %i-%i", s->loopStart, s->loopEnd);
+    printf(" (%.1f MB, %.1f as float)\n", pcmBytes / 1048576.0, frames * keepChannels * 4 / 1048576.0);
+    return true;
+}
+
+// Renders one voice's block
+void renderVoiceBlock(int voiceIdx, int frames, double blockTime, float* outL, float* outR) {
+    auto& v = voices[voiceIdx];
+    if (v.model == V_Sample) {
+        renderSampleVoice(voiceIdx, frames, blockTime, outL, outR);
+        return;
+    }
+
+    if (v.model != V_Oscillator) {
+        int group = voiceIdx / STRING_LANES;
+        int lane = voiceIdx % STRING_LANES;
+        for (int i = 0; i < frames; i++) {
+            outL[i] = outR[i] = stringOut[group][i][lane];
+            voiceEffects(outL[i], outR[i], v, i);
+        }
+        return;
+    }
+
+    for (int i = 0; i < frames; i++) {
+        double sampleTime = blockTime + i / (double)currentSampleRate;
+        getVoiceSample(outL[i], outR[i], voiceIdx, i, sampleTime);
+    }
+}
+
+// Pans a rendered voice into outBus
+void mixVoice(int voiceIdx, const float* bufL, const float* bufR, int frames) {
+    auto& v = voices[voiceIdx];
+    float lGains[MAX_CHANNELS], rGains[MAX_CHANNELS];
+    computePanGains(v.azimuth - stereoWidth, lGains);
+    computePanGains(v.azimuth + stereoWidth, rGains);
+    float gain = v.velocity * v.noteVolume * 0.25f;
+
+    for (int ch = 0; ch < nChannels && ch < MAX_CHANNELS; ch++) {
+        if (lGains[ch] == 0.0f && rGains[ch] == 0.0f)
+            continue;
+
+        mixStereoInto(outBus[ch], bufL, bufR, lGains[ch] * gain, rGains[ch] * gain, frames);
+    }
+}
+
+// Parallel rendering
+// ------------------
+// Offline renders (journal replays) can spread each block's string groups
+// and then its voices over every core. Each voice renders into a buffer of
+// its own and they're mixed in voice order on one thread afterwards, which
+// is exactly the sum the live engine does, so the output is bit for bit
+// the same whatever the thread count. Never used on the audio thread.
+// Workers spin between batches, since replays keep the live block sizes
+// and those can be as small as 64 frames.
+
+// 0 is one per core
+int renderThreads = 0;
+
+struct RenderPool {
+    std::vector<std::thread> workers;
+    std::atomic<bool> running { false };
+    std::atomic<uint32_t> generation { 0 };
+    // Batch in the top half and next job in the bottom, so a worker still
+    // on its way out of the last batch can't take a job from this one
+    std::atomic<uint64_t> nextJob { 0 };
+    std::atomic<int> jobCount { 0 };
+    std::atomic<int> jobsDone { 0 };
+    std::atomic<void (*)(int)> job { nullptr };
+    int frames;
+    double blockTime;
+};
+
+RenderPool renderPool;
+
+// Voices playing this block, in order, and where they render to
+int parallelVoices[NUM_VOICES];
+float parallelBufL[NUM_VOICES][MAX_BLOCK];
+float parallelBufR[NUM_VOICES][MAX_BLOCK];
+
+void renderPoolDrain(uint32_t gen) {
+    auto& p = renderPool;
+    uint64_t next = p.nextJob.load(std::memory_order_acquire);
+    while ((uint32_t)(next >> 32) == gen && (int)(uint32_t)next < p.jobCount.load(std::memory_order_relaxed)) {
+        if (!p.nextJob.compare_exchange_weak(next, next + 1, std::memory_order_acq_rel))
+            continue;
+
+        p.job.load(std::memory_order_relaxed)((int)(uint32_t)next);
+        p.jobsDone.fetch_add(1, std::memory_order_release);
+        next = p.nextJob.load(std::memory_order_acquire);
+    }
+}
+
+void renderPoolWorker() {
+    uint32_t seen = renderPool.generation.load(std::memory_order_acquire);
+    while (renderPool.running.load(std::memory_order_relaxed)) {
+        uint32_t gen = renderPool.generation.load(std::memory_order_acquire);
+        if (gen == seen) {
+            std::this_thread::yield();
+            continue;
+        }
+        seen = gen;
+        renderPoolDrain(gen);
+    }
+}
+
+// Runs job(0..count-1) across the pool and this thread, and returns once
+// they're all done
+void renderPoolRun(void (*job)(int), int count) {
+    auto& p = renderPool;
+    p.job.store(job, std::memory_order_relaxed);
+    p.jobCount.store(count, std::memory_order_relaxed);
+    p.jobsDone.store(0, std::memory_order_relaxed);
+    uint32_t gen = p.generation.load(std::memory_order_relaxed) + 1;
+    p.nextJob.store((uint64_t)gen << 32, std::memory_order_release);
+    p.generation.store(gen, std::memory_order_release);
+
+    renderPoolDrain(gen);
+    while (p.jobsDone.load(std::memory_order_acquire) < count) {
+        std::this_thread::yield();
+    }
+}
+
+void startRenderPool(int threads) {
+    renderPool.running = true;
+    for (int i = 1; i < threads; i++) {
+        renderPool.workers.emplace_back(renderPoolWorker);
+    }
+    printf("rendering on %i threads\n", threads);
+}
+
+void stopRenderPool() {
+    renderPool.running = false;
+    for (auto& t : renderPool.workers) {
+        t.join();
+    }
+    renderPool.workers.clear();
+}
+
+void stringGroupJob(int gi) {
+    renderStringGroup(gi, renderPool.frames, renderPool.blockTime);
+}
+
+void voiceJob(int n) {
+    int j = parallelVoices[n];
+    renderVoiceBlock(j, renderPool.frames, renderPool.blockTime, parallelBufL[j], parallelBufR[j]);
+}
+
+// Mixes every playing voice into outBus
+void renderVoices(int frames, double blockTime) {
+    for (int ch = 0; ch < nChannels && ch < MAX_CHANNELS; ch++) {
+        memset(outBus[ch], 0, sizeof(float) * frames);
+    }
+
+    if (!renderPool.workers.empty()) {
+        renderPool.frames = frames;
+        renderPool.blockTime = blockTime;
+        renderPoolRun(stringGroupJob, STRING_GROUPS);
+
+        int playing = 0;
+        for (int j = 0; j < NUM_VOICES; j++) {
+            if (!voices[j].finishedPlaying)
+                parallelVoices[playing++] = j;
+        }
+        renderPoolRun(voiceJob, playing);
+
+        for (int n = 0; n < playing; n++) {
+            int j = parallelVoices[n];
+            mixVoice(j, parallelBufL[j], parallelBufR[j], frames);
+        }
+        return;
+    }
+
+    renderStrings(frames, blockTime);
+
+    for (int j = 0; j < NUM_VOICES; j++) {
+        if (voices[j].finishedPlaying)
+            continue;
+
+        renderVoiceBlock(j, frames, blockTime, voiceBufL, voiceBufR);
+        mixVoice(j, voiceBufL, voiceBufR, frames);
+    }
+}
+
+// Planar bus to the device's interleaved buffer
+void interleaveFloat(float* stream, int frames) {
+    int i = 0;
+#ifdef SYNTH_SSE
+    if (nChannels == 2) {
+        for (; i + 4 <= frames; i += 4) {
+            __m128 l = _mm_loadu_ps(outBus[0] + i);
+            __m128 r = _mm_loadu_ps(outBus[1] + i);
+            _mm_storeu_ps(stream + i * 2, _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps(stream + i * 2 + 4, _mm_unpackhi_ps(l, r));
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        for (int ch = 0; ch < nChannels; ch++) {
+            stream[i * nChannels + ch] = ch < MAX_CHANNELS ? outBus[ch][i] : 0.0f;
+        }
+    }
+}
+
+// Integer output
+// ==============
+// When the device wants S16 or S32 we convert ourselves rather than have
+// SDL make another pass over the buffer, so it happens in the same loop
+// as the interleave and gets dithered. S32 devices are almost always
+// 24-bit converters underneath, and a float doesn't have more than 24
+// bits anyway, so those get dithered at 24 bits and shifted up.
+
+enum DitherMode {
+    D_Off,
+    D_Tpdf,
+    // TPDF with the error pushed up towards Nyquist
+    D_Shaped,
+};
+
+// 0 until the device is open means take whatever it prefers
+SDL_AudioFormat outputFormat = 0;
+DitherMode ditherMode = D_Tpdf;
+
+// Four lanes of xorshift
+alignas(16) uint32_t ditherRng[4] = { 0x9e3779b9, 0x7f4a7c15, 0x2545f491, 0x6c8e9cf5 };
+// Last two errors per channel for the shaping filter
+float shapeError[MAX_CHANNELS][2];
+
+int outputSampleBytes() {
+    return SDL_AUDIO_BITSIZE(outputFormat) / 8;
+}
+
+// -0.5..0.5 LSB, so two of them make a triangle
+float ditherNoise() {
+    uint32_t& x = ditherRng[0];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (int32_t)x * (1.0f / 4294967296.0f);
+}
+
+#ifdef SYNTH_SSE
+__m128 ditherNoise4(__m128i& state) {
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+    state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+    return _mm_mul_ps(_mm_cvtepi32_ps(state), _mm_set1_ps(1.0f / 4294967296.0f));
+}
+
+// Scales, dithers and rounds four samples, clamped to the integer range
+__m128i quantize4(__m128 x, __m128 scale, __m128 dither) {
+    __m128 v = _mm_add_ps(_mm_mul_ps(x, scale), dither);
+    v = _mm_min_ps(_mm_max_ps(v, _mm_sub_ps(_mm_setzero_ps(), scale)), _mm_sub_ps(scale, _mm_set1_ps(1.0f)));
+    return _mm_cvtps_epi32(v);
+}
+#endif
+
+// Bits is the resolution we dither to, Sample the container
+template<int Bits, typename Sample>
+void interleaveInt(Sample* stream, int frames) {
+    const float scale = (float)(1 << (Bits - 1));
+    const int shift = sizeof(Sample) * 8 - Bits;
+    const float ditherAmount = ditherMode == D_Off ? 0.0f : 1.0f;
+    int i = 0;
+
+#ifdef SYNTH_SSE
+    if (nChannels == 2 && ditherMode != D_Shaped) {
+        __m128i rng = _mm_load_si128((__m128i*)ditherRng);
+        __m128 scaleV = _mm_set1_ps(scale);
+        __m128 amount = _mm_set1_ps(ditherAmount);
+
+        for (; i + 4 <= frames; i += 4) {
+            __m128 l = _mm_loadu_ps(outBus[0] + i);
+            __m128 r = _mm_loadu_ps(outBus[1] + i);
+            __m128 lo = _mm_unpacklo_ps(l, r);
+            __m128 hi = _mm_unpackhi_ps(l, r);
+
+            __m128 dLo = _mm_mul_ps(_mm_add_ps(ditherNoise4(rng), ditherNoise4(rng)), amount);
+            __m128 dHi = _mm_mul_ps(_mm_add_ps(ditherNoise4(rng), ditherNoise4(rng)), amount);
+            __m128i qLo = quantize4(lo, scaleV, dLo);
+            __m128i qHi = quantize4(hi, scaleV, dHi);
+
+            if (sizeof(Sample) == 2) {
+                _mm_storeu_si128((__m128i*)(stream + i * 2), _mm_packs_epi32(qLo, qHi));
+            } else {
+                _mm_storeu_si128((__m128i*)(stream + i * 2), _mm_slli_epi32(qLo, shift));
+                _mm_storeu_si128((__m128i*)(stream + i * 2 + 4), _mm_slli_epi32(qHi, shift));
+            }
+        }
+
+        _mm_store_si128((__m128i*)ditherRng, rng);
+    }
+#endif
+    for (; i < frames; i++) {
+        for (int ch = 0; ch < nChannels; ch++) {
+            float x = ch < MAX_CHANNELS ? outBus[ch][i] * scale : 0.0f;
+            float v = x;
+            float* e = shapeError[ch < MAX_CHANNELS ? ch : 0];
+
+            // Error feedback through (1 - z^-1)^2
+            if (ditherMode == D_Shaped)
+                v = x - 2.0f * e[0] + e[1];
+
+            float q = nearbyintf(v + (ditherNoise() + ditherNoise()) * ditherAmount);
+            q = clamp(q, -scale, scale - 1.0f);
+
+            if (ditherMode == D_Shaped) {
+                e[1] = e[0];
+                e[0] = clamp(q - v, -4.0f, 4.0f);
+            }
+
+            stream[i * nChannels + ch] = (Sample)((int32_t)q * (1 << shift));
+        }
+    }
+}
+
+// Interleaves the bus into the device's buffer in whatever format it
+// took
+void interleaveBus(Uint8* stream, int frames) {
+    switch (outputFormat) {
+    case AUDIO_S16SYS:
+        interleaveInt<16>((int16_t*)stream, frames);
+        break;
+    case AUDIO_S32SYS:
+        interleaveInt<24>((int32_t*)stream, frames);
+        break;
+    default:
+        interleaveFloat((float*)stream, frames);
+        break;
+    }
+}
+
+// Where the audio thread was at the start of its last block, so other
+// threads can turn wall clock times into engine frames
+struct BlockClock {
+    double wallTime;
+    uint64_t frame;
+    int sampleRate;
+    // timeAccumulator at the start of the block
+    double dspTime;
+};
+
+SeqLock<BlockClock> blockClock;
+
+double getWallTime() {
+    return SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
+}
+
+// Engine frame being rendered at the given wall time
+double wallTimeToFrame(double wallTime) {
+    BlockClock c = blockClock.load();
+    return c.frame + (wallTime - c.wallTime) * c.sampleRate;
+}
+
+// DSP clock time being rendered at the given wall time
+double wallTimeToDspTime(double wallTime) {
+    BlockClock c = blockClock.load();
+    return c.dspTime + (wallTime - c.wallTime);
+}
+
+// Wall time at which the given frame gets rendered. It's heard about a
+// buffer later than that.
+double frameToWallTime(double frame) {
+    BlockClock c = blockClock.load();
+    return c.wallTime + (frame - c.frame) / c.sampleRate;
+}
+
+bool sequencerWantsAudio();
+void journalBlockStart(int frames);
+void runParamRamps();
+void fillParamCurves(int frames);
+void journalTuningSwap();
+bool engineInputsPending();
+void sequencerProcess(uint64_t blockFrame, int frames, double blockTime);
+
+// Master bus
+// ==========
+// Everything after the voices are mixed. This is where live input comes
+// in: it can go straight to the output, through the synth's bitcrush and
+// lowpass first, and/or duck the synth as a sidechain.
+//
+// SDL2 won't give us input and output in one callback, so the capture
+// device is opened without a callback and the output callback pulls from
+// its queue directly. No thread of ours sits in between.
+
+const static int MAX_INPUT_CHANNELS = 2;
+
+SDL_AudioDeviceID captureDevice = 0;
+int nInputChannels = 0;
+float inBus[MAX_INPUT_CHANNELS][MAX_BLOCK];
+float inInterleaved[MAX_BLOCK * MAX_INPUT_CHANNELS];
+
+float inputGain = 1.0f;
+bool inputMix = true;
+bool inputEffects = false;
+bool inputSidechain = false;
+float inputLpAccum[MAX_INPUT_CHANNELS];
+float inputPeak = 0.0f;
+
+// Sidechain ducking
+float sidechainThreshold = -30.0f;
+float sidechainRatio = 4.0f;
+float sidechainAttack = 0.005f;
+float sidechainRelease = 0.2f;
+float sidechainEnv = 0.0f;
+// How much the synth's being turned down, for the UI
+float sidechainGain = 1.0f;
+
+// Any more than this many blocks of input queued up and we drop some, so
+// latency doesn't creep up when the two devices' clocks drift
+const static int MAX_INPUT_BACKLOG = 3;
+
+bool inputActive() {
+    return captureDevice != 0 && nInputChannels > 0;
+}
+
+// Pulls a block of input out of the capture queue into inBus. Comes up
+// short with silence if the input's fallen behind.
+void pullInput(int frames) {
+    Uint32 bytes = frames * nInputChannels * sizeof(float);
+
+    Uint32 queued = SDL_GetQueuedAudioSize(captureDevice);
+    while (queued > bytes * MAX_INPUT_BACKLOG) {
+        Uint32 drop = queued - bytes * MAX_INPUT_BACKLOG;
+        queued -= SDL_DequeueAudio(captureDevice, inInterleaved, min(drop, sizeof(inInterleaved)));
+    }
+
+    // Mono goes straight into the bus, no need to deinterleave
+    float* dest = nInputChannels == 1 ? inBus[0] : inInterleaved;
+    Uint32 got = SDL_DequeueAudio(captureDevice, dest, bytes);
+    memset((Uint8*)dest + got, 0, bytes - got);
+
+    if (nInputChannels > 1) {
+        for (int i = 0; i < frames; i++) {
+            for (int ch = 0; ch < nInputChannels; ch++) {
+                inBus[ch][i] = inInterleaved[i * nInputChannels + ch];
+            }
+        }
+    }
+}
+
+float dbToGain(float db) {
+    return powf(10.0f, db / 20.0f);
+}
+
+float gainToDb(float gain) {
+    return 20.0f * log10f(max(gain, 0.000001f));
+}
+
+// Vocoder
+// -------
+// The input is the modulator and the synth is the carrier. Both go
+// through the same bank of band-pass filters, the modulator bands drive
+// envelope followers, and those set the level of each carrier band.
+// Bands are processed four at a time in SIMD lanes, and there's no FFT,
+// so the cost per sample is the same whatever the block size.
+
+const static int MIN_VOCODER_BANDS = 16;
+const static int MAX_VOCODER_BANDS = 32;
+// Two biquads in a row per band, to keep neighbouring bands apart
+const static int VOCODER_STAGES = 2;
+
+bool vocoderEnabled = false;
+int vocoderBands = 16;
+float vocoderLowFreq = 100.0f;
+float vocoderHighFreq = 8000.0f;
+float vocoderAttack = 0.005f;
+float vocoderRelease = 0.03f;
+float vocoderWet = 1.0f;
+// Each band only passes a slice of both signals and the two are multiplied,
+// so the sum comes out around 40dB under the carrier with a voice on the
+// input. This makes it back up.
+const float VOCODER_MAKEUP = 100.0f;
+float vocoderGain = VOCODER_MAKEUP;
+
+// Struct of arrays, one lane per band
+struct BiquadBank {
+    alignas(16) float b0[MAX_VOCODER_BANDS];
+    alignas(16) float b2[MAX_VOCODER_BANDS];
+    alignas(16) float a1[MAX_VOCODER_BANDS];
+    alignas(16) float a2[MAX_VOCODER_BANDS];
+    alignas(16) float z1[VOCODER_STAGES][MAX_VOCODER_BANDS];
+    alignas(16) float z2[VOCODER_STAGES][MAX_VOCODER_BANDS];
+};
+
+struct Vocoder {
+    BiquadBank modulator;
+    BiquadBank carrier;
+    alignas(16) float env[MAX_VOCODER_BANDS];
+    int bands;
+    int sampleRate;
+};
+
+Vocoder vocoder = {};
+
+// Log spaced constant 0dB peak band-passes. b1 is always zero for these so
+// it isn't stored. Only redone when the band count or rate changes.
+// Whole SIMD groups of four, in the supported range
+int vocoderBandCount(int bands) {
+    return (int)clamp(bands / 4 * 4, MIN_VOCODER_BANDS, MAX_VOCODER_BANDS);
+}
+
+void configureVocoder(int bands) {
+    bands = vocoderBandCount(bands);
+
+    float top = min(vocoderHighFreq, currentSampleRate * 0.45f);
+    float ratio = powf(top / vocoderLowFreq, 1.0f / (bands - 1));
+    // Each band about as wide as the spacing between them
+    float q = sqrtf(ratio) / (ratio - 1.0f);
+
+    for (int b = 0; b < MAX_VOCODER_BANDS; b++) {
+        float freq = vocoderLowFreq * powf(ratio, b);
+        float w = 2.0f * M_PI * min(freq, top) / currentSampleRate;
+        float alpha = sinf(w) / (2.0f * q);
+        float a0 = 1.0f + alpha;
+
+        for (BiquadBank* bank : { &vocoder.modulator, &vocoder.carrier }) {
+            bank->b0[b] = b < bands ? alpha / a0 : 0.0f;
+            bank->b2[b] = b < bands ? -alpha / a0 : 0.0f;
+            bank->a1[b] = -2.0f * cosf(w) / a0;
+            bank->a2[b] = (1.0f - alpha) / a0;
+            for (int st = 0; st < VOCODER_STAGES; st++) {
+                bank->z1[st][b] = 0.0f;
+                bank->z2[st][b] = 0.0f;
+            }
+        }
+
+        vocoder.env[b] = 0.0f;
+    }
+
+    vocoder.bands = bands;
+    vocoder.sampleRate = currentSampleRate;
+}
+
+#ifdef SYNTH_SSE
+// One transposed direct form II step for four bands at once
+inline __m128 biquadBankStep(BiquadBank& bank, int stage, int band, __m128 x) {
+    __m128 z1 = _mm_load_ps(bank.z1[stage] + band);
+    __m128 z2 = _mm_load_ps(bank.z2[stage] + band);
+    __m128 a1 = _mm_load_ps(bank.a1 + band);
+    __m128 a2 = _mm_load_ps(bank.a2 + band);
+
+    __m128 y = _mm_add_ps(_mm_mul_ps(x, _mm_load_ps(bank.b0 + band)), z1);
+    z1 = _mm_sub_ps(z2, _mm_mul_ps(a1, y));
+    z2 = _mm_sub_ps(_mm_mul_ps(x, _mm_load_ps(bank.b2 + band)), _mm_mul_ps(a2, y));
+
+    _mm_store_ps(bank.z1[stage] + band, z1);
+    _mm_store_ps(bank.z2[stage] + band, z2);
+    return y;
+}
+#endif
+
+inline float biquadBankStepScalar(BiquadBank& bank, int stage, int band, float x) {
+    float y = x * bank.b0[band] + bank.z1[stage][band];
+    bank.z1[stage][band] = bank.z2[stage][band] - bank.a1[band] * y;
+    bank.z2[stage][band] = x * bank.b2[band] - bank.a2[band] * y;
+    return y;
+}
+
+// Vocodes the synth on outBus with inBus as the modulator
+void processVocoder(int frames) {
+    if (vocoder.bands != vocoderBandCount(vocoderBands) || vocoder.sampleRate != currentSampleRate)
+        configureVocoder(vocoderBands);
+
+    int bands = vocoder.bands;
+    int channels = min(nChannels, MAX_CHANNELS);
+    float attack = 1.0f - expf(-1.0f / (vocoderAttack * currentSampleRate));
+    float release = 1.0f - expf(-1.0f / (vocoderRelease * currentSampleRate));
+
+    // Vocoded signal comes out of the middle
+    float centreGains[MAX_CHANNELS];
+    computePanGains(0.0f, centreGains);
+
+    for (int i = 0; i < frames; i++) {
+        float mod = 0.0f;
+        for (int ch = 0; ch < nInputChannels; ch++) {
+            mod += inBus[ch][i];
+        }
+
+        // The LFE isn't one of the speakers the synth is panned over
+        float car = 0.0f;
+        for (int ch = 0; ch < channels; ch++) {
+            if (ch != speakers->lfe)
+                car += outBus[ch][i];
+        }
+
+        float out = 0.0f;
+        int b = 0;
+#ifdef SYNTH_SSE
+        __m128 modV = _mm_set1_ps(mod);
+        __m128 carV = _mm_set1_ps(car);
+        __m128 attackV = _mm_set1_ps(attack);
+        __m128 releaseV = _mm_set1_ps(release);
+        __m128 signMask = _mm_set1_ps(-0.0f);
+        __m128 sum = _mm_setzero_ps();
+
+        for (; b < bands; b += 4) {
+            __m128 m = modV, c = carV;
+            for (int st = 0; st < VOCODER_STAGES; st++) {
+                m = biquadBankStep(vocoder.modulator, st, b, m);
+                c = biquadBankStep(vocoder.carrier, st, b, c);
+            }
+
+            // Envelope follower, attack or release coefficient per lane
+            __m128 level = _mm_andnot_ps(signMask, m);
+            __m128 env = _mm_load_ps(vocoder.env + b);
+            __m128 rising = _mm_cmpgt_ps(level, env);
+            __m128 coef = _mm_or_ps(_mm_and_ps(rising, attackV), _mm_andnot_ps(rising, releaseV));
+            env = _mm_add_ps(env, _mm_mul_ps(_mm_sub_ps(level, env), coef));
+            _mm_store_ps(vocoder.env + b, env);
+
+            sum = _mm_add_ps(sum, _mm_mul_ps(c, env));
+        }
+
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, sum);
+        out = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+        for (; b < bands; b++) {
+            float m = mod, c = car;
+            for (int st = 0; st < VOCODER_STAGES; st++) {
+                m = biquadBankStepScalar(vocoder.modulator, st, b, m);
+                c = biquadBankStepScalar(vocoder.carrier, st, b, c);
+            }
+
+            float level = abs(m);
+            float& env = vocoder.env[b];
+            env += (level - env) * (level > env ? attack : release);
+            out += c * env;
+        }
+
+        out *= vocoderGain;
+
+        for (int ch = 0; ch < channels; ch++) {
+            outBus[ch][i] = outBus[ch][i] * (1.0f - vocoderWet) + out * centreGains[ch] * vocoderWet;
+        }
+    }
+}
+
+void processMasterBus(int frames) {
+    if (!inputActive())
+        return;
+
+    pullInput(frames);
+
+    float peak = 0.0f;
+    for (int ch = 0; ch < nInputChannels; ch++) {
+        for (int i = 0; i < frames; i++) {
+            float x = inBus[ch][i] * inputGain;
+
+            if (inputEffects) {
+                if (enableBitcrush)
+                    x = bitcrush(x, crushBits);
+                if (lpEnabled)
+                    x = lowpass(inputLpAccum[ch], x, lpQ);
+            }
+
+            inBus[ch][i] = x;
+            peak = max(peak, abs(x));
+        }
+    }
+    inputPeak = peak;
+
+    if (vocoderEnabled)
+        processVocoder(frames);
+
+    // Duck the synth while the input's over the threshold
+    if (inputSidechain) {
+        float attack = 1.0f - expf(-1.0f / (sidechainAttack * currentSampleRate));
+        float release = 1.0f - expf(-1.0f / (sidechainRelease * currentSampleRate));
+
+        for (int i = 0; i < frames; i++) {
+            float level = 0.0f;
+            for (int ch = 0; ch < nInputChannels; ch++) {
+                level = max(level, abs(inBus[ch][i]));
+            }
+
+            sidechainEnv += (level - sidechainEnv) * (level > sidechainEnv ? attack : release);
+
+            float over = gainToDb(sidechainEnv) - sidechainThreshold;
+            float gain = over > 0.0f ? dbToGain(-over * (1.0f - 1.0f / sidechainRatio)) : 1.0f;
+
+            for (int ch = 0; ch < nChannels && ch < MAX_CHANNELS; ch++) {
+                outBus[ch][i] *= gain;
+            }
+            sidechainGain = gain;
+        }
+    } else {
+        sidechainGain = 1.0f;
+    }
+
+    // Mono input sits in the middle, stereo goes either side like a voice
+    if (inputMix) {
+        float lGains[MAX_CHANNELS], rGains[MAX_CHANNELS];
+        const float* l = inBus[0];
+        const float* r = inBus[nInputChannels > 1 ? 1 : 0];
+
+        if (nInputChannels > 1) {
+            computePanGains(-stereoWidth, lGains);
+            computePanGains(stereoWidth, rGains);
+        } else {
+            computePanGains(0.0f, lGains);
+            for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+                rGains[ch] = 0.0f;
+            }
+        }
+
+        for (int ch = 0; ch < nChannels && ch < MAX_CHANNELS; ch++) {
+            if (lGains[ch] != 0.0f || rGains[ch] != 0.0f)
+                mixStereoInto(outBus[ch], l, r, lGains[ch], rGains[ch], frames);
+        }
+    }
+}
+
+// Kept so it can be opened again when the output changes
+bool captureWanted = false;
+const char* captureDeviceName = nullptr;
+int captureWantChannels = 1;
+
+// Opens the capture side at the output's rate and block size. SDL does any
+// conversion on its own thread.
+bool openInput(const char* deviceName, int channels) {
+    captureWanted = true;
+    captureDeviceName = deviceName;
+    captureWantChannels = channels;
+
+    SDL_AudioSpec want = {};
+    want.format = AUDIO_F32;
+    want.freq = currentSampleRate;
+    want.channels = (int)clamp(channels, 1, MAX_INPUT_CHANNELS);
+    want.samples = bufSize;
+    want.callback = nullptr;
+
+    SDL_AudioSpec got;
+    captureDevice = SDL_OpenAudioDevice(deviceName, 1, &want, &got, 0);
+    if (captureDevice == 0) {
+        fprintf(stderr, "failed to open capture device: %s\n", SDL_GetError());
+        return false;
+    }
+
+    nInputChannels = got.channels;
+    printf("input: %s, %i channels\n", deviceName ? deviceName : "default", nInputChannels);
+    return true;
+}
+
+// Harmonizer
+// ==========
+// Up to four pitch shifted copies of the mix (or just the input) added
+// back in around the stereo field, so a patch can be thickened without
+// spending voices on it the way the octave modes do. Two ways to do it:
+//
+//   Time domain: two read heads sweep through a delay line half a grain
+//   apart and crossfade. Costs next to nothing and adds a grain of delay
+//   at most, but it warbles a bit on sustained notes.
+//
+//   Phase vocoder: 4x overlapped FFT frames. Each peak in the spectrum
+//   gets moved to the new pitch along with the bins around it, phases
+//   locked to the peak. Much cleaner, a frame and a hop of latency.
+//
+// The phase vocoder's FFT work for a frame is cut into steps that are
+// spread over the next hop a few samples at a time, so each callback costs
+// the same whatever the block size instead of spiking on blocks that
+// happen to end a hop.
+
+const static int HARMONY_VOICES = 4;
+const static int HARMONY_DELAY = 16384;
+const static int PV_MAX_SIZE = 2048;
+const static int PV_OVERLAP = 4;
+// Output frames get added in ahead of where they're read
+const static int PV_RING = PV_MAX_SIZE * 2;
+
+enum HarmonyMode {
+    H_TimeDomain,
+    H_PhaseVocoder,
+    H_Count,
+};
+
+bool harmonizerEnabled = false;
+HarmonyMode harmonyMode = H_TimeDomain;
+// Shift the live input rather than the whole mix
+bool harmonizeInput = false;
+int harmonyVoices = 2;
+// Semitones
+float harmonyShift[HARMONY_VOICES] = { 7.0f, 12.0f, -12.0f, 19.0f };
+float harmonyLevel[HARMONY_VOICES] = { 0.5f, 0.5f, 0.5f, 0.5f };
+// Azimuth in degrees, like the voices
+float harmonyPan[HARMONY_VOICES] = { -30.0f, 30.0f, -15.0f, 15.0f };
+// Time domain grain length in seconds
+float harmonyGrain = 0.04f;
+
+struct Harmonizer {
+    float delay[HARMONY_DELAY];
+    unsigned writePos;
+    // Where each voice is in its grain, 0 to 1
+    float grainPhase[HARMONY_VOICES];
+
+    // Phase vocoder
+    int size;
+    int hop;
+    int passes;
+    float window[PV_MAX_SIZE];
+    float twiddleRe[PV_MAX_SIZE / 2];
+    float twiddleIm[PV_MAX_SIZE / 2];
+    uint16_t bitReverse[PV_MAX_SIZE];
+    // Analysis frame, then one voice at a time
+    float re[PV_MAX_SIZE];
+    float im[PV_MAX_SIZE];
+    float voiceRe[PV_MAX_SIZE];
+    float voiceIm[PV_MAX_SIZE];
+    float magnitude[PV_MAX_SIZE / 2 + 1];
+    // In bins
+    float frequency[PV_MAX_SIZE / 2 + 1];
+    float phase[PV_MAX_SIZE / 2 + 1];
+    float lastPhase[PV_MAX_SIZE / 2 + 1];
+    // Bin of the peak each bin belongs to
+    int16_t peakOf[PV_MAX_SIZE / 2 + 1];
+    // Phase each voice has added to each peak so far
+    float rotation[HARMONY_VOICES][PV_MAX_SIZE / 2 + 1];
+    float rotationNow[PV_MAX_SIZE / 2 + 1];
+    float accum[HARMONY_VOICES][PV_RING];
+    unsigned readPos;
+    // Where the frame being worked on starts coming out
+    unsigned frameOut;
+    int hopPos;
+    int step;
+    int steps;
+
+    // Quiet long enough for everything to have come out the other end.
+    // Nothing runs then and the state is all zeros, which is what lets a
+    // journal checkpoint get away without saving any of this.
+    bool idle;
+    int quietFrames;
+    int sampleRate;
+
+    float source[MAX_BLOCK];
+    float out[HARMONY_VOICES][MAX_BLOCK];
+};
+
+Harmonizer harmonizer;
+
+void resetHarmonizer() {
+    auto& hz = harmonizer;
+    memset(hz.delay, 0, sizeof(hz.delay));
+    memset(hz.grainPhase, 0, sizeof(hz.grainPhase));
+    memset(hz.lastPhase, 0, sizeof(hz.lastPhase));
+    memset(hz.rotation, 0, sizeof(hz.rotation));
+    memset(hz.accum, 0, sizeof(hz.accum));
+    hz.writePos = 0;
+    hz.readPos = 0;
+    hz.hopPos = 0;
+    // Nothing in flight
+    hz.step = hz.steps = 0;
+    hz.idle = true;
+    hz.quietFrames = 0;
+}
+
+void configureHarmonizer() {
+    auto& hz = harmonizer;
+
+    // About 20ms of window whatever the rate
+    hz.size = currentSampleRate > 64000 ? PV_MAX_SIZE : PV_MAX_SIZE / 2;
+    hz.hop = hz.size / PV_OVERLAP;
+    hz.passes = 0;
+    while ((1 << hz.passes) < hz.size) {
+        hz.passes++;
+    }
+
+    for (int n = 0; n < hz.size; n++) {
+        hz.window[n] = 0.5f - 0.5f * cosf(2.0f * M_PI * n / hz.size);
+
+        unsigned r = 0;
+        for (int b = 0; b < hz.passes; b++) {
+            r |= ((n >> b) & 1) << (hz.passes - 1 - b);
+        }
+        hz.bitReverse[n] = r;
+    }
+
+    for (int k = 0; k < hz.size / 2; k++) {
+        hz.twiddleRe[k] = cosf(2.0f * M_PI * k / hz.size);
+        hz.twiddleIm[k] = -sinf(2.0f * M_PI * k / hz.size);
+    }
+
+    resetHarmonizer();
+    hz.sampleRate = currentSampleRate;
+}
+
+bool harmonizerBusy() {
+    return harmonizerEnabled && !harmonizer.idle;
+}
+
+// Frames it takes for something going in to be all the way out
+int harmonizerTail() {
+    if (harmonyMode == H_PhaseVocoder)
+        return harmonizer.size * 2 + harmonizer.hop;
+    return (int)(harmonyGrain * currentSampleRate) + 2;
+}
+
+void fftPermute(float* re, float* im) {
+    auto& hz = harmonizer;
+    for (int n = 0; n < hz.size; n++) {
+        int r = hz.bitReverse[n];
+        if (r > n) {
+            std::swap(re[n], re[r]);
+            std::swap(im[n], im[r]);
+        }
+    }
+}
+
+// One radix-2 pass over bit reversed data. Inverse just conjugates the
+// twiddles and leaves the scaling to whoever uses it.
+void fftPass(float* re, float* im, int pass, bool inverse) {
+    auto& hz = harmonizer;
+    int half = 1 << pass;
+    int stride = hz.size / (half * 2);
+    float sign = inverse ? -1.0f : 1.0f;
+
+    for (int start = 0; start < hz.size; start += half * 2) {
+        for (int j = 0; j < half; j++) {
+            float wr = hz.twiddleRe[j * stride];
+            float wi = hz.twiddleIm[j * stride] * sign;
+            int a = start + j;
+            int b = a + half;
+
+            float tr = re[b] * wr - im[b] * wi;
+            float ti = re[b] * wi + im[b] * wr;
+            re[b] = re[a] - tr;
+            im[b] = im[a] - ti;
+            re[a] += tr;
+            im[a] += ti;
+        }
+    }
+}
+
+// One piece of the frame's work. The analysis is steps 0 to passes + 1,
+// then each voice takes another passes + 2.
+void harmonizerStep(int step) {
+    auto& hz = harmonizer;
+    int half = hz.size / 2;
+    float hopPhase = 2.0f * M_PI * hz.hop / hz.size;
+
+    if (step == 0) {
+        // The frame that ends on the newest sample
+        unsigned from = hz.writePos - hz.size;
+        for (int n = 0; n < hz.size; n++) {
+            hz.re[n] = hz.delay[(from + n) & (HARMONY_DELAY - 1)] * hz.window[n];
+            hz.im[n] = 0.0f;
+        }
+        fftPermute(hz.re, hz.im);
+        return;
+    }
+
+    if (step <= hz.passes) {
+        fftPass(hz.re, hz.im, step - 1, false);
+        return;
+    }
+
+    if (step == hz.passes + 1) {
+        // True frequency of each bin from how far its phase moved
+        for (int k = 0; k <= half; k++) {
+            float phase = atan2f(hz.im[k], hz.re[k]);
+            float moved = phase - hz.lastPhase[k] - k * hopPhase;
+            moved -= 2.0f * M_PI * roundf(moved / (2.0f * M_PI));
+            hz.lastPhase[k] = phase;
+
+            hz.phase[k] = phase;
+            hz.magnitude[k] = sqrtf(hz.re[k] * hz.re[k] + hz.im[k] * hz.im[k]);
+            hz.frequency[k] = k + moved / hopPhase;
+        }
+
+        // Split the spectrum into regions around each peak, the boundary
+        // being the lowest bin between two of them
+        int last = -1;
+        for (int k = 0; k <= half; k++) {
+            bool peak = (k == 0 || hz.magnitude[k] > hz.magnitude[k - 1]) &&
+                        (k == half || hz.magnitude[k] >= hz.magnitude[k + 1]);
+            if (!peak)
+                continue;
+
+            if (last < 0) {
+                for (int j = 0; j < k; j++) {
+                    hz.peakOf[j] = k;
+                }
+            } else {
+                int low = last;
+                for (int j = last; j <= k; j++) {
+                    if (hz.magnitude[j] < hz.magnitude[low])
+                        low = j;
+                }
+                for (int j = last; j <= k; j++) {
+                    hz.peakOf[j] = j < low ? last : k;
+                }
+            }
+            last = k;
+        }
+        for (int j = max(last, 0); j <= half; j++) {
+            hz.peakOf[j] = max(last, 0);
+        }
+        return;
+    }
+
+    int v = (step - hz.passes - 2) / (hz.passes + 2);
+    int vstep = (step - hz.passes - 2) % (hz.passes + 2);
+
+    if (vstep == 0) {
+        float ratio = powf(2.0f, harmonyShift[v] / 12.0f);
+
+        // Each peak's phase has to turn by the extra frequency it's gained
+        for (int k = 0; k <= half; k++) {
+            if (hz.peakOf[k] != k)
+                continue;
+            float r = hz.rotation[v][k] + (ratio - 1.0f) * hz.frequency[k] * hopPhase;
+            hz.rotationNow[k] = r - 2.0f * M_PI * floorf(r / (2.0f * M_PI));
+        }
+
+        memset(hz.voiceRe, 0, sizeof(float) * hz.size);
+        memset(hz.voiceIm, 0, sizeof(float) * hz.size);
+
+        // Regions move whole to where their peak lands, so the shape of
+        // each partial and the phases across it come through untouched
+        for (int k = 0; k <= half; k++) {
+            int peak = hz.peakOf[k];
+            int to = k + (int)(peak * ratio + 0.5f) - peak;
+            float r = hz.rotationNow[peak];
+            hz.rotation[v][k] = r;
+            if (to < 0 || to > half)
+                continue;
+
+            float phase = hz.phase[k] + r;
+            hz.voiceRe[to] += hz.magnitude[k] * cosf(phase);
+            hz.voiceIm[to] += hz.magnitude[k] * sinf(phase);
+        }
+
+        // Only half the spectrum is worked out, the rest mirrors it
+        hz.voiceIm[0] = 0.0f;
+        hz.voiceIm[half] = 0.0f;
+        for (int k = 1; k < half; k++) {
+            hz.voiceRe[hz.size - k] = hz.voiceRe[k];
+            hz.voiceIm[hz.size - k] = -hz.voiceIm[k];
+        }
+        fftPermute(hz.voiceRe, hz.voiceIm);
+    } else if (vstep <= hz.passes) {
+        fftPass(hz.voiceRe, hz.voiceIm, vstep - 1, true);
+    } else {
+        // Hann in and out at 4x overlap adds up to 1.5
+        float scale = 1.0f / (hz.size * 1.5f);
+        for (int n = 0; n < hz.size; n++) {
+            hz.accum[v][(hz.frameOut + n) & (PV_RING - 1)] += hz.voiceRe[n] * hz.window[n] * scale;
+        }
+    }
+}
+
+// Sums the shifted voices into outBus
+void processHarmonizer(int frames) {
+    auto& hz = harmonizer;
+    if (hz.sampleRate != currentSampleRate)
+        configureHarmonizer();
+
+    int channels = min(nChannels, MAX_CHANNELS);
+    int voices = (int)clamp(harmonyVoices, 1, HARMONY_VOICES);
+
+    for (int i = 0; i < frames; i++) {
+        float x = 0.0f;
+        if (harmonizeInput) {
+            for (int ch = 0; ch < nInputChannels && inputActive(); ch++) {
+                x += inBus[ch][i];
+            }
+        } else {
+            for (int ch = 0; ch < channels; ch++) {
+                x += outBus[ch][i];
+            }
+        }
+        hz.source[i] = x;
+    }
+
+    if (blockPeak(hz.source, frames) >= silenceThreshold) {
+        hz.idle = false;
+        hz.quietFrames = 0;
+    } else {
+        hz.quietFrames += frames;
+    }
+
+    if (hz.idle)
+        return;
+
+    for (int v = 0; v < HARMONY_VOICES; v++) {
+        memset(hz.out[v], 0, sizeof(float) * frames);
+    }
+
+    int grain = max((int)(harmonyGrain * currentSampleRate), 16);
+    float ratios[HARMONY_VOICES];
+    for (int v = 0; v < voices; v++) {
+        ratios[v] = powf(2.0f, harmonyShift[v] / 12.0f);
+    }
+
+    for (int i = 0; i < frames; i++) {
+        hz.delay[hz.writePos++ & (HARMONY_DELAY - 1)] = hz.source[i];
+
+        if (harmonyMode == H_TimeDomain) {
+            for (int v = 0; v < voices; v++) {
+                // The heads move through the grain at the difference in speed
+                float& phase = hz.grainPhase[v];
+                phase += (1.0f - ratios[v]) / grain;
+                phase -= floorf(phase);
+
+                float y = 0.0f;
+                for (int head = 0; head < 2; head++) {
+                    float p = phase + head * 0.5f;
+                    p -= floorf(p);
+
+                    float back = 1.0f + p * grain;
+                    int whole = (int)back;
+                    float frac = back - whole;
+                    float a = hz.delay[(hz.writePos - whole) & (HARMONY_DELAY - 1)];
+                    float b = hz.delay[(hz.writePos - whole - 1) & (HARMONY_DELAY - 1)];
+
+                    // sin^2 crossfade, the two heads always add up to one
+                    float fade = sinf(M_PI * p);
+                    y += (a + (b - a) * frac) * fade * fade;
+                }
+                hz.out[v][i] = y;
+            }
+            continue;
+        }
+
+        unsigned at = hz.readPos++ & (PV_RING - 1);
+        for (int v = 0; v < HARMONY_VOICES; v++) {
+            hz.out[v][i] = hz.accum[v][at];
+            hz.accum[v][at] = 0.0f;
+        }
+
+        if (++hz.hopPos >= hz.hop) {
+            // Whatever's left of the last frame has to be in before its
+            // output starts being read
+            while (hz.step < hz.steps) {
+                harmonizerStep(hz.step++);
+            }
+
+            hz.hopPos = 0;
+            hz.frameOut = hz.readPos + hz.hop;
+            hz.steps = (hz.passes + 2) * (1 + voices);
+            hz.step = 0;
+            harmonizerStep(hz.step++);
+        } else if (hz.step < hz.steps) {
+            int target = 1 + hz.hopPos * (hz.steps - 1) / hz.hop;
+            while (hz.step < target) {
+                harmonizerStep(hz.step++);
+            }
+        }
+    }
+
+    // Voices beyond the count are silent, so they can go in two at a time
+    float gains[HARMONY_VOICES][MAX_CHANNELS] = {};
+    for (int v = 0; v < voices; v++) {
+        computePanGains(harmonyPan[v], gains[v]);
+    }
+
+    for (int ch = 0; ch < channels; ch++) {
+        for (int v = 0; v < voices; v += 2) {
+            mixStereoInto(outBus[ch], hz.out[v], hz.out[v + 1],
+                gains[v][ch] * harmonyLevel[v], gains[v + 1][ch] * harmonyLevel[v + 1], frames);
+        }
+    }
+
+    // Everything's through, back to doing nothing
+    if (hz.quietFrames > harmonizerTail())
+        resetHarmonizer();
+}
+
+// Multiband compressor
+// ====================
+// Last stage on the master bus. The mix is split into four bands with 4th
+// order Linkwitz-Riley crossovers, which add back up flat, and each band
+// gets its own compressor, so a stack of octaves pushing the low end
+// doesn't pull the whole mix down with it. The four bands sit in the four
+// lanes of an SSE register, so every filter stage is one biquad step for
+// all of them:
+//
+//   A: split at the middle crossover, low half in lanes 0-1, high in 2-3
+//   B: lanes 0-1 split at the low crossover, lanes 2-3 at the high one
+//   C: each half allpassed at the other half's crossover, so the phase of
+//      all four bands lines up again when they're summed
+//
+// A and B are two Butterworth biquads each, which is what makes them
+// Linkwitz-Riley. Detection is linked across channels so nothing wanders
+// in the image when one side gets louder.
+
+const static int MB_BANDS = 4;
+// A twice, B twice, C once
+const static int MB_STAGES = 5;
+
+bool mbEnabled = false;
+float mbCrossovers[MB_BANDS - 1] = { 150.0f, 1000.0f, 6000.0f };
+float mbThreshold[MB_BANDS] = { -24.0f, -20.0f, -18.0f, -18.0f };
+float mbRatio[MB_BANDS] = { 4.0f, 3.0f, 2.0f, 2.0f };
+float mbAttack[MB_BANDS] = { 0.010f, 0.005f, 0.003f, 0.002f };
+float mbRelease[MB_BANDS] = { 0.200f, 0.150f, 0.100f, 0.080f };
+float mbMakeup[MB_BANDS] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+// For the UI, dB of gain reduction per band at the end of the last block
+float mbGainReduction[MB_BANDS];
+
+enum CrossoverShape {
+    X_Lowpass,
+    X_Highpass,
+    X_Allpass,
+};
+
+// One biquad per lane
+struct BiquadLanes {
+    alignas(16) float b0[4];
+    alignas(16) float b1[4];
+    alignas(16) float b2[4];
+    alignas(16) float a1[4];
+    alignas(16) float a2[4];
+};
+
+// Everything that carries over between blocks
+struct MultibandState {
+    alignas(16) float z1[MAX_CHANNELS][MB_STAGES][4];
+    alignas(16) float z2[MAX_CHANNELS][MB_STAGES][4];
+    alignas(16) float env[MB_BANDS];
+};
+
+struct Multiband {
+    BiquadLanes stages[MB_STAGES];
+    MultibandState state;
+    // Gain computer settings, in log2 units so it never needs log10
+    alignas(16) float threshold[MB_BANDS];
+    alignas(16) float slope[MB_BANDS];
+    alignas(16) float makeup[MB_BANDS];
+    alignas(16) float attack[MB_BANDS];
+    alignas(16) float release[MB_BANDS];
+    int sampleRate;
+};
+
+Multiband multiband = {};
+
+// RBJ cookbook with a Q of 1/sqrt(2). Two of the low or high passes in a
+// row make the Linkwitz-Riley, and the allpass has the same phase as the
+// pair of them summed.
+void setCrossoverLane(BiquadLanes& s, int lane, CrossoverShape shape, float freq) {
+    float w = 2.0f * M_PI * freq / currentSampleRate;
+    float cw = cosf(w);
+    float alpha = sinf(w) / (2.0f * (float)M_SQRT1_2);
+    float a0 = 1.0f + alpha;
+
+    switch (shape) {
+    case X_Lowpass:
+        s.b0[lane] = (1.0f - cw) / 2.0f / a0;
+        s.b1[lane] = (1.0f - cw) / a0;
+        s.b2[lane] = s.b0[lane];
+        break;
+    case X_Highpass:
+        s.b0[lane] = (1.0f + cw) / 2.0f / a0;
+        s.b1[lane] = -(1.0f + cw) / a0;
+        s.b2[lane] = s.b0[lane];
+        break;
+    case X_Allpass:
+        s.b0[lane] = (1.0f - alpha) / a0;
+        s.b1[lane] = -2.0f * cw / a0;
+        s.b2[lane] = 1.0f;
+        break;
+    }
+
+    s.a1[lane] = -2.0f * cw / a0;
+    s.a2[lane] = (1.0f - alpha) / a0;
+}
+
+void configureMultiband() {
+    auto& mb = multiband;
+
+    // Kept in order and clear of Nyquist whatever came in on the command line
+    float f[MB_BANDS - 1];
+    for (int i = 0; i < MB_BANDS - 1; i++) {
+        f[i] = clamp(mbCrossovers[i], 20.0f, currentSampleRate * 0.45f);
+    }
+    for (int i = 1; i < MB_BANDS - 1; i++) {
+        for (int j = i; j > 0 && f[j] < f[j - 1]; j--) {
+            std::swap(f[j], f[j - 1]);
+        }
+    }
+
+    for (int st = 0; st < 2; st++) {
+        BiquadLanes& a = mb.stages[st];
+        setCrossoverLane(a, 0, X_Lowpass, f[1]);
+        setCrossoverLane(a, 1, X_Lowpass, f[1]);
+        setCrossoverLane(a, 2, X_Highpass, f[1]);
+        setCrossoverLane(a, 3, X_Highpass, f[1]);
+
+        BiquadLanes& b = mb.stages[2 + st];
+        setCrossoverLane(b, 0, X_Lowpass, f[0]);
+        setCrossoverLane(b, 1, X_Highpass, f[0]);
+        setCrossoverLane(b, 2, X_Lowpass, f[2]);
+        setCrossoverLane(b, 3, X_Highpass, f[2]);
+    }
+
+    BiquadLanes& c = mb.stages[4];
+    setCrossoverLane(c, 0, X_Allpass, f[2]);
+    setCrossoverLane(c, 1, X_Allpass, f[2]);
+    setCrossoverLane(c, 2, X_Allpass, f[0]);
+    setCrossoverLane(c, 3, X_Allpass, f[0]);
+
+    for (int b = 0; b < MB_BANDS; b++) {
+        mb.threshold[b] = mbThreshold[b] / 6.0206f;
+        mb.slope[b] = 1.0f - 1.0f / max(mbRatio[b], 1.0f);
+        mb.makeup[b] = mbMakeup[b] / 6.0206f;
+        mb.attack[b] = 1.0f - expf(-1.0f / (max(mbAttack[b], 0.0001f) * currentSampleRate));
+        mb.release[b] = 1.0f - expf(-1.0f / (max(mbRelease[b], 0.0001f) * currentSampleRate));
+    }
+
+    mb.state = {};
+    mb.sampleRate = currentSampleRate;
+}
+
+#ifdef SYNTH_SSE
+inline __m128 biquadLanesStep(const BiquadLanes& s, float* z1p, float* z2p, __m128 x) {
+    __m128 z1 = _mm_load_ps(z1p);
+    __m128 z2 = _mm_load_ps(z2p);
+
+    __m128 y = _mm_add_ps(_mm_mul_ps(x, _mm_load_ps(s.b0)), z1);
+    z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(x, _mm_load_ps(s.b1)), _mm_mul_ps(_mm_load_ps(s.a1), y)), z2);
+    z2 = _mm_sub_ps(_mm_mul_ps(x, _mm_load_ps(s.b2)), _mm_mul_ps(_mm_load_ps(s.a2), y));
+
+    _mm_store_ps(z1p, z1);
+    _mm_store_ps(z2p, z2);
+    return y;
+}
+
+// log2 from the exponent bits and a polynomial for the mantissa, good to
+// about 1e-4, which is well under a hundredth of a dB
+inline __m128 log2Lanes(__m128 x) {
+    __m128i bits = _mm_castps_si128(x);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000)));
+
+    __m128 p = _mm_set1_ps(-0.081614486f);
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(0.64514372f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-2.1206994f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(4.070135f));
+    p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-2.5128774f));
+    return _mm_add_ps(e, p);
+}
+
+// And back again, whole part into the exponent, polynomial for the rest
+inline __m128 exp2Lanes(__m128 x) {
+    x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(126.0f)), _mm_set1_ps(-126.0f));
+
+    // Truncation rounds towards zero, so step the negatives down one
+    __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, x), _mm_set1_ps(1.0f)));
+    __m128 f = _mm_sub_ps(x, whole);
+
+    __m128 p = _mm_set1_ps(0.0096181291f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.055504109f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.24022651f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.69314718f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+
+    __m128i scale = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(scale));
+}
+#endif
+
+inline float biquadLanesStepScalar(const BiquadLanes& s, float* z1, float* z2, int lane, float x) {
+    float y = x * s.b0[lane] + z1[lane];
+    z1[lane] = x * s.b1[lane] - s.a1[lane] * y + z2[lane];
+    z2[lane] = x * s.b2[lane] - s.a2[lane] * y;
+    return y;
+}
+
+// Compresses outBus in place
+void processMultiband(int frames) {
+    auto& mb = multiband;
+    if (mb.sampleRate != currentSampleRate)
+        configureMultiband();
+
+    int channels = min(nChannels, MAX_CHANNELS);
+    MultibandState& s = mb.state;
+
+#ifdef SYNTH_SSE
+    __m128 threshold = _mm_load_ps(mb.threshold);
+    __m128 slope = _mm_load_ps(mb.slope);
+    __m128 makeup = _mm_load_ps(mb.makeup);
+    __m128 attack = _mm_load_ps(mb.attack);
+    __m128 release = _mm_load_ps(mb.release);
+    __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 env = _mm_load_ps(s.env);
+    __m128 gain = _mm_set1_ps(1.0f);
+
+    for (int i = 0; i < frames; i++) {
+        __m128 bands[MAX_CHANNELS];
+        __m128 level = _mm_setzero_ps();
+
+        for (int ch = 0; ch < channels; ch++) {
+            __m128 x = _mm_set1_ps(outBus[ch][i]);
+            for (int st = 0; st < MB_STAGES; st++) {
+                x = biquadLanesStep(mb.stages[st], s.z1[ch][st], s.z2[ch][st], x);
+            }
+            bands[ch] = x;
+            level = _mm_max_ps(level, _mm_andnot_ps(signMask, x));
+        }
+
+        __m128 rising = _mm_cmpgt_ps(level, env);
+        __m128 coef = _mm_or_ps(_mm_and_ps(rising, attack), _mm_andnot_ps(rising, release));
+        env = _mm_add_ps(env, _mm_mul_ps(_mm_sub_ps(level, env), coef));
+
+        // Everything over the threshold comes down by the slope
+        __m128 over = _mm_sub_ps(log2Lanes(_mm_max_ps(env, _mm_set1_ps(1e-20f))), threshold);
+        over = _mm_max_ps(over, _mm_setzero_ps());
+        gain = exp2Lanes(_mm_sub_ps(makeup, _mm_mul_ps(over, slope)));
+
+        for (int ch = 0; ch < channels; ch++) {
+            __m128 y = _mm_mul_ps(bands[ch], gain);
+            y = _mm_add_ps(y, _mm_movehl_ps(y, y));
+            y = _mm_add_ss(y, _mm_shuffle_ps(y, y, 1));
+            outBus[ch][i] = _mm_cvtss_f32(y);
+        }
+    }
+
+    _mm_store_ps(s.env, env);
+
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, gain);
+    for (int b = 0; b < MB_BANDS; b++) {
+        mbGainReduction[b] = mbMakeup[b] - gainToDb(lanes[b]);
+    }
+#else
+    float gain[MB_BANDS] = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+    for (int i = 0; i < frames; i++) {
+        float bands[MAX_CHANNELS][MB_BANDS];
+        float level[MB_BANDS] = {};
+
+        for (int ch = 0; ch < channels; ch++) {
+            for (int b = 0; b < MB_BANDS; b++) {
+                float x = outBus[ch][i];
+                for (int st = 0; st < MB_STAGES; st++) {
+                    x = biquadLanesStepScalar(mb.stages[st], s.z1[ch][st], s.z2[ch][st], b, x);
+                }
+                bands[ch][b] = x;
+                level[b] = max(level[b], abs(x));
+            }
+        }
+
+        for (int b = 0; b < MB_BANDS; b++) {
+            float& env = s.env[b];
+            env += (level[b] - env) * (level[b] > env ? mb.attack[b] : mb.release[b]);
+
+            float over = max(log2f(max(env, 1e-20f)) - mb.threshold[b], 0.0f);
+            gain[b] = exp2f(mb.makeup[b] - over * mb.slope[b]);
+        }
+
+        for (int ch = 0; ch < channels; ch++) {
+            float y = 0.0f;
+            for (int b = 0; b < MB_BANDS; b++) {
+                y += bands[ch][b] * gain[b];
+            }
+            outBus[ch][i] = y;
+        }
+    }
+
+    for (int b = 0; b < MB_BANDS; b++) {
+        mbGainReduction[b] = mbMakeup[b] - gainToDb(gain[b]);
+    }
+#endif
+}
+
+// Metering
+// ========
+// Sample peak, 4x oversampled true peak, RMS and K-weighted momentary and
+// short-term loudness (BS.1770) for every channel, worked out a block at a
+// time at the end of the bus. Readings go out through a seqlock so the UI
+// and the Launchkey never hold up the audio thread.
+
+// Taps per phase of the true peak interpolator
+const static int TP_TAPS = 12;
+// Loudness is gathered in 100ms bins. Momentary is the last 4 of them,
+// short-term the last 30.
+const static int LOUDNESS_BINS = 30;
+const static int RMS_BINS = 3;
+// How quickly held peaks fall back, dB a second
+const float PEAK_FALL_RATE = 20.0f;
+
+struct MeterReadings {
+    int channels;
+    float peak[MAX_CHANNELS];
+    float truePeak[MAX_CHANNELS];
+    float rms[MAX_CHANNELS];
+    float momentaryLufs;
+    float shortTermLufs;
+    // Anything over full scale in the last second
+    bool clipped;
+};
+
+struct KWeighting {
+    double b[2][3];
+    double a[2][3];
+};
+
+struct MeterState {
+    int sampleRate;
+    const SpeakerLayout* layout;
+    KWeighting coefs;
+    // Per channel, per stage
+    double kState[MAX_CHANNELS][2][2];
+    float channelWeight[MAX_CHANNELS];
+
+    // Phases 1-3 of the interpolator, backwards so they line up with
+    // the history
+    alignas(16) float tpTaps[3][TP_TAPS];
+    float tpHistory[MAX_CHANNELS][TP_TAPS + MAX_BLOCK];
+
+    double binLoudness;
+    double binSquares[MAX_CHANNELS];
+    int binFrames;
+    double loudnessBins[LOUDNESS_BINS];
+    double rmsBins[RMS_BINS][MAX_CHANNELS];
+    int binsFilled;
+    int binIdx;
+
+    float truePeakHold[MAX_CHANNELS];
+    int clipHoldFrames;
+};
+
+MeterState meter = {};
+SeqLock<MeterReadings> meterReadings;
+float kWeighted[MAX_BLOCK];
+
+// Coefficients straight from BS.1770, redone for whatever rate we're at
+void configureMeter() {
+    auto& m = meter;
+    double rate = currentSampleRate;
+
+    // High shelf
+    double f0 = 1681.974450955533;
+    double gain = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / rate);
+    double vh = pow(10.0, gain / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    m.coefs.b[0][0] = (vh + vb * k / q + k * k) / a0;
+    m.coefs.b[0][1] = 2.0 * (k * k - vh) / a0;
+    m.coefs.b[0][2] = (vh - vb * k / q + k * k) / a0;
+    m.coefs.a[0][1] = 2.0 * (k * k - 1.0) / a0;
+    m.coefs.a[0][2] = (1.0 - k / q + k * k) / a0;
+
+    // RLB high-pass
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+    m.coefs.b[1][0] = 1.0;
+    m.coefs.b[1][1] = -2.0;
+    m.coefs.b[1][2] = 1.0;
+    m.coefs.a[1][1] = 2.0 * (k * k - 1.0) / a0;
+    m.coefs.a[1][2] = (1.0 - k / q + k * k) / a0;
+
+    // Windowed sinc, phase 0 is just the sample itself
+    for (int p = 1; p < 4; p++) {
+        float sum = 0.0f;
+        float taps[TP_TAPS];
+        for (int t = 0; t < TP_TAPS; t++) {
+            float x = TP_TAPS / 2 - t - p * 0.25f;
+            float sinc = x == 0.0f ? 1.0f : sinf(M_PI * x) / (M_PI * x);
+            float window = 0.42f + 0.5f * cosf(M_PI * x / (TP_TAPS / 2)) + 0.08f * cosf(2.0f * M_PI * x / (TP_TAPS / 2));
+            taps[t] = sinc * window;
+            sum += taps[t];
+        }
+
+        for (int t = 0; t < TP_TAPS; t++) {
+            m.tpTaps[p - 1][TP_TAPS - 1 - t] = taps[t] / sum;
+        }
+    }
+
+    // Surrounds count for a bit more, the LFE not at all
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        if (ch == speakers->lfe)
+            m.channelWeight[ch] = 0.0f;
+        else if (fabsf(speakers->azimuth[ch]) >= 60.0f && speakers->ring)
+            m.channelWeight[ch] = 1.41f;
+        else
+            m.channelWeight[ch] = 1.0f;
+    }
+
+    memset(m.kState, 0, sizeof(m.kState));
+    memset(m.tpHistory, 0, sizeof(m.tpHistory));
+    m.sampleRate = currentSampleRate;
+    m.layout = speakers;
+}
+
+// K-weights one channel's block into kWeighted
+void kWeightBlock(const float* x, int frames, double state[2][2]) {
+    const auto& c = meter.coefs;
+    for (int i = 0; i < frames; i++) {
+        double v = x[i];
+        for (int st = 0; st < 2; st++) {
+            double y = c.b[st][0] * v + state[st][0];
+            state[st][0] = c.b[st][1] * v - c.a[st][1] * y + state[st][1];
+            state[st][1] = c.b[st][2] * v - c.a[st][2] * y;
+            v = y;
+        }
+        kWeighted[i] = v;
+    }
+}
+
+// Peak of the signal oversampled 4x. Reads TP_TAPS of history before x.
+float truePeak(const float* x, int frames) {
+    float peak = blockPeak(x, frames);
+    const float* hist = x - TP_TAPS + 1;
+    int i = 0;
+
+#ifdef SYNTH_SSE
+    // Four output samples per phase at a time
+    __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 peaks = _mm_setzero_ps();
+    for (; i + 4 <= frames; i += 4) {
+        for (int p = 0; p < 3; p++) {
+            __m128 acc = _mm_setzero_ps();
+            for (int t = 0; t < TP_TAPS; t++) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(hist + i + t), _mm_set1_ps(meter.tpTaps[p][t])));
+            }
+            peaks = _mm_max_ps(peaks, _mm_andnot_ps(signMask, acc));
+        }
+    }
+
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, peaks);
+    peak = fmaxf(peak, fmaxf(fmaxf(lanes[0], lanes[1]), fmaxf(lanes[2], lanes[3])));
+#endif
+    for (; i < frames; i++) {
+        for (int p = 0; p < 3; p++) {
+            float acc = 0.0f;
+            for (int t = 0; t < TP_TAPS; t++) {
+                acc += hist[i + t] * meter.tpTaps[p][t];
+            }
+            peak = fmaxf(peak, fabsf(acc));
+        }
+    }
+
+    return peak;
+}
+
+float loudnessToLufs(double meanSquare) {
+    return meanSquare > 0.0 ? -0.691 + 10.0 * log10(meanSquare) : -INFINITY;
+}
+
+// Folds the current 100ms bin into the history once it's full
+void finishMeterBin() {
+    auto& m = meter;
+    m.loudnessBins[m.binIdx % LOUDNESS_BINS] = m.binLoudness / m.binFrames;
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        m.rmsBins[m.binIdx % RMS_BINS][ch] = m.binSquares[ch] / m.binFrames;
+        m.binSquares[ch] = 0.0;
+    }
+
+    m.binIdx++;
+    m.binsFilled = min(m.binsFilled + 1, LOUDNESS_BINS);
+    m.binLoudness = 0.0;
+    m.binFrames = 0;
+}
+
+// Meters the block on outBus. Silent blocks skip the filters but still
+// let the readings fall.
+void meterBlock(int frames, bool silent) {
+    auto& m = meter;
+    int channels = min(nChannels, MAX_CHANNELS);
+
+    if (m.sampleRate != currentSampleRate || m.layout != speakers)
+        configureMeter();
+
+    MeterReadings r = {};
+    r.channels = channels;
+
+    float fall = powf(10.0f, -PEAK_FALL_RATE / 20.0f * frames / currentSampleRate);
+    float blockMax = 0.0f;
+    float blockTruePeak = 0.0f;
+
+    // Bins can end partway through the block, so it's summed in pieces
+    // that each stay inside one bin
+    const static int MAX_PIECES = 4;
+    int binLength = max(currentSampleRate / 10, MAX_BLOCK / (MAX_PIECES - 1));
+    int pieceEnd[MAX_PIECES];
+    int nPieces = 0;
+    for (int done = 0, binFrames = m.binFrames; done < frames; nPieces++) {
+        done = min(frames, done + binLength - binFrames);
+        pieceEnd[nPieces] = done;
+        binFrames = 0;
+    }
+
+    double pieceLoudness[MAX_PIECES] = {};
+    double pieceSquares[MAX_PIECES][MAX_CHANNELS] = {};
+
+    for (int ch = 0; ch < channels; ch++) {
+        float* hist = m.tpHistory[ch];
+        float tp = 0.0f;
+
+        if (!silent) {
+            memcpy(hist + TP_TAPS, outBus[ch], sizeof(float) * frames);
+            r.peak[ch] = blockPeak(hist + TP_TAPS, frames);
+            tp = truePeak(hist + TP_TAPS, frames);
+            memmove(hist, hist + frames, sizeof(float) * TP_TAPS);
+            kWeightBlock(outBus[ch], frames, m.kState[ch]);
+        } else {
+            memset(hist, 0, sizeof(float) * TP_TAPS);
+        }
+
+        blockMax = fmaxf(blockMax, r.peak[ch]);
+        blockTruePeak = fmaxf(blockTruePeak, tp);
+        m.truePeakHold[ch] = fmaxf(tp, m.truePeakHold[ch] * fall);
+        r.truePeak[ch] = m.truePeakHold[ch];
+
+        for (int p = 0, start = 0; p < nPieces && !silent; start = pieceEnd[p++]) {
+            pieceSquares[p][ch] = blockSumSquares(outBus[ch] + start, pieceEnd[p] - start);
+            pieceLoudness[p] += m.channelWeight[ch] * blockSumSquares(kWeighted + start, pieceEnd[p] - start);
+        }
+    }
+
+    for (int p = 0, start = 0; p < nPieces; start = pieceEnd[p++]) {
+        m.binLoudness += pieceLoudness[p];
+        for (int ch = 0; ch < channels; ch++) {
+            m.binSquares[ch] += pieceSquares[p][ch];
+        }
+
+        m.binFrames += pieceEnd[p] - start;
+        if (m.binFrames >= binLength)
+            finishMeterBin();
+    }
+
+    // Inter-sample overs clip in the DAC just the same
+    if (blockTruePeak > 1.0f)
+        m.clipHoldFrames = currentSampleRate;
+    else
+        m.clipHoldFrames = max(0, m.clipHoldFrames - frames);
+
+    double momentary = 0.0, shortTerm = 0.0;
+    int momentaryBins = min(4, m.binsFilled);
+    for (int b = 0; b < m.binsFilled; b++) {
+        double bin = m.loudnessBins[(m.binIdx - 1 - b + LOUDNESS_BINS) % LOUDNESS_BINS];
+        if (b < momentaryBins)
+            momentary += bin;
+        shortTerm += bin;
+    }
+
+    r.momentaryLufs = momentaryBins ? loudnessToLufs(momentary / momentaryBins) : -INFINITY;
+    r.shortTermLufs = m.binsFilled ? loudnessToLufs(shortTerm / m.binsFilled) : -INFINITY;
+
+    int rmsBins = min(RMS_BINS, m.binsFilled);
+    for (int ch = 0; ch < channels; ch++) {
+        double sum = 0.0;
+        for (int b = 0; b < rmsBins; b++) {
+            sum += m.rmsBins[b][ch];
+        }
+        r.rms[ch] = rmsBins ? sqrt(sum / rmsBins) : 0.0f;
+    }
+
+    r.clipped = m.clipHoldFrames > 0;
+    lastBlockPeak = blockMax;
+    meterReadings.store(r);
+}
+
+// Renders up to MAX_BLOCK frames into outBus
+void renderBlock(int frames) {
+    blockClock.store({ getWallTime(), engineFrame, currentSampleRate, timeAccumulator });
+
+    // Notes and parameter changes from everyone else land here
+    journalBlockStart(frames);
+    runParamRamps();
+
+    TuningTable* nextTuning = pendingTuning.exchange(nullptr);
+    if (nextTuning) {
+        arenaRetire(currentTuning.exchange(nextTuning));
+        journalTuningSwap();
+    }
+
+    blockTuning = currentTuning;
+    updateSampleRoot();
+    blockBendRatio = pow(2.0, pitchBendAmt / 12.0);
+    fillParamCurves(frames);
+    updateUnisonTables();
+
+    // Sequencer goes first so steps landing in this block get rendered
+    sequencerProcess(engineFrame, frames, timeAccumulator);
+
+    // Silence fast path. Nothing is playing and whatever was playing has
+    // died away, so there's no point running the voices at all. Live
+    // input always needs the full path.
+    if (!anyVoiceActive() && lastBlockPeak < silenceThreshold && !inputActive() && !harmonizerBusy()) {
+        for (int ch = 0; ch < nChannels && ch < MAX_CHANNELS; ch++) {
+            memset(outBus[ch], 0, sizeof(float) * frames);
+        }
+
+        timeAccumulator += frames / (double)currentSampleRate;
+        engineFrame += frames;
+
+        // A running sequencer needs the clock to keep ticking
+        if (sequencerWantsAudio())
+            idleTime = 0.0;
+        else
+            idleTime += frames / (double)currentSampleRate;
+
+        // Can't pause the device from inside its own callback, so ask the
+        // main thread to do it
+        if (idleSuspendSeconds >= 0.0f && idleTime >= idleSuspendSeconds)
+            audioSuspendRequested = true;
+
+        meterBlock(frames, true);
+        return;
+    }
+
+    idleTime = 0.0;
+
+    renderVoices(frames, timeAccumulator);
+    processMasterBus(frames);
+    if (harmonizerEnabled)
+        processHarmonizer(frames);
+    if (mbEnabled)
+        processMultiband(frames);
+    meterBlock(frames, false);
+
+    timeAccumulator += frames / (double)currentSampleRate;
+    engineFrame += frames;
+}
+
+// Network output
+// ==============
+// Sends the final mix out as RTP the way AES67 gear expects it: L24 or L16
+// big endian samples, one packet every rtpPacketMs, dynamic payload type.
+// The audio thread only fills packets and queues them. A sender thread
+// puts them on the wire, each one when the sample clock says its last
+// frame has been rendered, so they leave evenly spaced however lumpy the
+// device's callbacks are. The SDP receivers need is printed on startup.
+
+#ifdef _WIN32
+typedef SOCKET NetSocket;
+const static NetSocket NO_SOCKET = INVALID_SOCKET;
+#else
+typedef int NetSocket;
+const static NetSocket NO_SOCKET = -1;
+#endif
+
+// Keeps packets inside a 1500 byte MTU
+const static int RTP_MAX_PAYLOAD = 1440;
+const static int RTP_PAYLOAD_TYPE = 96;
+
+bool rtpEnabled = false;
+const char* rtpAddress = "127.0.0.1";
+int rtpPort = 5004;
+int rtpBits = 24;
+float rtpPacketMs = 1.0f;
+
+struct RtpPacket {
+    uint64_t frame;
+    int frames;
+    int bytes;
+    uint8_t payload[RTP_MAX_PAYLOAD];
+};
+
+SpscRing<RtpPacket, 64> rtpQueue;
+// The one the audio thread is filling
+RtpPacket rtpFilling;
+int rtpPacketFrames = 48;
+std::atomic<bool> rtpRunning { false };
+// Packets the sender didn't take in time
+std::atomic<unsigned> rtpDropped { 0 };
+
+NetSocket rtpSocket = NO_SOCKET;
+sockaddr_in rtpDest;
+bool rtpMulticast = false;
+// What the packets and the SDP were sized for
+int rtpRate = 0;
+int rtpChannels = 0;
+
+void configureRtp();
+
+void netStartup() {
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+}
+
+void closeSocket(NetSocket sock) {
+#ifdef _WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+// Audio thread. Quantizes the block that was just rendered into packets.
+void rtpBlock(int frames) {
+    if (!rtpRunning)
+        return;
+
+    int sampleBytes = rtpBits / 8;
+    int frameBytes = nChannels * sampleBytes;
+    // configureRtp keeps it in, this is in case the channels changed first
+    int packetFrames = min(rtpPacketFrames, RTP_MAX_PAYLOAD / frameBytes);
+    int packetBytes = packetFrames * frameBytes;
+    const float scale = (float)(1 << (rtpBits - 1));
+    const float ditherAmount = ditherMode == D_Off ? 0.0f : 1.0f;
+    uint64_t blockFrame = engineFrame - frames;
+
+    for (int i = 0; i < frames; i++) {
+        if (rtpFilling.bytes == 0)
+            rtpFilling.frame = blockFrame + i;
+
+        uint8_t* out = rtpFilling.payload + rtpFilling.bytes;
+        for (int ch = 0; ch < nChannels; ch++) {
+            float q = nearbyintf(outBus[ch][i] * scale + (ditherNoise() + ditherNoise()) * ditherAmount);
+            int32_t sample = (int32_t)clamp(q, -scale, scale - 1.0f);
+
+            // Network order, most significant byte first
+            for (int b = 0; b < sampleBytes; b++) {
+                *out++ = (uint8_t)(sample >> (8 * (sampleBytes - 1 - b)));
+            }
+        }
+        rtpFilling.bytes += frameBytes;
+        rtpFilling.frames++;
+
+        if (rtpFilling.bytes >= packetBytes) {
+            if (!rtpQueue.push(rtpFilling))
+                rtpDropped++;
+            rtpFilling.bytes = 0;
+            rtpFilling.frames = 0;
+        }
+    }
+}
+
+void rtpSenderThread() {
+    uint8_t packet[12 + RTP_MAX_PAYLOAD];
+    uint32_t ssrc = (uint32_t)SDL_GetPerformanceCounter() * 2654435761u;
+    uint16_t sequence = (uint16_t)(ssrc >> 16);
+    uint32_t timestampOffset = ssrc * 2246822519u;
+
+    while (rtpRunning) {
+        RtpPacket p;
+        if (!rtpQueue.pop(p)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        double sendAt = frameToWallTime((double)(p.frame + p.frames));
+        double wait = sendAt - getWallTime();
+
+        // Sleep most of the way, then spin for the last bit
+        if (wait > 0.002)
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait - 0.001));
+        while (getWallTime() < sendAt) {}
+
+        uint32_t timestamp = (uint32_t)p.frame + timestampOffset;
+        packet[0] = 0x80;
+        packet[1] = RTP_PAYLOAD_TYPE;
+        packet[2] = sequence >> 8;
+        packet[3] = sequence & 0xff;
+        for (int b = 0; b < 4; b++) {
+            packet[4 + b] = (uint8_t)(timestamp >> (24 - 8 * b));
+            packet[8 + b] = (uint8_t)(ssrc >> (24 - 8 * b));
+        }
+        memcpy(packet + 12, p.payload, p.bytes);
+        sequence++;
+
+        sendto(rtpSocket, (const char*)packet, 12 + p.bytes, 0, (sockaddr*)&rtpDest, sizeof(rtpDest));
+    }
+}
+
+// Opens the socket and works out the packet size. Call once the output
+// is open so the rate and channel count are known.
+bool startRtp() {
+    netStartup();
+    if (rtpBits != 16)
+        rtpBits = 24;
+
+    memset(&rtpDest, 0, sizeof(rtpDest));
+    rtpDest.sin_family = AF_INET;
+    rtpDest.sin_port = htons(rtpPort);
+    if (inet_pton(AF_INET, rtpAddress, &rtpDest.sin_addr) != 1) {
+        fprintf(stderr, "bad RTP address: %s\n", rtpAddress);
+        return false;
+    }
+
+    rtpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (rtpSocket == NO_SOCKET) {
+        fprintf(stderr, "couldn't open RTP socket\n");
+        return false;
+    }
+
+    // Expedited forwarding, like AES67 asks for media
+    int tos = 46 << 2;
+    setsockopt(rtpSocket, IPPROTO_IP, IP_TOS, (const char*)&tos, sizeof(tos));
+
+    rtpMulticast = (ntohl(rtpDest.sin_addr.s_addr) >> 28) == 14;
+    if (rtpMulticast) {
+        unsigned char ttl = 16;
+        unsigned char loop = 1;
+        setsockopt(rtpSocket, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+        setsockopt(rtpSocket, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop));
+    }
+
+    configureRtp();
+    rtpRunning = true;
+    return true;
+}
+
+// Sizes packets for the current rate and channel count and prints the SDP
+// for them. Again whenever the output reopens with either changed, with the
+// audio thread stopped, which also throws away the packet half filled in
+// the old format.
+void configureRtp() {
+    rtpRate = currentSampleRate;
+    rtpChannels = nChannels;
+
+    int sampleBytes = rtpBits / 8;
+    int maxFrames = RTP_MAX_PAYLOAD / (nChannels * sampleBytes);
+    rtpPacketFrames = (int)clamp(nearbyint(currentSampleRate * rtpPacketMs / 1000.0), 1.0, (double)maxFrames);
+    if (rtpPacketFrames != (int)nearbyint(currentSampleRate * rtpPacketMs / 1000.0))
+        fprintf(stderr, "RTP packets cut down to %i frames to fit the MTU\n", rtpPacketFrames);
+
+    printf("RTP output to %s:%i, SDP:\n", rtpAddress, rtpPort);
+    printf("v=0\n");
+    printf("o=- 0 0 IN IP4 %s\n", rtpAddress);
+    printf("s=synth\n");
+    printf(rtpMulticast ? "c=IN IP4 %s/16\n" : "c=IN IP4 %s\n", rtpAddress);
+    printf("t=0 0\n");
+    printf("m=audio %i RTP/AVP %i\n", rtpPort, RTP_PAYLOAD_TYPE);
+    printf("a=rtpmap:%i L%i/%i/%i\n", RTP_PAYLOAD_TYPE, rtpBits, currentSampleRate, nChannels);
+    printf("a=ptime:%g\n", rtpPacketFrames * 1000.0 / currentSampleRate);
+    printf("a=ts-refclk:local\n");
+    printf("a=mediaclk:direct=0\n");
+
+    rtpFilling.bytes = 0;
+    rtpFilling.frames = 0;
+}
+
+void stopRtp() {
+    if (rtpSocket == NO_SOCKET)
+        return;
+
+    closeSocket(rtpSocket);
+    rtpSocket = NO_SOCKET;
+    if (rtpDropped > 0)
+        printf("RTP: %u packets dropped\n", (unsigned)rtpDropped);
+}
+
+// Keeps a copy of the block for the oscilloscope. done is how far into
+// the device's buffer the block starts.
+void keepScopeCopy(int done, int frames) {
+    for (int i = 0; i < frames && done + i < SCOPE_FRAMES; i++) {
+        lastBufferL[done + i] = outBus[0][i];
+        lastBufferR[done + i] = outBus[nChannels > 1 ? 1 : 0][i];
+    }
+}
+
+// Input stats
+// -----------
+// Only kept while the MIDI stress test runs, one set for the quiet
+// baseline and one for the flood. Latency is from an input being queued
+// to the start of the block that applies it. Load is how long a callback
+// took over how long it had.
+
+const static int LATENCY_BINS = 10000;
+const double LATENCY_BIN_SECONDS = 0.00002;
+// In percent
+const static int LOAD_BINS = 400;
+
+struct InputStats {
+    std::atomic<uint32_t> latency[LATENCY_BINS + 1];
+    std::atomic<uint32_t> load[LOAD_BINS + 1];
+    std::atomic<uint32_t> applied;
+    std::atomic<uint32_t> callbacks;
+    std::atomic<uint32_t> overruns;
+    std::atomic<uint32_t> highWater;
+    std::atomic<double> maxLatency;
+    std::atomic<double> maxLoad;
+};
+
+InputStats inputStats[2];
+// -1 when not collecting
+std::atomic<int> statsPhase { -1 };
+
+void recordInputLatency(int phase, double seconds) {
+    InputStats& st = inputStats[phase];
+    int bin = (int)min(max(seconds, 0.0) / LATENCY_BIN_SECONDS, (double)LATENCY_BINS);
+    st.latency[bin].fetch_add(1, std::memory_order_relaxed);
+    st.applied.fetch_add(1, std::memory_order_relaxed);
+    if (seconds > st.maxLatency.load(std::memory_order_relaxed))
+        st.maxLatency.store(seconds, std::memory_order_relaxed);
+}
+
+// Called at the end of a callback that started at wall time start
+void recordCallbackLoad(double start, int frames) {
+    int phase = statsPhase.load(std::memory_order_relaxed);
+    if (phase < 0 || frames == 0)
+        return;
+
+    InputStats& st = inputStats[phase];
+    double load = (getWallTime() - start) * currentSampleRate / frames * 100.0;
+    st.load[(int)min(load, (double)LOAD_BINS)].fetch_add(1, std::memory_order_relaxed);
+    st.callbacks.fetch_add(1, std::memory_order_relaxed);
+    if (load > 100.0)
+        st.overruns.fetch_add(1, std::memory_order_relaxed);
+    if (load > st.maxLoad.load(std::memory_order_relaxed))
+        st.maxLoad.store(load, std::memory_order_relaxed);
+}
+
+void audioCallback(void*, Uint8* stream, int len) {
+    onRealtimeThread = true;
+    double start = getWallTime();
+    int frameBytes = outputSampleBytes() * nChannels;
+    int frames = len / frameBytes;
+
+    for (int done = 0; done < frames;) {
+        int chunk = min(frames - done, MAX_BLOCK);
+        renderBlock(chunk);
+        interleaveBus(stream + done * frameBytes, chunk);
+        keepScopeCopy(done, chunk);
+        rtpBlock(chunk);
+
+        done += chunk;
+    }
+
+    recordCallbackLoad(start, frames);
+}
+
+const std::unordered_map<SDL_Scancode, int> freqs = {
+    { SDL_SCANCODE_Z, 48 },
+    { SDL_SCANCODE_S, 49 },
+    { SDL_SCANCODE_X, 50 },
+    { SDL_SCANCODE_D, 51 },
     { SDL_SCANCODE_C, 52 },
     { SDL_SCANCODE_V, 53 },
     { SDL_SCANCODE_G, 54 },
@@ -370,59 +4080,2281 @@ const std::unordered_map<SDL_Scancode, int> freqs = {
     { SDL_SCANCODE_SEMICOLON, 63 },
     { SDL_SCANCODE_SLASH, 64 },
 
-    { SDL_SCANCODE_Q, 60 },
-    { SDL_SCANCODE_2, 61 },
-    { SDL_SCANCODE_W, 62 },
-    { SDL_SCANCODE_3, 63 },
-    { SDL_SCANCODE_E, 64 },
-    { SDL_SCANCODE_R, 65 },
-    { SDL_SCANCODE_5, 66 },
-    { SDL_SCANCODE_T, 67 },
-    { SDL_SCANCODE_6, 68 },
-    { SDL_SCANCODE_Y, 69 },
-    { SDL_SCANCODE_7, 70 },
-    { SDL_SCANCODE_U, 71 },
-    { SDL_SCANCODE_I, 72 },
-    { SDL_SCANCODE_9, 73 },
-    { SDL_SCANCODE_O, 74 },
-    { SDL_SCANCODE_0, 75 },
-    { SDL_SCANCODE_P, 76 },
-    { SDL_SCANCODE_LEFTBRACKET, 77 },
-    { SDL_SCANCODE_EQUALS, 78 },
-    { SDL_SCANCODE_RIGHTBRACKET, 79 }
+    { SDL_SCANCODE_Q, 60 },
+    { SDL_SCANCODE_2, 61 },
+    { SDL_SCANCODE_W, 62 },
+    { SDL_SCANCODE_3, 63 },
+    { SDL_SCANCODE_E, 64 },
+    { SDL_SCANCODE_R, 65 },
+    { SDL_SCANCODE_5, 66 },
+    { SDL_SCANCODE_T, 67 },
+    { SDL_SCANCODE_6, 68 },
+    { SDL_SCANCODE_Y, 69 },
+    { SDL_SCANCODE_7, 70 },
+    { SDL_SCANCODE_U, 71 },
+    { SDL_SCANCODE_I, 72 },
+    { SDL_SCANCODE_9, 73 },
+    { SDL_SCANCODE_O, 74 },
+    { SDL_SCANCODE_0, 75 },
+    { SDL_SCANCODE_P, 76 },
+    { SDL_SCANCODE_LEFTBRACKET, 77 },
+    { SDL_SCANCODE_EQUALS, 78 },
+    { SDL_SCANCODE_RIGHTBRACKET, 79 }
+};
+
+// Device failover
+// ===============
+// USB interfaces drop out. When SDL says the output's gone it's opened
+// again straight away: the same device if it's still there, then the
+// backup, then whatever the system default is. Nothing in the engine is
+// touched, so voices, the sequencer and the journal carry on where they
+// were, just at the new device's rate and buffer size. If nothing will
+// open it keeps trying every half second, and sooner if a device turns
+// up. The dummy driver never loses a device, so --inject-device-loss
+// fakes the event every so many seconds to test with.
+
+const char* outputDeviceName = nullptr;
+const char* backupDeviceName = nullptr;
+// What was asked for on the command line, 0 for whatever the device likes
+SDL_AudioFormat outputFormatWanted = 0;
+float injectDeviceLossSeconds = 0.0f;
+bool audioDeviceLost = false;
+double nextReopenTime = 0.0;
+
+bool openOutput(const char* deviceName) {
+    // Unless told otherwise we ask for float but take whatever the
+    // device would rather have
+    bool anyFormat = outputFormatWanted == 0;
+
+    SDL_AudioSpec want;
+    want.format = anyFormat ? AUDIO_F32SYS : outputFormatWanted;
+    want.samples = bufSize;
+    want.freq = 44100;
+    want.userdata = nullptr;
+    want.channels = nChannels;
+    want.callback = audioCallback;
+    want.silence = 0;
+
+    SDL_AudioSpec got;
+
+    int allowed = SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE;
+    audioDevice = SDL_OpenAudioDevice(deviceName, 0, &want, &got, allowed | (anyFormat ? SDL_AUDIO_ALLOW_FORMAT_CHANGE : 0));
+
+    // Anything we can't write ourselves (U8, other endian) goes back to
+    // float and SDL converts it
+    if (audioDevice != 0 && got.format != AUDIO_F32SYS && got.format != AUDIO_S16SYS && got.format != AUDIO_S32SYS) {
+        SDL_CloseAudioDevice(audioDevice);
+        want.format = AUDIO_F32SYS;
+        audioDevice = SDL_OpenAudioDevice(deviceName, 0, &want, &got, allowed);
+    }
+
+    if (audioDevice == 0) {
+        // Once is enough while it's retrying
+        if (!audioDeviceLost)
+            fprintf(stderr, "failed to open audio device %s: %s\n", deviceName ? deviceName : "(default)", SDL_GetError());
+        outputFormat = AUDIO_F32SYS;
+        return false;
+    }
+
+    outputFormat = got.format;
+    printf("output: %s, %i Hz, %i frames, %s%s, %i bits\n", deviceName ? deviceName : "default", got.freq, got.samples,
+        SDL_AUDIO_ISFLOAT(outputFormat) ? "float" : "int",
+        SDL_AUDIO_ISFLOAT(outputFormat) || ditherMode == D_Off ? "" : ditherMode == D_Shaped ? " (shaped dither)" : " (dither)",
+        SDL_AUDIO_BITSIZE(outputFormat));
+
+    bufSize = got.samples;
+    setSampleRate(got.freq);
+    setChannelCount(got.channels);
+    // Opens paused, so the audio thread isn't in rtpBlock
+    if (rtpRunning && (rtpRate != currentSampleRate || rtpChannels != nChannels)) {
+        printf("output format changed, new RTP stream\n");
+        configureRtp();
+    }
+    return true;
+}
+
+// Capture runs at the output's rate, so it has to follow it to a new one
+void reopenInput() {
+    if (!captureWanted)
+        return;
+
+    if (audioDevice != 0)
+        SDL_LockAudioDevice(audioDevice);
+    if (captureDevice != 0)
+        SDL_CloseAudioDevice(captureDevice);
+    captureDevice = 0;
+    openInput(captureDeviceName, captureWantChannels);
+    if (audioDevice != 0)
+        SDL_UnlockAudioDevice(audioDevice);
+
+    if (captureDevice != 0)
+        SDL_PauseAudioDevice(captureDevice, 0);
+}
+
+// Main thread. Closes what's left of the output and opens the first
+// device that'll have us.
+void reopenOutput() {
+    std::lock_guard<std::mutex> lock(audioSuspendMutex);
+    double start = getWallTime();
+    int oldRate = currentSampleRate;
+
+    if (audioDevice != 0)
+        SDL_CloseAudioDevice(audioDevice);
+    audioDevice = 0;
+
+    bool opened = openOutput(outputDeviceName);
+    if (!opened && backupDeviceName)
+        opened = openOutput(backupDeviceName);
+    if (!opened && outputDeviceName)
+        opened = openOutput(nullptr);
+
+    if (!opened) {
+        if (!audioDeviceLost)
+            fprintf(stderr, "no output device, trying again every 500ms\n");
+        audioDeviceLost = true;
+        nextReopenTime = getWallTime() + 0.5;
+        return;
+    }
+
+    // The DSP clock stood still while there was no device, the same as
+    // coming back from a suspend. The callback can't be running yet.
+    timeAccumulator = getWallTime();
+    audioDeviceLost = false;
+
+    if (currentSampleRate != oldRate)
+        reopenInput();
+
+    // A suspended engine stays that way, waking it unpauses the new device
+    if (!audioSuspended)
+        SDL_PauseAudioDevice(audioDevice, 0);
+
+    printf("output back after %.1f ms\n", (getWallTime() - start) * 1000.0);
+}
+
+// Both loops hand their audio device events here
+void handleAudioDeviceEvent(const SDL_Event& evt) {
+    if (evt.type == SDL_AUDIODEVICEREMOVED) {
+        if (evt.adevice.iscapture) {
+            if (captureDevice != 0 && evt.adevice.which == captureDevice) {
+                printf("capture device lost\n");
+                reopenInput();
+            }
+        } else if (audioDevice != 0 && evt.adevice.which == audioDevice) {
+            printf("output device lost\n");
+            reopenOutput();
+        }
+    } else if (evt.type == SDL_AUDIODEVICEADDED && !evt.adevice.iscapture && audioDeviceLost) {
+        reopenOutput();
+    }
+}
+
+// Pretends the output went away, from any thread
+void injectDeviceLoss() {
+    if (audioDevice == 0)
+        return;
+
+    SDL_Event evt = {};
+    evt.type = SDL_AUDIODEVICEREMOVED;
+    evt.adevice.which = audioDevice;
+    evt.adevice.iscapture = 0;
+    SDL_PushEvent(&evt);
+}
+
+// Pauses the audio device if the callback has been idle long enough, and
+// keeps trying to get a lost one back. Called from the main thread.
+void resumeAudioDevice();
+
+void serviceAudioDevice() {
+    if (audioDeviceLost && getWallTime() >= nextReopenTime)
+        reopenOutput();
+
+    if (!audioSuspendRequested.exchange(false))
+        return;
+
+    std::lock_guard<std::mutex> lock(audioSuspendMutex);
+    if (audioSuspended || anyVoiceActive() || engineInputsPending())
+        return;
+
+    SDL_PauseAudioDevice(audioDevice, 1);
+    audioSuspended = true;
+
+    // Anyone who queued something before seeing the flag go up didn't wake
+    // us, so look again now it's up. Pairs with the fence in
+    // wakeAudioDevice: one side or the other sees the input.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (engineInputsPending()) {
+        resumeAudioDevice();
+        return;
+    }
+
+    printf("audio idle, device suspended\n");
+}
+
+// With audioSuspendMutex held and the device paused
+void resumeAudioDevice() {
+    // The DSP clock stood still while we were paused. Keyboard notes are
+    // stamped with wall time, so catch back up before anything plays.
+    // The callback isn't running while paused so this is safe to touch.
+    timeAccumulator = getWallTime();
+    idleTime = 0.0;
+    lastBlockPeak = 0.0f;
+
+    audioSuspended = false;
+    SDL_PauseAudioDevice(audioDevice, 0);
+}
+
+// Brings a suspended audio device back. Call after queueing the input that
+// needs it. Only locks when the device really is suspended, when there's no
+// audio running for it to hold up, so MIDI reader threads can use it. Never
+// from the audio callback, which pausing waits on, or JACK's process
+// thread.
+void wakeAudioDevice() {
+    if (onRealtimeThread)
+        return;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!audioSuspended)
+        return;
+
+    std::lock_guard<std::mutex> lock(audioSuspendMutex);
+    if (audioSuspended)
+        resumeAudioDevice();
+}
+
+void setNoteOn(int note, double currTime, float velocity = 1.0f, int playedNote = -1) {
+    if (noteAlreadyDown(note))
+        return;
+
+    int voiceSlot = getFreeVoiceIdx();
+    auto& v = voices[voiceSlot];
+    v.note = note;
+    v.playedNote = playedNote >= 0 ? playedNote : note;
+    v.freq = currentTuning.load()->freq[tuningIndex(note)];
+    v.volume = 1.0;
+    v.velocity = velocity;
+    v.noteVolume = 1.0f;
+    v.bendRatio = 1.0;
+
+    // Spread the unison phases out so they don't all start in step
+    for (int i = 0; i < MAX_UNISON; i++) {
+        v.phase[i] = fmod(i * 0.618034, 1.0);
+    }
+    v.pressTime = currTime;
+    v.lpAccumL = 0.0f;
+    v.lpAccumR = 0.0f;
+    v.model = voiceModel;
+    // Nothing loaded to play
+    if (v.model == V_Sample && !sampleData)
+        v.model = V_Oscillator;
+    if (v.model == V_Sample)
+        startSampleVoice(voiceSlot);
+    v.stringStart = true;
+
+    if (voiceSpread >= 360.0f) {
+        v.azimuth = nextPanSlot * 360.0f / NUM_VOICES;
+    } else {
+        v.azimuth = -voiceSpread * 0.5f + voiceSpread * nextPanSlot / (NUM_VOICES - 1);
+    }
+    v.startAzimuth = v.azimuth;
+    nextPanSlot = (nextPanSlot + 1) % NUM_VOICES;
+
+    v.finishedPlaying = false;
+
+    //printf("note on: %i (at %f)\n", v.note, v.pressTime);
+}
+
+void setNoteOff(int note, double currTime) { 
+    while (true) {
+        int voiceSlot = getVoiceWithNote(note);
+
+        if (voiceSlot == -1) {
+            break;
+        }
+
+        auto& v = voices[voiceSlot];
+        v.volume = 0.0;
+        v.releaseTime = currTime;
+
+        //printf("note off: %i at %f (started at %f)\n", note, v.releaseTime, v.pressTime);
+    }
+}
+
+// Plays a note along with whatever octaves octaveMode stacks on top of it
+void playNoteOn(int note, double currTime, float velocity = 1.0f) {
+    setNoteOn(note, currTime, velocity);
+    for (int i = 0; i < (int)octaveMode; i++) {
+        setNoteOn(note + 12 * (i + 1), currTime, velocity, note);
+    }
+}
+
+void playNoteOff(int note, double currTime) {
+    setNoteOff(note, currTime);
+    for (int i = 0; i < (int)octaveMode; i++) {
+        setNoteOff(note + 12 * (i + 1), currTime);
+    }
+}
+
+enum NoteControl {
+    // Semitones
+    N_Bend,
+    N_Volume,
+    // Degrees, same as the voice's azimuth
+    N_Pan,
+    // Back to how the note started
+    N_Reset,
+};
+
+// Per-note expression. Goes to every voice the note is sounding on,
+// octaves included, and to its release tail too.
+void setNoteControl(int note, NoteControl control, double value) {
+    for (int i = 0; i < NUM_VOICES; i++) {
+        auto& v = voices[i];
+        // Octaves stacked on the note follow it, a key held an octave up
+        // doesn't
+        if (v.finishedPlaying || v.playedNote != note)
+            continue;
+
+        switch (control) {
+        case N_Bend: v.bendRatio = pow(2.0, value / 12.0); break;
+        case N_Volume: v.noteVolume = clamp(value, 0.0, 2.0); break;
+        case N_Pan: v.azimuth = value; break;
+        case N_Reset:
+            v.bendRatio = 1.0;
+            v.noteVolume = 1.0f;
+            v.azimuth = v.startAzimuth;
+            break;
+        }
+    }
+}
+
+
+// Sequencer
+// =========
+// Arpeggiator and step sequencer, both run from the audio callback. Every
+// step is stamped with the time of its exact frame, so timing doesn't
+// depend on the buffer size.
+
+enum class SeqMode {
+    Off,
+    Arp,
+    Step
+};
+
+enum ArpPattern {
+    A_Up,
+    A_Down,
+    A_UpDown,
+    A_Random,
+    A_Count
+};
+
+const char* arpPatternNames[A_Count] = { "up", "down", "up/down", "random" };
+
+const static int SEQ_STEPS = 16;
+const static int SEQ_REST = -128;
+// MIDI clock runs at 24 ticks per quarter note
+const static int MIDI_CLOCK_PPQN = 24;
+
+SeqMode seqMode = SeqMode::Off;
+ArpPattern arpPattern = A_Up;
+int arpOctaves = 1;
+float seqTempo = 120.0f;
+int seqStepsPerBeat = 4;
+// Fraction of a step each note is held for
+float seqGate = 0.5f;
+bool seqSyncToMidiClock = false;
+bool seqSendClock = false;
+
+// Set every block by backends that have a transport (JACK). While it's
+// valid, which means rolling, the sequencer takes its position and tempo
+// from it instead of counting frames itself. Audio thread only.
+struct TransportState {
+    bool valid;
+    bool rolling;
+    // Position in beats at engine frame `frame`
+    double beat;
+    uint64_t frame;
+    double bpm;
+};
+
+TransportState transport = {};
+
+// Step pattern, in semitones from seqRoot
+int seqPattern[SEQ_STEPS] = {
+    0, 12, 7, SEQ_REST, 3, 12, 10, 7,
+    0, SEQ_REST, 12, 15, 7, 3, 10, 12
+};
+
+// Notes held down while the sequencer has the keyboard, as a 128 bit mask
+std::atomic<uint64_t> seqHeldNotes[2];
+// Step mode transposes to the last note pressed
+std::atomic<int> seqRoot { 48 };
+// Which step is playing, for the UI
+std::atomic<int> seqCurrentStep { -1 };
+
+bool sequencerTakesNotes() {
+    return seqMode != SeqMode::Off;
+}
+
+void sequencerNoteOn(int note) {
+    if (note < 0 || note > 127)
+        return;
+
+    seqHeldNotes[note / 64].fetch_or(1ull << (note % 64));
+    seqRoot = note;
+}
+
+void sequencerNoteOff(int note) {
+    if (note < 0 || note > 127)
+        return;
+
+    seqHeldNotes[note / 64].fetch_and(~(1ull << (note % 64)));
+}
+
+// Keyboard and MIDI notes come through here, so the sequencer can take
+// them over when it's running
+void inputNoteOn(int note, double currTime, float velocity = 1.0f) {
+    if (sequencerTakesNotes()) {
+        sequencerNoteOn(note);
+    } else {
+        playNoteOn(note, currTime, velocity);
+    }
+}
+
+void inputNoteOff(int note, double currTime) {
+    // Always release, in case the sequencer got switched on mid-note
+    sequencerNoteOff(note);
+    playNoteOff(note, currTime);
+}
+
+// MIDI clock in
+// -------------
+// Incoming 0xF8 ticks are timestamped on arrival, which is only as good as
+// the MIDI thread's scheduling. A PLL tracks the tick period and phase in
+// engine frames and filters that jitter out. The audio thread then places
+// steps on the PLL's predicted ticks.
+
+struct ClockPLL {
+    // Filtered frame of tick number `tick`
+    double tickFrame;
+    // Frames per tick
+    double period;
+    int64_t tick;
+    double lastWallTime;
+    bool locked;
+    bool running;
+};
+
+// Loop gains. Phase gets pulled towards each measured tick, the period
+// follows more slowly. Roughly critically damped.
+const double PLL_PHASE_GAIN = 0.05;
+const double PLL_PERIOD_GAIN = 0.000625;
+// Longest gap between ticks before we decide the clock went away
+const double PLL_TIMEOUT = 0.5;
+
+// Only touched from the MIDI thread, published through midiClock
+ClockPLL pllState;
+SeqLock<ClockPLL> midiClock;
+std::atomic<bool> midiClockStarted { false };
+
+void midiClockTick(double wallTime) {
+    auto& p = pllState;
+
+    // Aim for the note to be heard when the tick arrived, rather than a
+    // buffer later
+    double measured = wallTimeToFrame(wallTime) - bufSize;
+
+    if (p.locked && wallTime - p.lastWallTime > PLL_TIMEOUT)
+        p.locked = false;
+
+    p.tick++;
+
+    if (!p.locked) {
+        if (p.lastWallTime > 0.0 && wallTime - p.lastWallTime < PLL_TIMEOUT) {
+            p.period = measured - p.tickFrame;
+            p.locked = p.period > 0.0;
+        }
+        p.tickFrame = measured;
+    } else {
+        double predicted = p.tickFrame + p.period;
+        double err = measured - predicted;
+
+        // Way off, the tempo must have jumped. Start again from here.
+        if (fabs(err) > p.period) {
+            p.locked = false;
+            p.tickFrame = measured;
+        } else {
+            p.tickFrame = predicted + err * PLL_PHASE_GAIN;
+            p.period += err * PLL_PERIOD_GAIN;
+        }
+    }
+
+    p.lastWallTime = wallTime;
+    midiClock.store(p);
+}
+
+void midiClockStart(bool fromTop) {
+    // The first tick after a start is the downbeat
+    if (fromTop) {
+        pllState.tick = -1;
+        midiClockStarted = true;
+    }
+
+    pllState.running = true;
+    midiClock.store(pllState);
+}
+
+void midiClockStop() {
+    pllState.running = false;
+    midiClock.store(pllState);
+}
+
+double pllFrameForTick(const ClockPLL& c, int64_t tick) {
+    return c.tickFrame + (tick - c.tick) * c.period;
+}
+
+// MIDI clock out
+// --------------
+// The audio thread works out which frame each outgoing tick lands on and
+// queues it. A sender thread waits until that frame is actually heard and
+// sends it, since RtMidi isn't something to call from the callback.
+
+struct ClockOutEvent {
+    uint64_t frame;
+    unsigned char status;
+};
+
+SpscRing<ClockOutEvent, 256> clockOutQueue;
+std::atomic<bool> clockOutRunning { false };
+
+void clockOutThread(RtMidiOut* clockOut) {
+    while (clockOutRunning) {
+        ClockOutEvent e;
+        if (!clockOutQueue.pop(e)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        double sendAt = frameToWallTime(e.frame + bufSize);
+        double wait = sendAt - getWallTime();
+
+        // Sleep most of the way, then spin for the last bit
+        if (wait > 0.002)
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait - 0.001));
+        while (getWallTime() < sendAt) {}
+
+        clockOut->sendMessage(&e.status, 1);
+    }
+}
+
+// Audio thread side
+// -----------------
+
+struct SequencerState {
+    SeqMode mode;
+    // Counts steps since starting, drives the arp and the pattern
+    int64_t step;
+    // Next step when running from our own clock
+    double nextStepFrame;
+    double nextClockFrame;
+    // Next step's tick when following MIDI clock
+    int64_t nextStepTick;
+    bool synced;
+    int playingNote;
+    uint64_t gateOffFrame;
+    uint32_t random;
+};
+
+SequencerState seq = { SeqMode::Off, 0, 0.0, 0.0, 0, false, -1, 0, 12345 };
+
+bool sequencerWantsAudio() {
+    if (seqMode == SeqMode::Step || (seqMode != SeqMode::Off && seqSendClock))
+        return true;
+
+    if (seqMode == SeqMode::Arp)
+        return seqHeldNotes[0] != 0 || seqHeldNotes[1] != 0;
+
+    return false;
+}
+
+int seqTicksPerStep() {
+    return MIDI_CLOCK_PPQN / seqStepsPerBeat;
+}
+
+double seqFramesPerStep() {
+    return currentSampleRate * 60.0 / (seqTempo * seqStepsPerBeat);
+}
+
+// Picks the note for the current step, or -1 for a rest
+int sequencerNextNote() {
+    if (seq.mode == SeqMode::Step) {
+        int offset = seqPattern[seq.step % SEQ_STEPS];
+        if (offset == SEQ_REST)
+            return -1;
+
+        return seqRoot + offset;
+    }
+
+    int held[128 * 4];
+    int numHeld = 0;
+
+    for (int o = 0; o < arpOctaves; o++) {
+        for (int n = 0; n < 128; n++) {
+            if ((seqHeldNotes[n / 64].load(std::memory_order_relaxed) >> (n % 64)) & 1)
+                held[numHeld++] = n + o * 12;
+        }
+    }
+
+    if (numHeld == 0)
+        return -1;
+
+    int idx = 0;
+    switch (arpPattern) {
+    case A_Up:
+        idx = seq.step % numHeld;
+        break;
+    case A_Down:
+        idx = numHeld - 1 - (seq.step % numHeld);
+        break;
+    case A_UpDown: {
+        int period = numHeld > 1 ? numHeld * 2 - 2 : 1;
+        idx = seq.step % period;
+        if (idx >= numHeld)
+            idx = period - idx;
+        break;
+    }
+    case A_Random:
+        seq.random ^= seq.random << 13;
+        seq.random ^= seq.random >> 17;
+        seq.random ^= seq.random << 5;
+        idx = seq.random % numHeld;
+        break;
+    default:
+        break;
+    }
+
+    return held[idx];
+}
+
+void sequencerStep(uint64_t frame, double time, double framesPerStep) {
+    seqCurrentStep = (int)(seq.step % SEQ_STEPS);
+
+    int note = sequencerNextNote();
+    if (note >= 0) {
+        if (seq.playingNote >= 0)
+            playNoteOff(seq.playingNote, time);
+
+        playNoteOn(note, time);
+        seq.playingNote = note;
+        seq.gateOffFrame = frame + (uint64_t)max(1.0, framesPerStep * seqGate);
+    }
+
+    seq.step++;
+}
+
+// Runs the sequencer over one block. Notes get stamped with the time of
+// the frame they land on, so they start mid-block where they should.
+void sequencerProcess(uint64_t blockFrame, int frames, double blockTime) {
+    uint64_t blockEnd = blockFrame + frames;
+    auto frameTime = [&](uint64_t frame) {
+        return blockTime + (double)(frame - blockFrame) / currentSampleRate;
+    };
+
+    if (seq.mode != seqMode || seq.synced != seqSyncToMidiClock) {
+        if (seq.playingNote >= 0)
+            playNoteOff(seq.playingNote, blockTime);
+
+        // Only send start/stop when we're the clock master
+        bool wasMaster = seq.mode != SeqMode::Off && !seq.synced;
+        bool isMaster = seqMode != SeqMode::Off && !seqSyncToMidiClock;
+        if (seqSendClock && !wasMaster && isMaster)
+            clockOutQueue.push({ blockFrame, 0xFA });
+        if (seqSendClock && wasMaster && !isMaster)
+            clockOutQueue.push({ blockFrame, 0xFC });
+
+        seq.mode = seqMode;
+        seq.synced = seqSyncToMidiClock;
+        seq.step = 0;
+        seq.playingNote = -1;
+        seq.nextStepFrame = blockFrame;
+        seq.nextClockFrame = blockFrame;
+        seq.nextStepTick = 0;
+        seqCurrentStep = -1;
+    }
+
+    if (seq.mode == SeqMode::Off)
+        return;
+
+    double framesPerStep = seqFramesPerStep();
+    ClockPLL clock;
+    bool clockUsable = true;
+
+    if (seq.synced) {
+        clock = midiClock.load();
+        framesPerStep = clock.period * seqTicksPerStep();
+
+        if (midiClockStarted.exchange(false)) {
+            seq.step = 0;
+            seq.nextStepTick = 0;
+        }
+
+        clockUsable = clock.locked && clock.running;
+
+        // Fell behind the clock (we were suspended, or it jumped), so
+        // pick up from the next step that's still ahead of us
+        if (clockUsable && seq.nextStepTick <= clock.tick - seqTicksPerStep()) {
+            int64_t tps = seqTicksPerStep();
+            seq.nextStepTick = ((clock.tick / tps) + 1) * tps;
+            seq.step = seq.nextStepTick / tps;
+        }
+    }
+
+    // Following a transport, the next step comes from where it says we
+    // are rather than from counting frames
+    if (!seq.synced && transport.valid) {
+        seqTempo = transport.bpm;
+        framesPerStep = seqFramesPerStep();
+        double steps = transport.beat * seqStepsPerBeat + (blockFrame - (double)transport.frame) / framesPerStep;
+        double next = ceil(steps - 0.000001);
+        seq.step = (int64_t)next;
+        seq.nextStepFrame = blockFrame + (next - steps) * framesPerStep;
+    }
+
+    // Walk through everything that happens in this block in order
+    while (true) {
+        double stepFrame;
+        if (seq.synced)
+            stepFrame = clockUsable ? pllFrameForTick(clock, seq.nextStepTick) : INFINITY;
+        else
+            stepFrame = seq.nextStepFrame;
+
+        double gateFrame = seq.playingNote >= 0 ? (double)seq.gateOffFrame : INFINITY;
+
+        if (gateFrame < blockEnd && gateFrame <= stepFrame) {
+            playNoteOff(seq.playingNote, frameTime(seq.gateOffFrame));
+            seq.playingNote = -1;
+            continue;
+        }
+
+        if (stepFrame >= blockEnd)
+            break;
+
+        // A step we're late for (PLL moved it back) plays right away
+        uint64_t frame = stepFrame < blockFrame ? blockFrame : (uint64_t)stepFrame;
+        sequencerStep(frame, frameTime(frame), framesPerStep);
+
+        if (seq.synced)
+            seq.nextStepTick += seqTicksPerStep();
+        else
+            seq.nextStepFrame += seqFramesPerStep();
+    }
+
+    // We're the clock master, send ticks out
+    if (seqSendClock && !seq.synced) {
+        double framesPerTick = seqFramesPerStep() / seqTicksPerStep();
+        while (seq.nextClockFrame < blockEnd) {
+            clockOutQueue.push({ (uint64_t)seq.nextClockFrame, 0xF8 });
+            seq.nextClockFrame += framesPerTick;
+        }
+    }
+}
+
+
+// Journal
+// =======
+// Every input the engine gets (notes, MIDI, parameter changes, tuning
+// swaps) comes in through one queue that the audio thread empties at the
+// top of each block. Whatever it takes out goes into the journal stamped
+// with the frame it was applied at, so the journal is exactly what the
+// engine saw. It's a fixed ring that only the audio thread writes,
+// overwriting the oldest entries, so it's always on.
+//
+// Replays need somewhere to start. When the engine is quiet (no voices,
+// nothing ringing) it takes a checkpoint now and then: parameters, voices,
+// sequencer and the bits of string state that outlive a note. --replay
+// starts at the oldest checkpoint in a dump and renders offline with the
+// same block sizes and clock, which comes out bit for bit the same as it
+// did live, given the same build and tuning files.
+//
+// Dumped with Home, SIGUSR1, or on a crash. Audio input, the MIDI clock
+// PLL and the JACK transport aren't journalled, so sessions leaning on
+// those won't replay exactly.
+
+const static int JOURNAL_SIZE = 1 << 16;
+const static int CHECKPOINTS = 8;
+// Entries the audio thread can write while a dump is going without
+// treading on what's being written out
+const static int JOURNAL_SLACK = 1024;
+// How long to keep rendering after the end of a replay
+const double REPLAY_TAIL_SECONDS = 2.0;
+// Goes up whenever the header, entries or checkpoints change layout, so
+// an old dump is turned away instead of read shifted. 2 added the sample
+// and per-note fields.
+const char JOURNAL_MAGIC[8] = { 'S', 'Y', 'N', 'J', 'R', 'N', 'L', '2' };
+
+enum JournalType : uint8_t {
+    J_NoteOn,
+    J_NoteOff,
+    J_Param,
+    // MIDI as it came in, for reading. What it did is journalled as well.
+    J_Midi,
+    // Block size or DSP clock changed
+    J_Clock,
+    J_Tuning,
+    J_NoteControl,
+    J_Ramp,
+    // Relative to wherever the parameter has got to on the audio thread.
+    // rate says how, see ParamStep.
+    J_ParamStep,
+};
+
+enum ParamStep {
+    S_Add,
+    S_Toggle,
+    // J_Ramp to the value plus where the last ramp was headed
+    S_RampBy,
+};
+
+struct JournalEntry {
+    // Start of the block it was applied in
+    uint64_t frame;
+    // Note time, parameter value, or the block's start time for J_Clock
+    double value;
+    // Note, parameter, or block frames for J_Clock
+    int32_t arg;
+    // Sample rate for J_Clock, or which NoteControl
+    int32_t rate;
+    JournalType type;
+    uint8_t midi[3];
+    // For J_NoteOn, 0..1
+    float velocity;
+    // For J_Ramp, which starts at value
+    double rampTarget;
+    double rampSeconds;
+    // Wall time it was queued at
+    double queued;
+};
+
+// A parameter gliding to a new value, see rampParameter
+struct ParamRamp {
+    bool active;
+    double from;
+    double to;
+    // DSP clock
+    double start;
+    double seconds;
+};
+
+ParamRamp paramRamps[P_Count];
+
+struct Checkpoint {
+    // Journal entry it comes before
+    uint64_t entry;
+    uint64_t frame;
+    double params[P_Count];
+    PolyphonicVoice voices[NUM_VOICES];
+    SequencerState seq;
+    uint64_t seqHeldNotes[2];
+    int seqRoot;
+    int nextPanSlot;
+    float lastBlockPeak;
+    uint32_t stringRng[STRING_GROUPS][STRING_LANES];
+    unsigned stringWritePos[STRING_GROUPS];
+    // Crossover tails are still ringing down when it goes quiet
+    MultibandState multiband;
+    // So can ramps, nothing has to be playing
+    ParamRamp ramps[P_Count];
+};
+
+struct JournalHeader {
+    char magic[8];
+    int32_t sampleRate;
+    int32_t channels;
+    uint32_t checkpoints;
+    uint32_t entries;
+    // Index of the first entry in the file
+    uint64_t firstEntry;
+    // Block being rendered when it was dumped
+    uint64_t endFrame;
+    char sclPath[256];
+    char kbmPath[256];
+    char samplePath[256];
+    int32_t sampleRoot;
+    int32_t sampleLoop[2];
+};
+
+const static int ENGINE_INPUT_QUEUE = 1024;
+
+MpscRing<JournalEntry, ENGINE_INPUT_QUEUE> engineInputs;
+std::atomic<unsigned> engineInputsDropped { 0 };
+
+JournalEntry journal[JOURNAL_SIZE];
+std::atomic<uint64_t> journalHead { 0 };
+Checkpoint checkpoints[CHECKPOINTS];
+std::atomic<uint64_t> checkpointHead { 0 };
+std::atomic<uint64_t> journalFrame { 0 };
+
+// What the clock should read at the next block if nothing jumped
+double journalNextTime = -1.0;
+int journalBlockFrames = 0;
+int journalSampleRate = 0;
+
+std::atomic<bool> journalDumpRequested { false };
+
+// Set while rendering a dump back. Inputs come from replayEntries instead
+// of the queue.
+bool replaying = false;
+std::vector<JournalEntry> replayEntries;
+size_t replayPos = 0;
+
+double readParameter(Param p) {
+    switch (p) {
+    case P_Volume: return volume;
+    case P_CrushBits: return crushBits;
+    case P_Bitcrush: return enableBitcrush;
+    case P_Compressor: return enableCompressor;
+    case P_Lowpass: return lpEnabled;
+    case P_LowpassQ: return lpQ;
+    case P_Unison: return unisonDetune;
+    case P_UnisonAmount: return unisonDetuneAmount;
+    case P_GoofyUnison: return goofyUnison;
+    case P_OctaveMode: return (int)octaveMode;
+    case P_Waveform: return currWaveFunc;
+    case P_VoiceModel: return voiceModel;
+    case P_PitchBend: return pitchBendAmt;
+    case P_SeqMode: return (int)seqMode;
+    case P_ArpPattern: return arpPattern;
+    case P_ArpOctaves: return arpOctaves;
+    case P_Tempo: return seqTempo;
+    case P_SeqSync: return seqSyncToMidiClock;
+    case P_InputMix: return inputMix;
+    case P_InputEffects: return inputEffects;
+    case P_InputSidechain: return inputSidechain;
+    case P_Vocoder: return vocoderEnabled;
+    case P_VoiceSpread: return voiceSpread;
+    case P_StringDecay: return stringDecay;
+    case P_Multiband: return mbEnabled;
+    case P_Harmonizer: return harmonizerEnabled;
+    case P_HarmonyMode: return harmonyMode;
+    case P_HarmonyVoices: return harmonyVoices;
+    default: return 0.0;
+    }
+}
+
+// Audio thread only, everyone else goes through setParameter
+// Where the volume CC tops out
+const double MAX_VOLUME = 2.0;
+
+// Mode index for any value, going round from the end for negative ones
+int wrapMode(double value, int count) {
+    int m = (int)fmod(value, count);
+    return m < 0 ? m + count : m;
+}
+
+void applyParameter(Param p, double value) {
+    if (!std::isfinite(value))
+        return;
+
+    switch (p) {
+    case P_Volume: volume = clamp(value, 0.0, MAX_VOLUME); break;
+    case P_CrushBits: crushBits = clamp(value, 1.0, 31.0); break;
+    case P_Bitcrush: enableBitcrush = value != 0.0; break;
+    case P_Compressor: enableCompressor = value != 0.0; break;
+    case P_Lowpass: lpEnabled = value != 0.0; break;
+    case P_LowpassQ: lpQ = clamp(value, 0.0, 1.0); break;
+    case P_Unison: unisonDetune = value != 0.0; break;
+    case P_UnisonAmount: unisonDetuneAmount = value; break;
+    case P_GoofyUnison: goofyUnison = value != 0.0; break;
+    case P_OctaveMode: octaveMode = (OctaveMode)wrapMode(value, 4); break;
+    case P_Waveform: currWaveFunc = (Waveform)wrapMode(value, W_Count); break;
+    case P_VoiceModel: voiceModel = (VoiceModel)wrapMode(value, V_Count); break;
+    case P_PitchBend: pitchBendAmt = value; break;
+    case P_SeqMode: seqMode = (SeqMode)wrapMode(value, 3); break;
+    case P_ArpPattern: arpPattern = (ArpPattern)wrapMode(value, A_Count); break;
+    case P_ArpOctaves: arpOctaves = wrapMode(max(value, 1.0) - 1.0, 4) + 1; break;
+    case P_Tempo: seqTempo = clamp(value, 20.0, 400.0); break;
+    case P_SeqSync: seqSyncToMidiClock = value != 0.0; break;
+    case P_InputMix: inputMix = value != 0.0; break;
+    case P_InputEffects: inputEffects = value != 0.0; break;
+    case P_InputSidechain: inputSidechain = value != 0.0; break;
+    case P_Vocoder: vocoderEnabled = value != 0.0; break;
+    case P_VoiceSpread: voiceSpread = clamp(value, 0.0, 360.0); break;
+    case P_StringDecay: stringDecay = clamp(value, 0.1, 60.0); break;
+    case P_Multiband: mbEnabled = value != 0.0; break;
+    case P_Harmonizer:
+        // Starts from nothing each time so stale grains don't come back
+        if ((value != 0.0) != harmonizerEnabled)
+            resetHarmonizer();
+        harmonizerEnabled = value != 0.0;
+        break;
+    case P_HarmonyMode:
+        if ((HarmonyMode)wrapMode(value, H_Count) != harmonyMode)
+            resetHarmonizer();
+        harmonyMode = (HarmonyMode)wrapMode(value, H_Count);
+        break;
+    case P_HarmonyVoices: harmonyVoices = (int)clamp(value, 1.0, HARMONY_VOICES); break;
+    default: break;
+    }
+}
+
+bool remoteForward(const JournalEntry& e);
+
+// Whether an input will make a suspended device start making noise.
+// Everything else can wait in the queue until something does.
+bool inputMakesSound(const JournalEntry& e) {
+    if (e.type == J_NoteOn)
+        return true;
+    // The step sequencer plays on its own
+    return (e.type == J_Param || e.type == J_ParamStep) && e.arg == P_SeqMode;
+}
+
+// Queues an input for the audio thread. Any thread.
+void engineInput(JournalEntry e) {
+    e.queued = getWallTime();
+
+    // A remote front end hands everything to its engine instead
+    if (remoteForward(e))
+        return;
+
+    if (!engineInputs.push(e))
+        engineInputsDropped++;
+
+    // Only wake for sound, or before knob turns fill the queue up and
+    // the next note gets dropped
+    if (inputMakesSound(e) || engineInputs.size() >= ENGINE_INPUT_QUEUE / 2)
+        wakeAudioDevice();
+}
+
+void engineInput(JournalType type, int arg, double value, const uint8_t* midi = nullptr) {
+    JournalEntry e = {};
+    e.type = type;
+    e.arg = arg;
+    e.value = value;
+    if (midi)
+        memcpy(e.midi, midi, 3);
+    engineInput(e);
+}
+
+void setParameter(Param p, double value) {
+    engineInput(J_Param, p, value);
+}
+
+// Changes a parameter by delta from wherever the audio thread has it, so
+// presses quicker than a block all count, which reading it here and
+// setting it wouldn't. Modes wrap round.
+void nudgeParameter(Param p, double delta) {
+    JournalEntry e = {};
+    e.type = J_ParamStep;
+    e.arg = p;
+    e.value = delta;
+    e.rate = S_Add;
+    engineInput(e);
+}
+
+void toggleParameter(Param p) {
+    JournalEntry e = {};
+    e.type = J_ParamStep;
+    e.arg = p;
+    e.rate = S_Toggle;
+    engineInput(e);
+}
+
+void engineNoteOn(int note, double time, float velocity = 1.0f) {
+    JournalEntry e = {};
+    e.type = J_NoteOn;
+    e.arg = note;
+    e.value = time;
+    e.velocity = velocity;
+    engineInput(e);
+}
+
+// Parameters with values in between worth gliding through
+bool paramRampable(Param p) {
+    switch (p) {
+    case P_Volume:
+    case P_CrushBits:
+    case P_LowpassQ:
+    case P_UnisonAmount:
+    case P_PitchBend:
+    case P_Tempo:
+    case P_VoiceSpread:
+    case P_StringDecay:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Glides a parameter to target over the given time instead of jumping,
+// starting at startTime on the DSP clock, or as soon as possible if it's
+// negative. One of these does the job of a stream of setParameter calls,
+// without the steps. A setParameter on the same parameter stops it.
+// Any thread.
+void rampParameter(Param p, double target, double seconds, double startTime = -1.0) {
+    // Switches and modes would step through everything in between, so
+    // they just change
+    if (!paramRampable(p)) {
+        setParameter(p, target);
+        return;
+    }
+
+    JournalEntry e = {};
+    e.type = J_Ramp;
+    e.arg = p;
+    e.value = startTime;
+    e.rampTarget = target;
+    e.rampSeconds = max(seconds, 0.0);
+    engineInput(e);
+}
+
+// Ramps by delta from where the parameter is headed, so presses that come
+// quicker than the ramp pile up instead of being lost
+void rampParameterBy(Param p, double delta, double seconds) {
+    if (!paramRampable(p)) {
+        nudgeParameter(p, delta);
+        return;
+    }
+
+    JournalEntry e = {};
+    e.type = J_ParamStep;
+    e.arg = p;
+    // Starts at the block it lands in
+    e.value = -1.0;
+    e.rate = S_RampBy;
+    e.rampTarget = delta;
+    e.rampSeconds = max(seconds, 0.0);
+    engineInput(e);
+}
+
+// Takes effect at the start of the next block
+void engineNoteControl(int note, NoteControl control, double value) {
+    JournalEntry e = {};
+    e.type = J_NoteControl;
+    e.arg = note;
+    e.rate = control;
+    e.value = value;
+    engineInput(e);
+}
+
+void engineNoteOff(int note, double time) {
+    engineInput(J_NoteOff, note, time);
+}
+
+bool engineInputsPending() {
+    return !engineInputs.empty();
+}
+
+void applyEngineInput(const JournalEntry& e) {
+    switch (e.type) {
+    case J_NoteOn:
+        inputNoteOn(e.arg, e.value, e.velocity);
+        break;
+    case J_NoteOff:
+        inputNoteOff(e.arg, e.value);
+        break;
+    case J_Param:
+        paramRamps[e.arg].active = false;
+        applyParameter((Param)e.arg, e.value);
+        break;
+    case J_Ramp: {
+        if (!paramRampable((Param)e.arg))
+            break;
+        auto& r = paramRamps[e.arg];
+        r.active = true;
+        r.from = readParameter((Param)e.arg);
+        r.to = e.rampTarget;
+        r.start = e.value < 0.0 ? timeAccumulator : e.value;
+        r.seconds = e.rampSeconds;
+        break;
+    }
+    case J_ParamStep: {
+        auto& r = paramRamps[e.arg];
+        double now = readParameter((Param)e.arg);
+        if (e.rate == S_RampBy) {
+            double to = (r.active ? r.to : now) + e.rampTarget;
+            r.active = true;
+            r.from = now;
+            r.to = to;
+            r.start = e.value < 0.0 ? timeAccumulator : e.value;
+            r.seconds = e.rampSeconds;
+        } else {
+            r.active = false;
+            applyParameter((Param)e.arg, e.rate == S_Toggle ? (double)(now == 0.0) : now + e.value);
+        }
+        break;
+    }
+    case J_NoteControl:
+        setNoteControl(e.arg, (NoteControl)e.rate, e.value);
+        break;
+    default:
+        break;
+    }
+}
+
+void journalWrite(const JournalEntry& e) {
+    uint64_t h = journalHead.load(std::memory_order_relaxed);
+    journal[h % JOURNAL_SIZE] = e;
+    journalHead.store(h + 1, std::memory_order_release);
+}
+
+void takeCheckpoint() {
+    uint64_t n = checkpointHead.load(std::memory_order_relaxed);
+    Checkpoint& c = checkpoints[n % CHECKPOINTS];
+
+    c.entry = journalHead.load(std::memory_order_relaxed);
+    c.frame = engineFrame;
+    for (int p = 0; p < P_Count; p++) {
+        c.params[p] = readParameter((Param)p);
+    }
+    memcpy(c.voices, voices, sizeof(voices));
+    c.seq = seq;
+    c.seqHeldNotes[0] = seqHeldNotes[0];
+    c.seqHeldNotes[1] = seqHeldNotes[1];
+    c.seqRoot = seqRoot;
+    c.nextPanSlot = nextPanSlot;
+    c.lastBlockPeak = lastBlockPeak;
+    for (int g = 0; g < STRING_GROUPS; g++) {
+        memcpy(c.stringRng[g], stringGroups[g].rng, sizeof(c.stringRng[g]));
+        c.stringWritePos[g] = stringGroups[g].writePos;
+    }
+    c.multiband = multiband.state;
+    memcpy(c.ramps, paramRamps, sizeof(paramRamps));
+
+    checkpointHead.store(n + 1, std::memory_order_release);
+}
+
+void restoreCheckpoint(const Checkpoint& c) {
+    engineFrame = c.frame;
+    for (int p = 0; p < P_Count; p++) {
+        applyParameter((Param)p, c.params[p]);
+    }
+    memcpy(voices, c.voices, sizeof(voices));
+    seq = c.seq;
+    seqHeldNotes[0] = c.seqHeldNotes[0];
+    seqHeldNotes[1] = c.seqHeldNotes[1];
+    seqRoot = c.seqRoot;
+    nextPanSlot = c.nextPanSlot;
+    lastBlockPeak = c.lastBlockPeak;
+    for (int g = 0; g < STRING_GROUPS; g++) {
+        memcpy(stringGroups[g].rng, c.stringRng[g], sizeof(c.stringRng[g]));
+        stringGroups[g].writePos = c.stringWritePos[g];
+    }
+    memcpy(paramRamps, c.ramps, sizeof(paramRamps));
+    // Configuring clears the state, so it has to go first
+    configureMultiband();
+    multiband.state = c.multiband;
+    // Never busy at a checkpoint, so there's nothing of it to restore
+    configureHarmonizer();
+}
+
+double rampValue(const ParamRamp& r, double time) {
+    if (time <= r.start)
+        return r.from;
+    if (time >= r.start + r.seconds)
+        return r.to;
+    return lerp(r.from, r.to, (time - r.start) / r.seconds);
+}
+
+// Parameters that aren't read every sample get where the ramp is at the top
+// of each block
+void runParamRamps() {
+    for (int p = 0; p < P_Count; p++) {
+        auto& r = paramRamps[p];
+        if (!r.active)
+            continue;
+
+        applyParameter((Param)p, rampValue(r, timeAccumulator));
+        if (timeAccumulator >= r.start + r.seconds)
+            r.active = false;
+    }
+}
+
+// The ones that are follow it sample by sample, clamped like applyParameter
+void fillParamCurves(int frames) {
+    const auto& rv = paramRamps[P_Volume];
+    const auto& rc = paramRamps[P_CrushBits];
+    const auto& rq = paramRamps[P_LowpassQ];
+    const auto& rb = paramRamps[P_PitchBend];
+    for (int i = 0; i < frames; i++) {
+        double t = timeAccumulator + i / (double)currentSampleRate;
+        volumeCurve[i] = rv.active ? clamp(rampValue(rv, t), 0.0, MAX_VOLUME) : volume;
+        crushCurve[i] = rc.active ? clamp(rampValue(rc, t), 1.0, 31.0) : crushBits;
+        lpQCurve[i] = rq.active ? clamp(rampValue(rq, t), 0.0, 1.0) : lpQ;
+        bendCurve[i] = rb.active ? pow(2.0, rampValue(rb, t) / 12.0) : blockBendRatio;
+    }
+}
+
+// Takes the inputs for this block, from the queue or the replay
+void journalBlockStart(int frames) {
+    if (replaying) {
+        while (replayPos < replayEntries.size() && replayEntries[replayPos].frame <= engineFrame) {
+            const JournalEntry& e = replayEntries[replayPos++];
+            // The tuning goes in as soon as it's built, like it did live
+            if (e.type == J_Tuning)
+                loadTuning();
+            else
+                applyEngineInput(e);
+        }
+        return;
+    }
+
+    // Same test as the silence fast path, nothing's carrying over
+    bool quiet = !anyVoiceActive() && lastBlockPeak < silenceThreshold && !inputActive() && !harmonizerBusy();
+    uint64_t n = checkpointHead.load(std::memory_order_relaxed);
+    bool due = n == 0 || engineFrame >= checkpoints[(n - 1) % CHECKPOINTS].frame + currentSampleRate;
+    bool checkpointed = quiet && due;
+    if (checkpointed)
+        takeCheckpoint();
+
+    if (checkpointed || frames != journalBlockFrames || timeAccumulator != journalNextTime || currentSampleRate != journalSampleRate) {
+        JournalEntry clock = {};
+        clock.type = J_Clock;
+        clock.frame = engineFrame;
+        clock.value = timeAccumulator;
+        clock.arg = frames;
+        clock.rate = currentSampleRate;
+        journalWrite(clock);
+    }
+    journalBlockFrames = frames;
+    journalSampleRate = currentSampleRate;
+    // Has to match how renderBlock moves the clock on, to the bit
+    journalNextTime = timeAccumulator + frames / (double)currentSampleRate;
+    journalFrame.store(engineFrame, std::memory_order_relaxed);
+
+    int phase = statsPhase.load(std::memory_order_relaxed);
+    double now = phase >= 0 && engineInputsPending() ? getWallTime() : 0.0;
+    uint32_t taken = 0;
+
+    JournalEntry e;
+    while (engineInputs.pop(e)) {
+        e.frame = engineFrame;
+        applyEngineInput(e);
+        journalWrite(e);
+
+        taken++;
+        if (phase >= 0 && e.type == J_Midi)
+            recordInputLatency(phase, now - e.queued);
+    }
+
+    if (phase >= 0 && taken > inputStats[phase].highWater)
+        inputStats[phase].highWater = taken;
+}
+
+void journalTuningSwap() {
+    JournalEntry e = {};
+    e.type = J_Tuning;
+    e.frame = engineFrame;
+    journalWrite(e);
+}
+
+bool writeAll(int fd, const void* data, size_t bytes) {
+    const char* p = (const char*)data;
+    while (bytes > 0) {
+#ifdef _WIN32
+        int n = _write(fd, p, (unsigned)bytes);
+#else
+        ssize_t n = write(fd, p, bytes);
+#endif
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+
+    return true;
+}
+
+// Writes out the journal and the checkpoints it covers. Only uses write()
+// so the crash handler can call it.
+bool writeJournal(int fd) {
+    uint64_t head = journalHead.load(std::memory_order_acquire);
+    uint64_t first = head > JOURNAL_SIZE - JOURNAL_SLACK ? head - (JOURNAL_SIZE - JOURNAL_SLACK) : 0;
+    uint64_t cpHead = checkpointHead.load(std::memory_order_acquire);
+    uint64_t cpFirst = cpHead > CHECKPOINTS - 1 ? cpHead - (CHECKPOINTS - 1) : 0;
+
+    JournalHeader h = {};
+    memcpy(h.magic, JOURNAL_MAGIC, 8);
+    h.sampleRate = currentSampleRate;
+    h.channels = nChannels;
+    h.firstEntry = first;
+    h.entries = (uint32_t)(head - first);
+    h.endFrame = journalFrame.load(std::memory_order_relaxed);
+    strncpy(h.sclPath, sclPath.c_str(), sizeof(h.sclPath) - 1);
+    strncpy(h.kbmPath, kbmPath.c_str(), sizeof(h.kbmPath) - 1);
+    if (samplePath)
+        strncpy(h.samplePath, samplePath, sizeof(h.samplePath) - 1);
+    h.sampleRoot = sampleRootArg;
+    h.sampleLoop[0] = sampleLoopArg[0];
+    h.sampleLoop[1] = sampleLoopArg[1];
+
+    // Only checkpoints the entries still reach back to
+    for (uint64_t i = cpFirst; i < cpHead; i++) {
+        if (checkpoints[i % CHECKPOINTS].entry >= first)
+            h.checkpoints++;
+    }
+
+    bool ok = writeAll(fd, &h, sizeof(h));
+    for (uint64_t i = cpFirst; i < cpHead && ok; i++) {
+        if (checkpoints[i % CHECKPOINTS].entry >= first)
+            ok = writeAll(fd, &checkpoints[i % CHECKPOINTS], sizeof(Checkpoint));
+    }
+
+    // In at most two pieces, the ring wraps
+    uint64_t i = first;
+    while (i < head && ok) {
+        uint64_t run = std::min<uint64_t>(head - i, JOURNAL_SIZE - i % JOURNAL_SIZE);
+        ok = writeAll(fd, &journal[i % JOURNAL_SIZE], run * sizeof(JournalEntry));
+        i += run;
+    }
+
+    return ok;
+}
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+int openForWriting(const char* path) {
+#ifdef _WIN32
+    return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+void closeFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Not for the audio thread
+void dumpJournal() {
+    char path[64];
+    snprintf(path, sizeof(path), "synth-%lld.journal", (long long)time(nullptr));
+
+    int fd = openForWriting(path);
+    if (fd < 0 || !writeJournal(fd)) {
+        fprintf(stderr, "couldn't write journal to %s\n", path);
+    } else {
+        printf("journal written to %s\n", path);
+    }
+
+    if (fd >= 0)
+        closeFile(fd);
+}
+
+void onCrashSignal(int sig) {
+    int fd = openForWriting("synth-crash.journal");
+    if (fd >= 0) {
+        writeJournal(fd);
+        closeFile(fd);
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void onDumpSignal(int) {
+    journalDumpRequested = true;
+}
+
+void installJournalSignals() {
+    signal(SIGSEGV, onCrashSignal);
+    signal(SIGFPE, onCrashSignal);
+    signal(SIGILL, onCrashSignal);
+    signal(SIGABRT, onCrashSignal);
+#ifdef SIGBUS
+    signal(SIGBUS, onCrashSignal);
+#endif
+#ifdef SIGUSR1
+    signal(SIGUSR1, onDumpSignal);
+#endif
+}
+
+void writeWavHeader(FILE* f, int sampleRate, int channels, uint32_t dataBytes) {
+    auto put32 = [&](uint32_t v) { fwrite(&v, 4, 1, f); };
+    auto put16 = [&](uint16_t v) { fwrite(&v, 2, 1, f); };
+
+    fwrite("RIFF", 1, 4, f);
+    put32(36 + dataBytes);
+    fwrite("WAVEfmt ", 1, 8, f);
+    put32(16);
+    // IEEE float
+    put16(3);
+    put16(channels);
+    put32(sampleRate);
+    put32(sampleRate * channels * 4);
+    put16(channels * 4);
+    put16(32);
+    fwrite("data", 1, 4, f);
+    put32(dataBytes);
+}
+
+// Renders a dumped journal to a float WAV, from its oldest checkpoint to
+// a little past where it was dumped
+bool replayJournal(const char* path, const char* outPath) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "couldn't open journal %s\n", path);
+        return false;
+    }
+
+    JournalHeader h = {};
+    std::vector<Checkpoint> saved;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && !memcmp(h.magic, JOURNAL_MAGIC, 8);
+    if (!ok && !memcmp(h.magic, JOURNAL_MAGIC, 7)) {
+        fprintf(stderr, "%s is from another version, this build reads version %c\n", path, JOURNAL_MAGIC[7]);
+        fclose(f);
+        return false;
+    }
+    if (ok) {
+        saved.resize(h.checkpoints);
+        replayEntries.resize(h.entries);
+        ok = (h.checkpoints == 0 || fread(saved.data(), sizeof(Checkpoint), h.checkpoints, f) == h.checkpoints) &&
+             (h.entries == 0 || fread(replayEntries.data(), sizeof(JournalEntry), h.entries, f) == h.entries);
+    }
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "%s isn't a journal from this build\n", path);
+        return false;
+    }
+
+    if (saved.empty()) {
+        fprintf(stderr, "journal has no checkpoint to start from, the engine never went quiet\n");
+        return false;
+    }
+
+    sclPath = h.sclPath;
+    kbmPath = h.kbmPath;
+    setSampleRate(h.sampleRate);
+    loadTuning();
+    if (h.samplePath[0]) {
+        sampleRootArg = h.sampleRoot;
+        sampleLoopArg[0] = h.sampleLoop[0];
+        sampleLoopArg[1] = h.sampleLoop[1];
+        if (!loadSample(h.samplePath))
+            fprintf(stderr, "sample voices will be silent\n");
+    }
+    setChannelCount(h.channels);
+    outputFormat = AUDIO_F32SYS;
+
+    // Rebuilt tables only get swapped in by renderBlock
+    TuningTable* table = pendingTuning.exchange(nullptr);
+    if (table)
+        arenaFree(currentTuning.exchange(table));
+
+    const Checkpoint& start = saved[0];
+    restoreCheckpoint(start);
+    replayPos = start.entry - h.firstEntry;
+    replaying = true;
+
+    FILE* out = fopen(outPath, "wb");
+    if (!out) {
+        fprintf(stderr, "couldn't open %s\n", outPath);
+        return false;
+    }
+    writeWavHeader(out, h.sampleRate, h.channels, 0);
+
+    printf("replaying %u entries from frame %llu to %llu\n", h.entries - (uint32_t)replayPos,
+        (unsigned long long)start.frame, (unsigned long long)h.endFrame);
+
+    // More threads than voices would have nothing to do
+    int threads = renderThreads > 0 ? renderThreads : (int)std::thread::hardware_concurrency();
+    threads = min(threads, NUM_VOICES);
+    if (threads > 1)
+        startRenderPool(threads);
+
+    uint64_t stopFrame = h.endFrame + (uint64_t)(REPLAY_TAIL_SECONDS * h.sampleRate);
+    uint32_t dataBytes = 0;
+    int frames = MAX_BLOCK;
+    std::vector<float> interleaved(MAX_BLOCK * MAX_CHANNELS);
+
+    while (engineFrame < stopFrame) {
+        // Clock entries say how big the live blocks were and where the
+        // clock was, everything else goes in through renderBlock
+        while (replayPos < replayEntries.size() && replayEntries[replayPos].frame <= engineFrame &&
+               replayEntries[replayPos].type == J_Clock) {
+            const JournalEntry& e = replayEntries[replayPos++];
+            timeAccumulator = e.value;
+            frames = e.arg;
+            if (e.rate != currentSampleRate)
+                setSampleRate(e.rate);
+        }
+
+        renderBlock(frames);
+        interleaveFloat(interleaved.data(), frames);
+        fwrite(interleaved.data(), sizeof(float), frames * nChannels, out);
+        dataBytes += frames * nChannels * sizeof(float);
+    }
+
+    stopRenderPool();
+
+    fseek(out, 0, SEEK_SET);
+    writeWavHeader(out, h.sampleRate, h.channels, dataBytes);
+    fclose(out);
+
+    printf("wrote %s\n", outPath);
+    replaying = false;
+    return true;
+}
+
+
+// Auto-sampling
+// =============
+// --autosample DIR renders every note, velocity layer and round robin of
+// the patch set up by the other arguments to its own WAV, and writes an
+// SFZ mapping them all next to them, for rigs that only play samples.
+//
+// The engine is all globals, so each worker is a forked copy of the process
+// with the patch already loaded: one engine each, pulling jobs off a shared
+// counter. Every render starts from the same clean checkpoint, so a job
+// comes out the same whichever worker gets it. The note is held for
+// --autosample-hold seconds, then rendering carries on after the release
+// until the voices are done and the output has stayed under the floor for
+// a little while, and the silence at either end is trimmed.
+//
+// Round robins start the unison phases and the string noise somewhere
+// else. Sample voices have nothing to vary, so theirs come out the same.
+// Windows has no fork, so it renders them all in the one process.
+
+// -80 dBFS
+const double AUTOSAMPLE_FLOOR = 1e-4;
+// Quiet for this long after the release and it's over
+const double AUTOSAMPLE_QUIET_SECONDS = 0.1;
+const double AUTOSAMPLE_MAX_TAIL_SECONDS = 30.0;
+
+const char* autosampleDir = nullptr;
+int autosampleNotes[3] = { 21, 108, 3 };
+int autosampleLayers = 4;
+int autosampleRoundRobins = 1;
+double autosampleHold = 2.0;
+int autosampleWorkers = 0;
+int autosampleRate = 48000;
+
+struct AutosampleJob {
+    int note;
+    // MIDI velocities the layer covers, it's rendered at the top one
+    int loVel;
+    int hiVel;
+    int roundRobin;
+    // Keys it covers
+    int loKey;
+    int hiKey;
 };
 
-void setNoteOn(int note, double currTime) {
-    if (noteAlreadyDown(note))
+std::vector<AutosampleJob> autosampleJobs;
+Checkpoint autosampleStart;
+
+void autosampleFileName(char* out, size_t size, const AutosampleJob& j) {
+    snprintf(out, size, "n%03d_v%03d_rr%d.wav", j.note, j.hiVel, j.roundRobin + 1);
+}
+
+void planAutosample() {
+    std::vector<int> notes;
+    int step = max(autosampleNotes[2], 1);
+    for (int n = clamp(autosampleNotes[0], 0, 127); n <= clamp(autosampleNotes[1], 0, 127); n += step) {
+        notes.push_back(n);
+    }
+
+    autosampleJobs.clear();
+    for (size_t k = 0; k < notes.size(); k++) {
+        // Each sample covers the keys up to halfway to its neighbours
+        int loKey = k == 0 ? 0 : (notes[k - 1] + notes[k]) / 2 + 1;
+        int hiKey = k + 1 == notes.size() ? 127 : (notes[k] + notes[k + 1]) / 2;
+        for (int l = 0; l < autosampleLayers; l++) {
+            for (int r = 0; r < autosampleRoundRobins; r++) {
+                AutosampleJob j;
+                j.note = notes[k];
+                j.loVel = l * 127 / autosampleLayers + 1;
+                j.hiVel = (l + 1) * 127 / autosampleLayers;
+                j.roundRobin = r;
+                j.loKey = loKey;
+                j.hiKey = hiKey;
+                autosampleJobs.push_back(j);
+            }
+        }
+    }
+}
+
+bool renderAutosample(const AutosampleJob& j) {
+    restoreCheckpoint(autosampleStart);
+    timeAccumulator = 0.0;
+    lastBlockPeak = 0.0f;
+
+    playNoteOn(j.note, timeAccumulator, j.hiVel / 127.0f);
+    if (j.roundRobin > 0) {
+        for (auto& v : voices) {
+            for (int i = 0; i < MAX_UNISON; i++) {
+                v.phase[i] = fmod(v.phase[i] + j.roundRobin * 0.381966, 1.0);
+            }
+        }
+        for (auto& g : stringGroups) {
+            for (auto& x : g.rng) {
+                x ^= j.roundRobin * 0x9e3779b9u;
+                // xorshift sticks at zero
+                if (!x)
+                    x = 1;
+            }
+        }
+    }
+
+    std::vector<float> out;
+    std::vector<float> interleaved(MAX_BLOCK * MAX_CHANNELS);
+    uint64_t holdFrames = (uint64_t)(autosampleHold * currentSampleRate);
+    uint64_t maxFrames = holdFrames + (uint64_t)(AUTOSAMPLE_MAX_TAIL_SECONDS * currentSampleRate);
+    uint64_t quietWanted = (uint64_t)(AUTOSAMPLE_QUIET_SECONDS * currentSampleRate);
+    uint64_t rendered = 0;
+    uint64_t quietFrames = 0;
+    bool released = false;
+
+    while (rendered < maxFrames) {
+        if (!released && rendered >= holdFrames) {
+            playNoteOff(j.note, timeAccumulator);
+            released = true;
+        }
+
+        int frames = (int)(released ? MAX_BLOCK : std::min<uint64_t>(MAX_BLOCK, holdFrames - rendered));
+        renderBlock(frames);
+        interleaveFloat(interleaved.data(), frames);
+        out.insert(out.end(), interleaved.begin(), interleaved.begin() + frames * nChannels);
+        rendered += frames;
+
+        if (!released)
+            continue;
+        float peak = blockPeak(interleaved.data(), frames * nChannels);
+        quietFrames = peak < AUTOSAMPLE_FLOOR ? quietFrames + frames : 0;
+        if (quietFrames >= quietWanted && !anyVoiceActive())
+            break;
+    }
+
+    // Trimmed to the first and last frames over the floor
+    size_t first = out.size(), last = 0;
+    for (size_t i = 0; i < out.size(); i++) {
+        if (fabsf(out[i]) >= AUTOSAMPLE_FLOOR) {
+            first = min(first, i - i % nChannels);
+            last = i - i % nChannels + nChannels;
+        }
+    }
+    if (first >= last) {
+        fprintf(stderr, "note %d velocity %d came out silent\n", j.note, j.hiVel);
+        first = last = 0;
+    }
+
+    char name[64];
+    autosampleFileName(name, sizeof(name), j);
+    std::string path = std::string(autosampleDir) + "/" + name;
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "couldn't open %s\n", path.c_str());
+        return false;
+    }
+
+    uint32_t dataBytes = (uint32_t)((last - first) * sizeof(float));
+    writeWavHeader(f, currentSampleRate, nChannels, dataBytes);
+    bool ok = fwrite(out.data() + first, sizeof(float), last - first, f) == last - first;
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "couldn't write %s\n", path.c_str());
+    return ok;
+}
+
+bool writeAutosampleSfz() {
+    std::string path = std::string(autosampleDir) + "/patch.sfz";
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "couldn't open %s\n", path.c_str());
+        return false;
+    }
+
+    fprintf(f, "// %s voice, rendered with --autosample\n", voiceModelNames[voiceModel]);
+    fprintf(f, "<group> seq_length=%d\n", autosampleRoundRobins);
+    for (auto& j : autosampleJobs) {
+        char name[64];
+        autosampleFileName(name, sizeof(name), j);
+        fprintf(f, "<region> sample=%s pitch_keycenter=%d lokey=%d hikey=%d lovel=%d hivel=%d seq_position=%d\n",
+            name, j.note, j.loKey, j.hiKey, j.loVel, j.hiVel, j.roundRobin + 1);
+    }
+
+    bool ok = fclose(f) == 0;
+    if (ok)
+        printf("wrote %s\n", path.c_str());
+    return ok;
+}
+
+#ifndef _WIN32
+// Forked worker. Takes jobs until there are none left.
+bool autosampleWorker(std::atomic<uint32_t>* nextJob) {
+    bool ok = true;
+    while (true) {
+        uint32_t n = nextJob->fetch_add(1);
+        if (n >= autosampleJobs.size())
+            return ok;
+        ok = renderAutosample(autosampleJobs[n]) && ok;
+    }
+}
+#endif
+
+bool runAutosample() {
+    planAutosample();
+    if (autosampleJobs.empty()) {
+        fprintf(stderr, "no notes to sample between %d and %d\n", autosampleNotes[0], autosampleNotes[1]);
+        return false;
+    }
+
+#ifdef _WIN32
+    if (_mkdir(autosampleDir) != 0 && errno != EEXIST) {
+#else
+    if (mkdir(autosampleDir, 0755) != 0 && errno != EEXIST) {
+#endif
+        fprintf(stderr, "couldn't make %s\n", autosampleDir);
+        return false;
+    }
+
+    setSampleRate(autosampleRate);
+    loadTuning();
+    if (samplePath && !loadSample(samplePath))
+        fprintf(stderr, "sample voices will be silent\n");
+    setChannelCount(nChannels);
+    outputFormat = AUDIO_F32SYS;
+    // Samples go in the middle, and the arpeggiator would play other notes
+    voiceSpread = 0.0f;
+    seqMode = SeqMode::Off;
+
+    TuningTable* table = pendingTuning.exchange(nullptr);
+    if (table)
+        arenaFree(currentTuning.exchange(table));
+
+    takeCheckpoint();
+    autosampleStart = checkpoints[(checkpointHead.load() - 1) % CHECKPOINTS];
+
+    int workers = autosampleWorkers > 0 ? autosampleWorkers : (int)std::thread::hardware_concurrency();
+    workers = (int)clamp(workers, 1, (int)autosampleJobs.size());
+    printf("rendering %zu samples at %d Hz\n", autosampleJobs.size(), currentSampleRate);
+
+    bool ok = true;
+#ifdef _WIN32
+    for (auto& j : autosampleJobs) {
+        ok = renderAutosample(j) && ok;
+    }
+#else
+    printf("on %d workers\n", workers);
+    fflush(stdout);
+
+    // Shared with the workers, unlike everything else
+    void* shared = mmap(nullptr, sizeof(std::atomic<uint32_t>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "couldn't map the job counter\n");
+        return false;
+    }
+    auto* nextJob = new (shared) std::atomic<uint32_t>(0);
+
+    std::vector<pid_t> pids;
+    for (int w = 0; w < workers; w++) {
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(autosampleWorker(nextJob) ? 0 : 1);
+        if (pid < 0) {
+            fprintf(stderr, "couldn't start worker %d\n", w);
+            break;
+        }
+        pids.push_back(pid);
+    }
+
+    // Can't do without at least one
+    if (pids.empty())
+        ok = autosampleWorker(nextJob);
+
+    for (pid_t pid : pids) {
+        int status = 0;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = false;
+    }
+    munmap(shared, sizeof(std::atomic<uint32_t>));
+#endif
+
+    if (!ok)
+        fprintf(stderr, "some samples didn't render\n");
+    return writeAutosampleSfz() && ok;
+}
+
+
+// Remote UI
+// =========
+// The engine can serve everything the UI draws over TCP and take notes and
+// parameter changes back, so the SDL front end can run as its own process
+// (--remote) while the engine runs headless with --ui-server. A graphics
+// driver stalling SDL_RenderPresent then holds up nothing but the picture.
+// The server only listens on localhost; reach it from another box with an
+// SSH tunnel. Structs go over as they are, so both ends need to be the
+// same build, which the first message checks.
+
+const static int UI_STATE_RATE = 60;
+const uint32_t UI_MAGIC = 0x55534e59;
+
+bool uiServerEnabled = false;
+int uiPort = 5010;
+std::atomic<bool> uiServerRunning { false };
+
+// Front end side. The socket to the engine, and where its clock is
+// compared to ours.
+const char* remoteHost = nullptr;
+NetSocket remoteSocket = NO_SOCKET;
+double remoteClockOffset = 0.0;
+bool remoteInputActive = false;
+
+struct UiVoice {
+    int note;
+    double volume;
+    double pressTime;
+    double releaseTime;
+};
+
+struct UiState {
+    uint32_t magic;
+    uint32_t size;
+    // Engine's wall time when it was taken
+    double wallTime;
+    double params[P_Count];
+    UiVoice voices[NUM_VOICES];
+    MeterReadings meters;
+    bool inputActive;
+    float inputPeak;
+    float sidechainGain;
+    float mbGainReduction[MB_BANDS];
+    int seqCurrentStep;
+    int seqPattern[SEQ_STEPS];
+    ClockPLL midiClock;
+    int scopeFrames;
+    float scopeL[SCOPE_FRAMES];
+    float scopeR[SCOPE_FRAMES];
+};
+
+enum UiCommandType : uint8_t {
+    U_Input,
+    U_LoadTuning,
+    U_DumpJournal,
+};
+
+struct UiCommand {
+    UiCommandType type;
+    // For U_Input
+    JournalType input;
+    int32_t arg;
+    int32_t rate;
+    float velocity;
+    double value;
+    double rampTarget;
+    double rampSeconds;
+};
+
+#ifdef MSG_NOSIGNAL
+const static int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const static int SEND_FLAGS = 0;
+#endif
+
+bool sendAll(NetSocket sock, const void* data, int bytes) {
+    const char* p = (const char*)data;
+    while (bytes > 0) {
+        int sent = send(sock, p, bytes, SEND_FLAGS);
+        if (sent <= 0)
+            return false;
+        p += sent;
+        bytes -= sent;
+    }
+    return true;
+}
+
+bool recvAll(NetSocket sock, void* data, int bytes) {
+    char* p = (char*)data;
+    while (bytes > 0) {
+        int got = recv(sock, p, bytes, 0);
+        if (got <= 0)
+            return false;
+        p += got;
+        bytes -= got;
+    }
+    return true;
+}
+
+// Waits up to ms for something to read
+bool socketReadable(NetSocket sock, int ms) {
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(sock, &set);
+    timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return select((int)sock + 1, &set, nullptr, nullptr, &tv) > 0;
+}
+
+void fillUiState(UiState& s) {
+    s.magic = UI_MAGIC;
+    s.size = sizeof(UiState);
+    s.wallTime = getWallTime();
+    for (int p = 0; p < P_Count; p++) {
+        s.params[p] = readParameter((Param)p);
+    }
+    for (int i = 0; i < NUM_VOICES; i++) {
+        s.voices[i].note = voices[i].note;
+        s.voices[i].volume = voices[i].volume;
+        s.voices[i].pressTime = voices[i].pressTime;
+        s.voices[i].releaseTime = voices[i].releaseTime;
+    }
+    s.meters = meterReadings.load();
+    s.inputActive = inputActive();
+    s.inputPeak = inputPeak;
+    s.sidechainGain = sidechainGain;
+    memcpy(s.mbGainReduction, mbGainReduction, sizeof(s.mbGainReduction));
+    s.seqCurrentStep = seqCurrentStep;
+    memcpy(s.seqPattern, seqPattern, sizeof(s.seqPattern));
+    s.midiClock = midiClock.load();
+    s.scopeFrames = (int)clamp(bufSize, 0, SCOPE_FRAMES);
+    memcpy(s.scopeL, lastBufferL, sizeof(s.scopeL));
+    memcpy(s.scopeR, lastBufferR, sizeof(s.scopeR));
+}
+
+// Front end. Puts the engine's state where eventLoop looks for it.
+void applyUiState(const UiState& s) {
+    remoteClockOffset = s.wallTime - getWallTime();
+    for (int p = 0; p < P_Count; p++) {
+        // Some of these reset things when they change, so only on a change
+        if (readParameter((Param)p) != s.params[p])
+            applyParameter((Param)p, s.params[p]);
+    }
+    for (int i = 0; i < NUM_VOICES; i++) {
+        voices[i].note = s.voices[i].note;
+        voices[i].volume = s.voices[i].volume;
+        voices[i].pressTime = s.voices[i].pressTime;
+        voices[i].releaseTime = s.voices[i].releaseTime;
+    }
+    meterReadings.store(s.meters);
+    remoteInputActive = s.inputActive;
+    inputPeak = s.inputPeak;
+    sidechainGain = s.sidechainGain;
+    memcpy(mbGainReduction, s.mbGainReduction, sizeof(mbGainReduction));
+    seqCurrentStep = s.seqCurrentStep;
+    memcpy(seqPattern, s.seqPattern, sizeof(seqPattern));
+    midiClock.store(s.midiClock);
+    memcpy(lastBufferL, s.scopeL, sizeof(s.scopeL));
+    memcpy(lastBufferR, s.scopeR, sizeof(s.scopeR));
+}
+
+void handleUiCommand(const UiCommand& c) {
+    switch (c.type) {
+    case U_Input:
+        // Would only turn into NaN parameters on the audio thread
+        if (!std::isfinite(c.velocity) || !std::isfinite(c.value) || !std::isfinite(c.rampTarget) ||
+            !std::isfinite(c.rampSeconds))
+            break;
+
+        if (c.input == J_Param && c.arg >= 0 && c.arg < P_Count) {
+            setParameter((Param)c.arg, c.value);
+        } else if (c.input == J_Ramp && c.arg >= 0 && c.arg < P_Count) {
+            rampParameter((Param)c.arg, c.rampTarget, c.rampSeconds);
+        } else if (c.input == J_ParamStep && c.arg >= 0 && c.arg < P_Count) {
+            if (c.rate == S_RampBy)
+                rampParameterBy((Param)c.arg, c.rampTarget, c.rampSeconds);
+            else if (c.rate == S_Toggle)
+                toggleParameter((Param)c.arg);
+            else
+                nudgeParameter((Param)c.arg, c.value);
+        } else if (c.arg < 0 || c.arg > 127) {
+            // Not a note, and tuningIndex would take forever to find out
+            break;
+        } else if (c.input == J_NoteOn || c.input == J_NoteOff) {
+            // Stamped on arrival, the front end's clock means nothing here
+            if (c.input == J_NoteOn)
+                engineNoteOn(c.arg, getWallTime(), c.velocity);
+            else
+                engineNoteOff(c.arg, getWallTime());
+        } else if (c.input == J_NoteControl) {
+            engineNoteControl(c.arg, (NoteControl)c.rate, c.value);
+        }
+        break;
+    case U_LoadTuning:
+        loadTuning();
+        break;
+    case U_DumpJournal:
+        journalDumpRequested = true;
+        break;
+    }
+}
+
+// Serves one front end at a time. State goes out at UI_STATE_RATE and
+// commands are picked up in between.
+void uiServerThread() {
+    NetSocket listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == NO_SOCKET) {
+        fprintf(stderr, "couldn't open UI server socket\n");
         return;
+    }
 
-    int voiceSlot = getFreeVoiceIdx();
-    auto& v = voices[voiceSlot];
-    v.note = note;
-    v.freq = pitch(v.note);
-    v.volume = 1.0;
-    v.pressTime = currTime;
-    v.finishedPlaying = false;
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(uiPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        fprintf(stderr, "couldn't listen for the UI on port %i\n", uiPort);
+        closeSocket(listener);
+        return;
+    }
+    printf("UI server on 127.0.0.1:%i\n", uiPort);
+
+    static UiState state;
+
+    while (uiServerRunning) {
+        if (!socketReadable(listener, 250))
+            continue;
+
+        NetSocket client = accept(listener, nullptr, nullptr);
+        if (client == NO_SOCKET)
+            continue;
+
+        int noDelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+        // A front end that stops reading, or stops halfway through a
+        // command, gets dropped, not waited on forever
+#ifdef _WIN32
+        DWORD timeout = 1000;
+#else
+        timeval timeout = { 1, 0 };
+#endif
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        printf("remote UI connected\n");
+
+        double nextState = getWallTime();
+        bool ok = true;
+        while (ok && uiServerRunning) {
+            double now = getWallTime();
+            if (now >= nextState) {
+                fillUiState(state);
+                ok = sendAll(client, &state, sizeof(state));
+                nextState = max(nextState + 1.0 / UI_STATE_RATE, now);
+                continue;
+            }
+
+            if (socketReadable(client, (int)((nextState - now) * 1000.0) + 1)) {
+                UiCommand c;
+                ok = recvAll(client, &c, sizeof(c));
+                if (ok)
+                    handleUiCommand(c);
+            }
+        }
+
+        closeSocket(client);
+        printf("remote UI disconnected\n");
+    }
+
+    closeSocket(listener);
+}
+
+// Front end. Sends an input on to the engine instead of queueing it here.
+bool remoteForward(const JournalEntry& e) {
+    if (remoteSocket == NO_SOCKET)
+        return false;
+
+    UiCommand c = {};
+    c.type = U_Input;
+    c.input = e.type;
+    c.arg = e.arg;
+    c.rate = e.rate;
+    c.velocity = e.velocity;
+    c.value = e.value;
+    c.rampTarget = e.rampTarget;
+    c.rampSeconds = e.rampSeconds;
+    sendAll(remoteSocket, &c, sizeof(c));
+    return true;
+}
+
+bool remoteCommand(UiCommandType type) {
+    if (remoteSocket == NO_SOCKET)
+        return false;
 
-    //printf("note on: %i (at %f)\n", v.note, v.pressTime);
+    UiCommand c = {};
+    c.type = type;
+    sendAll(remoteSocket, &c, sizeof(c));
+    return true;
 }
 
-void setNoteOff(int note, double currTime) { 
-    while (true) {
-        int voiceSlot = getVoiceWithNote(note);
+// Connects and waits for the first state, so everything's in place
+// before the first frame gets drawn
+bool connectRemote(const char* host, int port) {
+    netStartup();
+
+    char portText[16];
+    snprintf(portText, sizeof(portText), "%i", port);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host, portText, &hints, &found) != 0 || !found) {
+        fprintf(stderr, "couldn't look up %s\n", host);
+        return false;
+    }
 
-        if (voiceSlot == -1) {
-            break;
-        }
+    NetSocket sock = socket(AF_INET, SOCK_STREAM, 0);
+    bool ok = sock != NO_SOCKET && connect(sock, found->ai_addr, (int)found->ai_addrlen) == 0;
+    freeaddrinfo(found);
+    if (!ok) {
+        fprintf(stderr, "couldn't connect to the engine at %s:%i\n", host, port);
+        if (sock != NO_SOCKET)
+            closeSocket(sock);
+        return false;
+    }
 
-        auto& v = voices[voiceSlot];
-        v.volume = 0.0;
-        v.releaseTime = currTime;
+    int noDelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
 
-        //printf("note off: %i at %f (started at %f)\n", note, v.releaseTime, v.pressTime);
+    static UiState state;
+    if (!socketReadable(sock, 2000) || !recvAll(sock, &state, sizeof(state)) ||
+        state.magic != UI_MAGIC || state.size != sizeof(UiState)) {
+        fprintf(stderr, "%s:%i isn't an engine from this build\n", host, port);
+        closeSocket(sock);
+        return false;
     }
+
+    remoteSocket = sock;
+    bufSize = state.scopeFrames;
+    applyUiState(state);
+    printf("connected to the engine at %s:%i\n", host, port);
+    return true;
 }
 
+// Front end, once a frame. Takes whatever states have come in and keeps
+// the newest, so a stall here only ever costs stale pictures.
+void pollRemote() {
+    if (remoteSocket == NO_SOCKET)
+        return;
+
+    static UiState state;
+    bool got = false;
+    while (socketReadable(remoteSocket, 0)) {
+        if (!recvAll(remoteSocket, &state, sizeof(state))) {
+            fprintf(stderr, "lost the engine\n");
+            closeSocket(remoteSocket);
+            remoteSocket = NO_SOCKET;
+
+            SDL_Event quit = {};
+            quit.type = SDL_QUIT;
+            SDL_PushEvent(&quit);
+            return;
+        }
+        got = true;
+    }
+
+    if (got)
+        applyUiState(state);
+}
 
 SDL_Renderer* renderer;
 SDL_Window* window;
@@ -488,8 +6420,17 @@ void eventLoop() {
     Label octaveModeLabel { "octave mode", SDL_Color { 255, 255, 255 }};
     Label clipLabel { "clipping!", SDL_Color { 255, 0, 0 }};
     Label lowpassLabel { "lowpass", SDL_Color { 255, 255, 255 }};
+    Label inputLabel { "input", SDL_Color { 255, 255, 255 }};
+    Label multibandLabel { "multiband", SDL_Color { 255, 255, 255 }};
+    Label harmonyLabel { "harmony", SDL_Color { 255, 255, 255 }};
+    Label harmonyHqLabel { "harmony hq", SDL_Color { 255, 255, 255 }};
+    Label voiceModelLabels[V_Count] = { { "(oscillator)" }, { "(pluck)" }, { "(bowed)" }, { "(sample)" } };
     Label* crushBitsLabel = new Label { "16.0" };
     double lastCrushBits = crushBits;
+    Label* seqLabel = nullptr;
+    Label* loudnessLabel = nullptr;
+    double loudnessLabelAge = 0.0;
+    char lastSeqText[64] = "";
 
     double lastTime = SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
     timeAccumulator = lastTime;
@@ -497,6 +6438,14 @@ void eventLoop() {
     while (!exit) {
         SDL_Event evt;
 
+        serviceAudioDevice();
+        pollRemote();
+
+        // Nothing moves on screen while the audio is suspended, so block
+        // on input instead of redrawing every vsync
+        if (audioSuspended && SDL_WaitEventTimeout(nullptr, 250) == 0)
+            continue;
+
         double currTime = SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
         double deltaTime = currTime - lastTime;
         lastTime = currTime;
@@ -505,13 +6454,16 @@ void eventLoop() {
             if (evt.type == SDL_QUIT)
                 exit = true;
 
+            if (evt.type == SDL_AUDIODEVICEREMOVED || evt.type == SDL_AUDIODEVICEADDED)
+                handleAudioDeviceEvent(evt);
+
+            if (evt.type == SDL_KEYDOWN)
+                wakeAudioDevice();
+
             if (evt.type == SDL_MOUSEBUTTONDOWN) {
                 if (evt.button.button == SDL_BUTTON_RIGHT) {
-                    currWaveFunc = (Waveform)(currWaveFunc + 1);
-
-                    // wrap around
-                    if (currWaveFunc == W_Count)
-                        currWaveFunc = W_Sine;
+                    // wraps around
+                    nudgeParameter(P_Waveform, 1);
                 }
             }
 
@@ -521,40 +6473,76 @@ void eventLoop() {
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_8) {
                     offset += 12;
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_9) {
-                    unisonDetune = !unisonDetune;
+                    toggleParameter(P_Unison);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_PLUS) {
-                    unisonDetuneAmount += 0.0001f;
+                    nudgeParameter(P_UnisonAmount, 0.0001);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_MINUS) {
-                    unisonDetuneAmount -= 0.0001f;
+                    nudgeParameter(P_UnisonAmount, -0.0001);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_ENTER) {
-                    enableBitcrush = !enableBitcrush;
+                    toggleParameter(P_Bitcrush);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_0) {
-                    enableCompressor = !enableCompressor;  
+                    toggleParameter(P_Compressor);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_7) {
-                    crushBits += 0.1f;
-                    crushBits = clamp(crushBits, 1.0, 31.0);
+                    nudgeParameter(P_CrushBits, 0.1);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_1) {
-                    crushBits -= 0.1f;
-                    crushBits = clamp(crushBits, 1.0, 31.0);
+                    nudgeParameter(P_CrushBits, -0.1);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_MULTIPLY) {
-                    octaveMode = (OctaveMode)((int)octaveMode + 1);
-                    if ((int)octaveMode > (int)OctaveMode::Quadruple) {
-                        octaveMode = OctaveMode::Single;
-                    }
+                    // Back to single after quadruple
+                    nudgeParameter(P_OctaveMode, 1);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_DIVIDE) {
-                    goofyUnison = !goofyUnison;
+                    toggleParameter(P_GoofyUnison);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_UP) {
-                    volume += 0.1f;
+                    rampParameterBy(P_Volume, 0.1, 0.05);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_DOWN) {
-                    volume -= 0.1f;
+                    rampParameterBy(P_Volume, -0.1, 0.05);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_4) {
+                    toggleParameter(P_Multiband);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_6) {
+                    // Off, then the cheap one, then the good one
+                    if (!harmonizerEnabled) {
+                        setParameter(P_HarmonyMode, H_TimeDomain);
+                        setParameter(P_Harmonizer, 1);
+                    } else if (harmonyMode == H_TimeDomain) {
+                        setParameter(P_HarmonyMode, H_PhaseVocoder);
+                    } else {
+                        setParameter(P_Harmonizer, 0);
+                    }
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_5) {
-                    lpEnabled = !lpEnabled;
+                    toggleParameter(P_Lowpass);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_3) {
-                    lpQ += 0.01f;
+                    nudgeParameter(P_LowpassQ, 0.01);
                 } else if (evt.key.keysym.scancode == SDL_SCANCODE_KP_PERIOD) {
-                    lpQ -= 0.01f;
+                    nudgeParameter(P_LowpassQ, -0.01);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F1) {
+                    nudgeParameter(P_SeqMode, 1);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F2) {
+                    nudgeParameter(P_ArpPattern, 1);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F3) {
+                    nudgeParameter(P_Tempo, -5.0);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F4) {
+                    nudgeParameter(P_Tempo, 5.0);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F5) {
+                    toggleParameter(P_SeqSync);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F6) {
+                    nudgeParameter(P_ArpOctaves, 1);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F7) {
+                    // Pick up edits to the tuning files
+                    if (!remoteCommand(U_LoadTuning))
+                        loadTuning();
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F8) {
+                    toggleParameter(P_InputMix);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F9) {
+                    toggleParameter(P_InputEffects);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F10) {
+                    toggleParameter(P_InputSidechain);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F11) {
+                    toggleParameter(P_Vocoder);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_F12) {
+                    nudgeParameter(P_VoiceModel, 1);
+                } else if (evt.key.keysym.scancode == SDL_SCANCODE_HOME) {
+                    if (!remoteCommand(U_DumpJournal))
+                        journalDumpRequested = true;
                 }
-                lpQ = clamp(lpQ, 0.0f, 1.0f);
             }
 
             auto noteIt = freqs.find(evt.key.keysym.scancode);
@@ -565,30 +6553,9 @@ void eventLoop() {
             int note = noteIt->second + offset;
 
             if (evt.type == SDL_KEYDOWN) {
-                setNoteOn(note, currTime);
-                if (octaveMode == OctaveMode::Double) {
-                    setNoteOn(note + 12, currTime);
-                } else if (octaveMode == OctaveMode::Triple) {
-                    setNoteOn(note + 12, currTime);
-                    setNoteOn(note + 24, currTime);
-                } else if (octaveMode == OctaveMode::Quadruple) {
-                    setNoteOn(note + 12, currTime);
-                    setNoteOn(note + 24, currTime);
-                    setNoteOn(note + 36, currTime);
-                }
+                engineNoteOn(note, currTime);
             } else if (evt.type == SDL_KEYUP) {
-                setNoteOff(note, currTime);
-
-                if (octaveMode == OctaveMode::Double) {
-                    setNoteOff(note + 12, currTime);
-                } else if (octaveMode == OctaveMode::Triple) {
-                    setNoteOff(note + 12, currTime);
-                    setNoteOff(note + 24, currTime);
-                } else if (octaveMode == OctaveMode::Quadruple) {
-                    setNoteOff(note + 12, currTime);
-                    setNoteOff(note + 24, currTime);
-                    setNoteOff(note + 36, currTime);
-                }
+                engineNoteOff(note, currTime);
             }
         }
 
@@ -600,14 +6567,15 @@ void eventLoop() {
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 
         SDL_RenderClear(renderer);
-        // visualise voices
+        // visualise voices, against the engine's clock if it's elsewhere
+        double engineTime = currTime + remoteClockOffset;
         for (int i = 0; i < NUM_VOICES; i++) {
             auto& v = voices[i];
             ADSRCurve curve;
-            double vAttenuation = getADSAttenuation(curve, currTime - v.pressTime);
+            double vAttenuation = getADSAttenuation(curve, engineTime - v.pressTime);
             
             if (v.volume == 0.0) {
-                vAttenuation = getRAttenuation(curve, currTime - v.releaseTime);
+                vAttenuation = getRAttenuation(curve, engineTime - v.releaseTime);
             }
 
             SDL_SetRenderDrawColor(renderer, 0, 50, vAttenuation * 255, 255);
@@ -622,203 +6590,997 @@ void eventLoop() {
 
             if (v.volume == 0.0) continue;
 
-            SDL_Rect r2;
-            r2.w = 5;
-            r2.h = 30;
-            r2.x = v.note * 6;
-            r2.y = 400;
-            SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-            SDL_RenderFillRect(renderer, &r2);
+            SDL_Rect r2;
+            r2.w = 5;
+            r2.h = 30;
+            r2.x = v.note * 6;
+            r2.y = 400;
+            SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+            SDL_RenderFillRect(renderer, &r2);
+        }
+
+        // visualise waveform
+        SDL_Point wPoints[128];
+
+        for (int i = 0; i < 128; i++) {
+            wPoints[i].x = i + 40;
+            wPoints[i].y = (waveFuncs[currWaveFunc](fmod(i / 64.0, 1.0)) * 30) + 400;
+        }
+
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        SDL_RenderDrawLines(renderer, wPoints, 128);
+        waveformLabel.draw(40, 400 - 50); 
+        if (voiceModel != V_Oscillator)
+            voiceModelLabels[voiceModel].draw(40 + 100, 400 - 50);
+
+        // JACK can change the period under us
+        static SDL_Point oscPointsL[SCOPE_FRAMES];
+        static SDL_Point oscPointsR[SCOPE_FRAMES];
+        int scopeFrames = (int)clamp(bufSize, 0, SCOPE_FRAMES);
+
+        for (int i = 0; i < scopeFrames; i++) {
+            oscPointsL[i].x = i + 40;
+            oscPointsL[i].y = (lastBufferL[i] * 100) + 480;
+        }
+
+
+        for (int i = 0; i < scopeFrames; i++) {
+            oscPointsR[i].x = i + 40;
+            oscPointsR[i].y = (lastBufferR[i] * 100) + 580;
+        }
+
+        SDL_RenderDrawLines(renderer, oscPointsL, scopeFrames);
+        SDL_RenderDrawLines(renderer, oscPointsR, scopeFrames);
+
+        MeterReadings meters = meterReadings.load();
+
+        // clipping indicator
+        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+        SDL_Rect clipRect;
+        clipRect.x = 64;
+        clipRect.y = 500;
+        clipRect.w = 64;
+        clipRect.h = 64;
+        if (meters.clipped) {
+            SDL_RenderFillRect(renderer, &clipRect);
+            clipLabel.draw(64, 594);
+        }
+
+        if (unisonDetune) {
+            SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+            SDL_Rect unisonRect;
+            unisonRect.x = 128 + 4;
+            unisonRect.y = 500;
+            unisonRect.w = 64;
+            unisonRect.h = 16 * (unisonDetuneAmount * 300);
+            SDL_RenderFillRect(renderer, &unisonRect);
+        }
+
+        if (enableBitcrush) {
+            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 0);
+            SDL_Rect labelRect;
+            labelRect.x = 20;
+            labelRect.y = 706;
+            labelRect.w = crushLabelMsg->w;
+            labelRect.h = crushLabelMsg->h;
+            SDL_RenderCopy(renderer, crushLabelTex, nullptr, &labelRect);
+
+            if (lastCrushBits != crushBits) {
+                delete crushBitsLabel;
+                char buf[5];
+                sprintf(buf, "%.1f", crushBits);
+                crushBitsLabel = new Label{buf};
+                lastCrushBits = crushBits;
+            }
+
+            crushBitsLabel->draw(20, 756);
+
+            drawDial(20 + 15, 756, (crushBits - 1.0f) / 15.0f, 30);
+        }
+
+        if (lpEnabled) {
+            lowpassLabel.draw(50, 756);
+            drawDial(50 + 15, 756, lpQ, 30);
+        }
+
+        {
+            // A bar per channel, RMS filled in with a tick for the held
+            // true peak, -48dB to 0dB
+            auto meterHeight = [](float level) {
+                return (int)(16 * 16 * clamp((gainToDb(level) + 48.0f) / 48.0f, 0.0f, 1.0f));
+            };
+
+            int channels = max(meters.channels, 1);
+            int barWidth = 64 / channels;
+            for (int ch = 0; ch < meters.channels; ch++) {
+                SDL_Rect volRect;
+                volRect.x = 128 + 4 + 72 + 72 + ch * barWidth;
+                volRect.y = 500 + (16 * 16);
+                volRect.w = max(barWidth - 2, 1);
+                volRect.h = -meterHeight(meters.rms[ch]);
+
+                if (meters.truePeak[ch] > 1.0f)
+                    SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+                else
+                    SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+                SDL_RenderFillRect(renderer, &volRect);
+
+                SDL_Rect peakRect = volRect;
+                peakRect.y = 500 + (16 * 16) - meterHeight(meters.truePeak[ch]);
+                peakRect.h = 2;
+                SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+                SDL_RenderFillRect(renderer, &peakRect);
+            }
+
+            vuLabel.draw(128 + 4 + 72 + 72, 480);
+
+            // Text is slow to redo, a few times a second is plenty
+            loudnessLabelAge += deltaTime;
+            if (!loudnessLabel || loudnessLabelAge > 0.25) {
+                char loudnessText[64];
+                snprintf(loudnessText, sizeof(loudnessText), "M %.1f S %.1f LUFS",
+                    max(meters.momentaryLufs, -70.0f), max(meters.shortTermLufs, -70.0f));
+                delete loudnessLabel;
+                loudnessLabel = new Label { loudnessText };
+                loudnessLabelAge = 0.0;
+            }
+
+            loudnessLabel->draw(128 + 4 + 72 + 72, 500 + (16 * 16) + 4);
+        }
+
+        if (inputActive() || remoteInputActive) {
+            SDL_Rect inRect;
+            inRect.x = 128 + 4 + 72 + 72 + 72;
+            inRect.y = 500 + (16 * 16);
+            inRect.w = 32;
+            inRect.h = -(16 * 16 * inputPeak);
+
+            inputLabel.draw(inRect.x, 480);
+            SDL_SetRenderDrawColor(renderer, 0, 150, 255, 255);
+            SDL_RenderFillRect(renderer, &inRect);
+
+            // Ducking hangs down from the top
+            if (inputSidechain) {
+                SDL_Rect duckRect;
+                duckRect.x = inRect.x + 36;
+                duckRect.y = 500;
+                duckRect.w = 16;
+                duckRect.h = 16 * 16 * (1.0f - sidechainGain);
+                SDL_SetRenderDrawColor(renderer, 255, 150, 0, 255);
+                SDL_RenderFillRect(renderer, &duckRect);
+            }
+        }
+
+        // Gain reduction per band hangs down from the top, 24dB full length
+        if (mbEnabled) {
+            int x = 128 + 4 + 72 * 4;
+            multibandLabel.draw(x, 480);
+            SDL_SetRenderDrawColor(renderer, 255, 150, 0, 255);
+            for (int b = 0; b < MB_BANDS; b++) {
+                SDL_Rect grRect;
+                grRect.x = x + b * 16;
+                grRect.y = 500;
+                grRect.w = 14;
+                grRect.h = (int)(16 * 16 * clamp(mbGainReduction[b] / 24.0f, 0.0f, 1.0f));
+                SDL_RenderFillRect(renderer, &grRect);
+            }
+        }
+
+        if (harmonizerEnabled) {
+            Label& label = harmonyMode == H_PhaseVocoder ? harmonyHqLabel : harmonyLabel;
+            label.draw(128 + 4 + 72 * 4, 500 + (16 * 16) + 4);
+        }
+
+        // Draw title
+        SDL_Rect titleRect;
+        titleRect.x = 5;
+        titleRect.y = 2;
+        titleRect.w = nameMsg->w;
+        titleRect.h = nameMsg->h; 
+        SDL_RenderCopy(renderer, nameTex, nullptr, &titleRect);
+
+        // Visualise octave mode
+        octaveModeLabel.draw(20, 430);
+        for (int i = 0; i < (int)octaveMode + 1; i++) {
+            drawOctaveMode(i);
+        }
+
+        // Sequencer
+        if (seqMode != SeqMode::Off) {
+            char seqText[64];
+            if (seqMode == SeqMode::Arp)
+                snprintf(seqText, sizeof(seqText), "arp %s x%i", arpPatternNames[arpPattern], arpOctaves);
+            else
+                snprintf(seqText, sizeof(seqText), "step");
+
+            if (seqSyncToMidiClock) {
+                ClockPLL clock = midiClock.load();
+                double bpm = clock.locked ? currentSampleRate * 60.0 / (clock.period * MIDI_CLOCK_PPQN) : 0.0;
+                snprintf(seqText + strlen(seqText), sizeof(seqText) - strlen(seqText), " ext %.1f", bpm);
+            } else {
+                snprintf(seqText + strlen(seqText), sizeof(seqText) - strlen(seqText), " %.0f bpm", seqTempo);
+            }
+
+            if (!seqLabel || strcmp(seqText, lastSeqText) != 0) {
+                delete seqLabel;
+                seqLabel = new Label { seqText };
+                strcpy(lastSeqText, seqText);
+            }
+
+            seqLabel->draw(400, 430);
+
+            int currStep = seqCurrentStep;
+            for (int i = 0; i < SEQ_STEPS; i++) {
+                SDL_Rect stepRect;
+                stepRect.x = 400 + i * 12;
+                stepRect.y = 460;
+                stepRect.w = 8;
+                stepRect.h = 8;
+
+                if (i == currStep)
+                    SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+                else if (seqMode == SeqMode::Step && seqPattern[i] == SEQ_REST)
+                    SDL_SetRenderDrawColor(renderer, 40, 40, 40, 255);
+                else
+                    SDL_SetRenderDrawColor(renderer, 120, 120, 120, 255);
+                SDL_RenderFillRect(renderer, &stepRect);
+            }
+        }
+
+        SDL_RenderPresent(renderer);
+    }
+}
+
+enum MsgType {
+    M_NoteOff = 0, 
+    M_NoteOn = 1,
+    M_AftertouchPolyphonic = 2,
+    M_ControlChange = 3,
+    M_ProgramChange = 4,
+    M_AftertouchChannel = 5,
+    M_PitchBend = 6
+};
+
+// Print incoming messages. Turned on with --verbose, and never when
+// they're handled on a realtime thread.
+bool logMidi = false;
+
+const double CC_GLIDE_SECONDS = 0.01;
+
+// Controllers, with the value scaled to 0..1 from whatever resolution it
+// came in at
+void midiController(int cc, double value) {
+    if (cc == 28) {
+        setParameter(P_CrushBits, 16.0 - value * 16.0);
+    }
+
+    // Glides over the gap a fast knob leaves between CCs, so there's no
+    // zipper noise
+    if (cc == 21) {
+        rampParameter(P_Volume, value * 2.0, CC_GLIDE_SECONDS);
+    }
+
+    if (cc == 22) {
+        setParameter(P_UnisonAmount, value * 0.005);
+    }
+}
+
+// Handles one complete MIDI message, stamped with the wall time it arrived.
+// Notes play at dspTime, or as soon as possible if it's negative.
+void handleMidiMessage(const unsigned char* msg, size_t nBytes, double wallTime, double dspTime = -1.0) {
+    if (nBytes == 0)
+        return;
+
+    // System realtime. These turn up on their own, at any time.
+    if (msg[0] >= 0xF8) {
+        if (msg[0] == 0xF8) {
+            midiClockTick(wallTime);
+        } else if (msg[0] == 0xFA) {
+            midiClockStart(true);
+        } else if (msg[0] == 0xFB) {
+            midiClockStart(false);
+        } else if (msg[0] == 0xFC) {
+            midiClockStop();
+        }
+        return;
+    }
+
+    const unsigned char channelMask = 0b00001111;
+    const unsigned char typeMask = 0b01110000;
+
+    // Catch the DSP clock up before anything gets stamped with it. Callers
+    // with their own timestamp have done that already, or never suspend
+    // (JACK), and may be on a realtime thread that mustn't lock.
+    if (dspTime < 0.0) {
+        wakeAudioDevice();
+        dspTime = timeAccumulator;
+    }
+
+    if (nBytes <= 3) {
+        uint8_t raw[3] = { msg[0], nBytes > 1 ? msg[1] : (uint8_t)0, nBytes > 2 ? msg[2] : (uint8_t)0 };
+        engineInput(J_Midi, (int)nBytes, dspTime, raw);
+    }
+
+    uint8_t channel = msg[0] & channelMask;
+    uint8_t type = (msg[0] & typeMask) >> 4;
+    if (logMidi)
+        printf("msg: channel %i, type %i\n", channel, type);
+
+    if (nBytes == 3) {
+        if (type == M_NoteOn) {
+            int newNote = msg[1];
+            int newVel = msg[2];
+
+            double currTime = dspTime;
+            if (msg[2] != 0) {
+                engineNoteOn(msg[1] + offset, currTime, newVel / 127.0f);
+            } else {
+                // Note on with no velocity is a note off
+                engineNoteOff(msg[1] + offset, currTime);
+            }
+            if (logMidi)
+                printf("midi note on! velocity: %i, note: %i\n", newVel, newNote);
+        }
+
+        if (type == M_NoteOff) {
+            engineNoteOff(msg[1] + offset, dspTime);
+        }
+
+        if (type == M_ControlChange) {
+            if (logMidi)
+                printf("set cc %i to %i\n", msg[1], msg[2]);
+
+            midiController(msg[1], msg[2] / 127.0);
+        }
+
+        if (type == M_PitchBend) {
+            // pitch bend uses 14 bits for some reason
+            int val = (msg[1] & 0b01111111) |
+                      ((msg[2] & 0b01111111) << 7);
+            double bend = (((double)val) / 16384.0) - 0.5;
+            setParameter(P_PitchBend, bend);
+            if (logMidi)
+                printf("pitch bend: %f\n", bend);
+
+        }
+    }
+}
+
+void midiCallback(double deltatime, std::vector< unsigned char >* message, void* userData) {
+    // deltatime is only relative to the previous message, so stamp it
+    // ourselves
+    handleMidiMessage(message->data(), message->size(), getWallTime());
+}
+
+// MIDI 2.0
+// --------
+// Universal MIDI Packets, one to four 32-bit words each. MIDI 2.0 channel
+// voice messages carry 16-bit velocity and 32-bit controllers in a single
+// packet, where MIDI 1.0 needed a pair of CCs for 14 bits, and can address
+// each note's pitch and controllers on their own. MIDI 1.0 messages wrapped
+// in UMP go through handleMidiMessage like any other.
+// Build with -DSYNTH_WITH_ALSA and link -lasound (1.2.10 or later) to read
+// them from a UMP rawmidi device with --ump hw:X,Y.
+
+// Per-note bend range either side, in semitones. 48 is what MPE uses.
+const double PER_NOTE_BEND_RANGE = 48.0;
+
+// Packet length in words, by message type
+const static int UMP_WORDS[16] = { 1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4 };
+
+// MIDI 2.0 channel voice opcodes
+enum UmpOpcode {
+    O_RegisteredPerNote = 0x0,
+    O_PerNoteBend = 0x6,
+    O_NoteOff = 0x8,
+    O_NoteOn = 0x9,
+    O_ControlChange = 0xB,
+    O_PitchBend = 0xE,
+    O_PerNoteManagement = 0xF,
+};
+
+int umpWords(uint32_t word) {
+    return UMP_WORDS[word >> 28];
+}
+
+// Full scale 32-bit controller to 0..1
+double umpUnit(uint32_t value) {
+    return value / 4294967295.0;
+}
+
+// Bends are centred on 0x80000000, this gives -1..1
+double umpCentred(uint32_t value) {
+    return ((double)value - 2147483648.0) / 2147483648.0;
+}
+
+// Handles one complete packet, stamped with the wall time it arrived
+void handleUmpPacket(const uint32_t* w, double wallTime) {
+    int type = w[0] >> 28;
+    uint8_t status = (w[0] >> 16) & 0xFF;
+
+    // System realtime and MIDI 1.0 channel voice are the same bytes as
+    // they'd be on a wire
+    if (type == 1 || type == 2) {
+        uint8_t msg[3] = { status, (uint8_t)((w[0] >> 8) & 0x7F), (uint8_t)(w[0] & 0x7F) };
+        if (type == 1 && status >= 0xF8) {
+            handleMidiMessage(msg, 1, wallTime);
+        } else if (type == 2) {
+            bool twoBytes = (status >> 4) == 0xC || (status >> 4) == 0xD;
+            handleMidiMessage(msg, twoBytes ? 2 : 3, wallTime);
+        }
+        return;
+    }
+
+    // Utility, data and stream messages don't mean anything to us
+    if (type != 4)
+        return;
+
+    int note = (w[0] >> 8) & 0x7F;
+    int index = w[0] & 0xFF;
+
+    wakeAudioDevice();
+    double dspTime = timeAccumulator;
+
+    switch (status >> 4) {
+    case O_NoteOn:
+        // Unlike MIDI 1.0, no velocity is still a note on
+        engineNoteOn(note + offset, dspTime, (w[1] >> 16) / 65535.0f);
+        // Attribute 3 gives the exact pitch as a 7.9 note number
+        if (index == 3)
+            engineNoteControl(note + offset, N_Bend, (w[1] & 0xFFFF) / 512.0 - note);
+        if (logMidi)
+            printf("ump note on: %i, velocity %u\n", note, w[1] >> 16);
+        break;
+    case O_NoteOff:
+        engineNoteOff(note + offset, dspTime);
+        break;
+    case O_ControlChange:
+        midiController(note, umpUnit(w[1]));
+        break;
+    case O_PitchBend:
+        // Same range as MIDI 1.0 bends
+        setParameter(P_PitchBend, umpCentred(w[1]) * 0.5);
+        break;
+    case O_PerNoteBend:
+        engineNoteControl(note + offset, N_Bend, umpCentred(w[1]) * PER_NOTE_BEND_RANGE);
+        break;
+    case O_RegisteredPerNote:
+        if (index == 3) {
+            // Pitch as a 7.25 note number
+            engineNoteControl(note + offset, N_Bend, w[1] / 33554432.0 - note);
+        } else if (index == 7) {
+            engineNoteControl(note + offset, N_Volume, umpUnit(w[1]));
+        } else if (index == 10) {
+            engineNoteControl(note + offset, N_Pan, (umpUnit(w[1]) - 0.5) * 180.0);
+        }
+        break;
+    case O_PerNoteManagement:
+        // Reset flag, the note goes back to plain
+        if (w[0] & 1)
+            engineNoteControl(note + offset, N_Reset, 0.0);
+        break;
+    default:
+        break;
+    }
+}
+
+// Runs whole packets out of a buffer of words, and returns how many
+// words that used. Anything after that is the start of a packet that
+// hasn't all arrived yet.
+size_t handleUmpWords(const uint32_t* words, size_t count, double wallTime) {
+    size_t i = 0;
+    while (i < count && i + umpWords(words[i]) <= count) {
+        handleUmpPacket(words + i, wallTime);
+        i += umpWords(words[i]);
+    }
+    return i;
+}
+
+#ifdef SYNTH_WITH_ALSA
+snd_ump_t* umpIn = nullptr;
+std::atomic<bool> umpRunning { false };
+std::thread umpThread;
+
+void umpReadThread() {
+    uint32_t words[256];
+    size_t have = 0;
+    while (umpRunning) {
+        // Wake up now and then to see if we should stop
+        pollfd fds[4];
+        int nFds = snd_ump_poll_descriptors(umpIn, fds, 4);
+        poll(fds, nFds, 100);
+
+        ssize_t got = snd_ump_read(umpIn, words + have, sizeof(words) - have * sizeof(uint32_t));
+        if (got == -EAGAIN)
+            continue;
+        if (got < 0) {
+            fprintf(stderr, "ump read failed: %s\n", snd_strerror((int)got));
+            break;
+        }
+
+        have += got / sizeof(uint32_t);
+        size_t used = handleUmpWords(words, have, getWallTime());
+        memmove(words, words + used, (have - used) * sizeof(uint32_t));
+        have -= used;
+    }
+}
+
+bool openUmp(const char* name) {
+    int err = snd_ump_open(&umpIn, nullptr, name, SND_RAWMIDI_NONBLOCK);
+    if (err < 0) {
+        fprintf(stderr, "failed to open ump device %s: %s\n", name, snd_strerror(err));
+        umpIn = nullptr;
+        return false;
+    }
+
+    printf("ump input: %s\n", name);
+    umpRunning = true;
+    umpThread = std::thread(umpReadThread);
+    return true;
+}
+
+void closeUmp() {
+    umpRunning = false;
+    if (umpThread.joinable())
+        umpThread.join();
+    if (umpIn)
+        snd_ump_close(umpIn);
+    umpIn = nullptr;
+}
+
+// ALSA sequencer
+// --------------
+// Instead of RtMidi. The kernel stamps each event with the time it came in
+// on a queue of our own, and it's read on a SCHED_FIFO thread, so neither
+// the read nor the thread waking up adds any jitter. Events go one buffer
+// after they arrived, on the exact frame, which is the same latency JACK
+// gets. Connect with --alsa-connect CLIENT:PORT, or from outside with
+// aconnect.
+
+snd_seq_t* alsaSeq = nullptr;
+snd_midi_event_t* alsaDecoder = nullptr;
+int alsaPort = -1;
+int alsaQueue = -1;
+std::atomic<bool> alsaMidiRunning { false };
+std::thread alsaMidiThread;
+
+const static int ALSA_MIDI_PRIORITY = 70;
+
+double alsaQueueTime(const snd_seq_real_time_t& t) {
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Wall time the queue is at right now. Read alongside each batch of
+// events, so the two clocks can't drift apart.
+double alsaQueueOffset() {
+    snd_seq_queue_status_t* status;
+    snd_seq_queue_status_alloca(&status);
+    if (snd_seq_get_queue_status(alsaSeq, alsaQueue, status) < 0)
+        return NAN;
+
+    double wall = getWallTime();
+    return wall - alsaQueueTime(*snd_seq_queue_status_get_real_time(status));
+}
+
+void alsaMidiReadThread() {
+    sched_param param = {};
+    param.sched_priority = ALSA_MIDI_PRIORITY;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+        fprintf(stderr, "couldn't get realtime priority for MIDI (%s), timing will be looser\n", strerror(err));
+    } else {
+        // Nothing printed from here on
+        logMidi = false;
+    }
+
+    int nFds = snd_seq_poll_descriptors_count(alsaSeq, POLLIN);
+    std::vector<pollfd> fds(nFds);
+    while (alsaMidiRunning) {
+        // Wake up now and then to see if we should stop
+        snd_seq_poll_descriptors(alsaSeq, fds.data(), nFds, POLLIN);
+        if (poll(fds.data(), nFds, 100) <= 0)
+            continue;
+
+        double offset = alsaQueueOffset();
+        snd_seq_event_t* ev;
+        while (snd_seq_event_input(alsaSeq, &ev) >= 0) {
+            unsigned char msg[16];
+            long nBytes = snd_midi_event_decode(alsaDecoder, msg, sizeof(msg), ev);
+            if (nBytes <= 0)
+                continue;
+
+            double wallTime = getWallTime();
+            if (snd_seq_ev_is_real(ev) && !std::isnan(offset))
+                wallTime = alsaQueueTime(ev->time.time) + offset;
+
+            // Straight after waking up the block clock is stale, so that
+            // one goes as soon as possible
+            bool wasSuspended = audioSuspended;
+            wakeAudioDevice();
+            double dspTime = -1.0;
+            if (!wasSuspended) {
+                dspTime = wallTimeToDspTime(wallTime) + bufSize / (double)currentSampleRate;
+                // Can't have been waiting around in the past
+                dspTime = max(dspTime, timeAccumulator);
+            }
+
+            handleMidiMessage(msg, nBytes, wallTime, dspTime);
+        }
+    }
+}
+
+bool openAlsaMidi(const char* connectTo) {
+    if (snd_seq_open(&alsaSeq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0) {
+        fprintf(stderr, "couldn't open the ALSA sequencer\n");
+        alsaSeq = nullptr;
+        return false;
+    }
+    snd_seq_set_client_name(alsaSeq, "synth");
+    alsaQueue = snd_seq_alloc_queue(alsaSeq);
+
+    // Anything that connects to us gets stamped with the queue's real time
+    snd_seq_port_info_t* info;
+    snd_seq_port_info_alloca(&info);
+    snd_seq_port_info_set_name(info, "synth in");
+    snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+    snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    snd_seq_port_info_set_timestamping(info, 1);
+    snd_seq_port_info_set_timestamp_real(info, 1);
+    snd_seq_port_info_set_timestamp_queue(info, alsaQueue);
+    if (snd_seq_create_port(alsaSeq, info) < 0) {
+        fprintf(stderr, "couldn't create an ALSA sequencer port\n");
+        snd_seq_close(alsaSeq);
+        alsaSeq = nullptr;
+        return false;
+    }
+    alsaPort = snd_seq_port_info_get_port(info);
+
+    snd_seq_start_queue(alsaSeq, alsaQueue, nullptr);
+    snd_seq_drain_output(alsaSeq);
+
+    if (connectTo) {
+        snd_seq_addr_t sender, dest;
+        dest.client = snd_seq_client_id(alsaSeq);
+        dest.port = alsaPort;
+
+        snd_seq_port_subscribe_t* sub;
+        snd_seq_port_subscribe_alloca(&sub);
+        if (snd_seq_parse_address(alsaSeq, &sender, connectTo) < 0) {
+            fprintf(stderr, "no ALSA sequencer port %s\n", connectTo);
+        } else {
+            snd_seq_port_subscribe_set_sender(sub, &sender);
+            snd_seq_port_subscribe_set_dest(sub, &dest);
+            snd_seq_port_subscribe_set_queue(sub, alsaQueue);
+            snd_seq_port_subscribe_set_time_update(sub, 1);
+            snd_seq_port_subscribe_set_time_real(sub, 1);
+            if (snd_seq_subscribe_port(alsaSeq, sub) < 0)
+                fprintf(stderr, "couldn't connect to %s\n", connectTo);
         }
+    }
 
-        // visualise waveform
-        SDL_Point wPoints[128];
+    // Whole messages every time, no running status
+    snd_midi_event_new(256, &alsaDecoder);
+    snd_midi_event_no_status(alsaDecoder, 1);
 
-        for (int i = 0; i < 128; i++) {
-            wPoints[i].x = i + 40;
-            wPoints[i].y = (waveFuncs[currWaveFunc](2.0, i / 128.0) * 30) + 400;
-        }
+    printf("alsa sequencer: %i:%i\n", snd_seq_client_id(alsaSeq), alsaPort);
+    alsaMidiRunning = true;
+    alsaMidiThread = std::thread(alsaMidiReadThread);
+    return true;
+}
 
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        SDL_RenderDrawLines(renderer, wPoints, 128);
-        waveformLabel.draw(40, 400 - 50); 
+void closeAlsaMidi() {
+    alsaMidiRunning = false;
+    if (alsaMidiThread.joinable())
+        alsaMidiThread.join();
+    if (alsaDecoder)
+        snd_midi_event_free(alsaDecoder);
+    if (alsaSeq)
+        snd_seq_close(alsaSeq);
+    alsaDecoder = nullptr;
+    alsaSeq = nullptr;
+}
+#endif
 
-        static SDL_Point* oscPointsL = (SDL_Point*)malloc(sizeof(SDL_Point) * bufSize);
-        static SDL_Point* oscPointsR = (SDL_Point*)malloc(sizeof(SDL_Point) * bufSize);
+// JACK
+// ====
+// Alternative to SDL output and RtMidi input. JACK gives us one planar
+// buffer per port, so we render straight into those, and MIDI events come
+// with a frame offset into the period so notes land on the exact sample.
+// Build with -DSYNTH_WITH_JACK and link -ljack.
+
+#ifdef SYNTH_WITH_JACK
+jack_client_t* jackClient = nullptr;
+jack_port_t* jackOutPorts[MAX_CHANNELS] = {};
+jack_port_t* jackMidiIn = nullptr;
+
+// Passes the transport position on to the sequencer. Blocks start at
+// engineFrame, which is where JACK says the transport is right now.
+void jackReadTransport() {
+    jack_position_t pos;
+    jack_transport_state_t state = jack_transport_query(jackClient, &pos);
+
+    transport.rolling = state == JackTransportRolling;
+    transport.frame = engineFrame;
+
+    // Only followed while it's rolling and someone is timebase master to
+    // say where the bars are. Stopped or without one, which is how most
+    // JACK setups sit, the sequencer keeps its own clock.
+    transport.valid = transport.rolling && (pos.valid & JackPositionBBT);
+    if (transport.valid) {
+        transport.bpm = pos.beats_per_minute;
+        transport.beat = (pos.bar - 1) * (double)pos.beats_per_bar + (pos.beat - 1) + pos.tick / pos.ticks_per_beat;
+    }
+}
 
-        for (int i = 0; i < bufSize; i++) {
-            oscPointsL[i].x = i + 40;
-            oscPointsL[i].y = (lastBufferL[i] * 100) + 480;
-        }
+int jackProcess(jack_nframes_t nframes, void*) {
+    onRealtimeThread = true;
+    double start = getWallTime();
+    jackReadTransport();
+
+    // MIDI for this period. Event times are frame offsets from the start
+    // of the period, which is timeAccumulator on the DSP clock.
+    void* midiBuffer = jack_port_get_buffer(jackMidiIn, nframes);
+    double wallNow = getWallTime();
+    jack_nframes_t nEvents = jack_midi_get_event_count(midiBuffer);
+    for (jack_nframes_t i = 0; i < nEvents; i++) {
+        jack_midi_event_t ev;
+        if (jack_midi_event_get(&ev, midiBuffer, i) != 0)
+            continue;
+
+        double offset = ev.time / (double)currentSampleRate;
+        handleMidiMessage(ev.buffer, ev.size, wallNow + offset, timeAccumulator + offset);
+    }
 
+    // Render straight into the port buffers, a block at a time
+    float* ports[MAX_CHANNELS];
+    for (int ch = 0; ch < nChannels; ch++) {
+        ports[ch] = (float*)jack_port_get_buffer(jackOutPorts[ch], nframes);
+    }
 
-        for (int i = 0; i < bufSize; i++) {
-            oscPointsR[i].x = i + 40;
-            oscPointsR[i].y = (lastBufferR[i] * 100) + 580;
+    for (int done = 0; done < (int)nframes;) {
+        int chunk = min((int)nframes - done, MAX_BLOCK);
+        for (int ch = 0; ch < nChannels; ch++) {
+            outBus[ch] = ports[ch] + done;
         }
 
-        SDL_RenderDrawLines(renderer, oscPointsL, bufSize);
-        SDL_RenderDrawLines(renderer, oscPointsR, bufSize);
+        renderBlock(chunk);
+        keepScopeCopy(done, chunk);
+        rtpBlock(chunk);
+        done += chunk;
+    }
 
-        // clipping indicator
-        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-        SDL_Rect clipRect;
-        clipRect.x = 64;
-        clipRect.y = 500;
-        clipRect.w = 64;
-        clipRect.h = 64;
-        if (hasClipped) {
-            SDL_RenderFillRect(renderer, &clipRect);
-            clipLabel.draw(64, 594);
-        }
+    for (int ch = 0; ch < MAX_CHANNELS; ch++) {
+        outBus[ch] = outBusStorage[ch];
+    }
 
-        if (unisonDetune) {
-            SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
-            SDL_Rect unisonRect;
-            unisonRect.x = 128 + 4;
-            unisonRect.y = 500;
-            unisonRect.w = 64;
-            unisonRect.h = 16 * (unisonDetuneAmount * 300);
-            SDL_RenderFillRect(renderer, &unisonRect);
-        }
+    recordCallbackLoad(start, nframes);
+    return 0;
+}
 
-        if (enableBitcrush) {
-            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 0);
-            SDL_Rect labelRect;
-            labelRect.x = 20;
-            labelRect.y = 706;
-            labelRect.w = crushLabelMsg->w;
-            labelRect.h = crushLabelMsg->h;
-            SDL_RenderCopy(renderer, crushLabelTex, nullptr, &labelRect);
+int jackBufferSize(jack_nframes_t nframes, void*) {
+    bufSize = nframes;
+    return 0;
+}
 
-            if (lastCrushBits != crushBits) {
-                delete crushBitsLabel;
-                char buf[5];
-                sprintf(buf, "%.1f", crushBits);
-                crushBitsLabel = new Label{buf};
-                lastCrushBits = crushBits;
-            }
+int jackSampleRate(jack_nframes_t rate, void*) {
+    setSampleRate(rate);
+    return 0;
+}
 
-            crushBitsLabel->draw(20, 756);
+void jackShutdown(void*) {
+    // The server went away, nothing more will get rendered
+    fprintf(stderr, "JACK server shut down\n");
+    SDL_Event quit;
+    quit.type = SDL_QUIT;
+    SDL_PushEvent(&quit);
+}
 
-            drawDial(20 + 15, 756, (crushBits - 1.0f) / 15.0f, 30);
-        }
+// Connects to a running server and sets the engine up to match it.
+// Doesn't start processing until startJack.
+bool openJack(const char* name, int channels) {
+    jack_status_t status;
+    jackClient = jack_client_open(name, JackNoStartServer, &status);
+    if (!jackClient) {
+        fprintf(stderr, "Couldn't connect to a JACK server (status 0x%x)\n", (unsigned)status);
+        return false;
+    }
 
-        if (lpEnabled) {
-            lowpassLabel.draw(50, 756);
-            drawDial(50 + 15, 756, lpQ, 30);
+    channels = max(1, min(channels, MAX_CHANNELS));
+    for (int ch = 0; ch < channels; ch++) {
+        char portName[32];
+        snprintf(portName, sizeof(portName), "out_%i", ch + 1);
+        jackOutPorts[ch] = jack_port_register(jackClient, portName, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+        if (!jackOutPorts[ch]) {
+            fprintf(stderr, "Couldn't register JACK port %s\n", portName);
+            jack_client_close(jackClient);
+            jackClient = nullptr;
+            return false;
         }
+    }
+    jackMidiIn = jack_port_register(jackClient, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
 
-        {
-            if (hasClipped)
-                SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-            else
-                SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
-            SDL_Rect volRect;
-            volRect.x = 128 + 4 + 72 + 72;
-            volRect.y = 500 + (16 * 16);
-            volRect.w = 64;
-            volRect.h = -(16 * 16 * maxAmplitude);
+    jack_set_process_callback(jackClient, jackProcess, nullptr);
+    jack_set_buffer_size_callback(jackClient, jackBufferSize, nullptr);
+    jack_set_sample_rate_callback(jackClient, jackSampleRate, nullptr);
+    jack_on_shutdown(jackClient, jackShutdown, nullptr);
 
-            vuLabel.draw(128 + 4 + 72 + 72, 480);
-            SDL_RenderFillRect(renderer, &volRect);
-        }
+    bufSize = jack_get_buffer_size(jackClient);
+    setSampleRate(jack_get_sample_rate(jackClient));
+    setChannelCount(channels);
 
-        // Draw title
-        SDL_Rect titleRect;
-        titleRect.x = 5;
-        titleRect.y = 2;
-        titleRect.w = nameMsg->w;
-        titleRect.h = nameMsg->h; 
-        SDL_RenderCopy(renderer, nameTex, nullptr, &titleRect);
+    // JACK keeps calling us whatever happens, and the samples are floats
+    idleSuspendSeconds = -1.0f;
+    outputFormat = AUDIO_F32SYS;
+    logMidi = false;
 
-        // Visualise octave mode
-        octaveModeLabel.draw(20, 430);
-        for (int i = 0; i < (int)octaveMode + 1; i++) {
-            drawOctaveMode(i);
-        }
+    printf("JACK client \"%s\": %i outputs at %i Hz, %i frames a period\n",
+        jack_get_client_name(jackClient), channels, currentSampleRate, bufSize);
+    return true;
+}
 
-        SDL_RenderPresent(renderer);
+bool startJack() {
+    if (jack_activate(jackClient) != 0) {
+        fprintf(stderr, "Couldn't activate JACK client\n");
+        return false;
     }
-}
 
-enum MsgType {
-    M_NoteOff = 0, 
-    M_NoteOn = 1,
-    M_AftertouchPolyphonic = 2,
-    M_ControlChange = 3,
-    M_ProgramChange = 4,
-    M_AftertouchChannel = 5,
-    M_PitchBend = 6
-};
+    // Hook the outputs up to the speakers, in order
+    const char** playback = jack_get_ports(jackClient, nullptr, JACK_DEFAULT_AUDIO_TYPE, JackPortIsPhysical | JackPortIsInput);
+    if (playback) {
+        for (int ch = 0; ch < nChannels && playback[ch]; ch++) {
+            jack_connect(jackClient, jack_port_name(jackOutPorts[ch]), playback[ch]);
+        }
+        jack_free(playback);
+    }
 
-void midiCallback(double deltatime, std::vector< unsigned char >* message, void* userData) {
-    unsigned int nBytes = message->size();
+    return true;
+}
 
-    const unsigned char channelMask = 0b00001111;
-    const unsigned char typeMask = 0b01110000;
+void closeJack() {
+    if (!jackClient)
+        return;
 
-    uint8_t channel = message->at(0) & channelMask;
-    uint8_t type = (message->at(0) & typeMask) >> 4;
-    printf("msg: channel %i, type %i\n", channel, type);
+    jack_deactivate(jackClient);
+    jack_client_close(jackClient);
+    jackClient = nullptr;
+}
+#endif
 
-    if (nBytes == 3) {
-        if (type == M_NoteOn) {
-            int newNote = message->at(1);
-            int newVel = message->at(2);
-
-            double currTime = timeAccumulator;
-            if (message->at(2) != 0) {
-                setNoteOn(message->at(1) + offset, currTime);
-                int oOffset = 0;
-                for (int i = 0; i < (int)octaveMode; i++) {
-                    oOffset += 12;
-                    setNoteOn(message->at(1) + oOffset + offset, currTime);
-                }
-            } 
-            printf("midi note on! velocity: %i, note: %i\n", newVel, newNote);
-        }
+// Cleared on the way out so the helper threads can finish up
+std::atomic<bool> synthRunning { true };
+
+// MIDI stress
+// ===========
+// --midi-stress RATE floods the input with RATE synthetic MIDI events a
+// second for --stress-seconds, after a couple of quiet seconds to measure
+// against. Events go straight into handleMidiMessage, or with
+// --stress-virtual out of an RtMidi virtual port that the input is hooked
+// up to, so RtMidi's thread is in the path too. The stream is MPE-like:
+// each note on its own channel with a CC 74 and a pitch bend before its
+// note off. Prints latency percentiles, losses, the input queue's
+// high-water mark and callback load, then quits.
+
+const double STRESS_BASELINE_SECONDS = 2.0;
+
+int stressRate = 0;
+double stressSeconds = 10.0;
+bool stressVirtual = false;
+
+// Percentile of a histogram, in bins
+double histogramPercentile(const std::atomic<uint32_t>* bins, int count, double pct) {
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += bins[i];
+    }
+    if (total == 0)
+        return 0.0;
+
+    uint64_t want = (uint64_t)ceil(total * pct / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < count; i++) {
+        seen += bins[i];
+        if (seen >= want)
+            return i + 0.5;
+    }
 
-        if (type == M_NoteOff) {
-            setNoteOff(message->at(1) + offset, timeAccumulator);
-            int oOffset = 0;
-            for (int i = 0; i < (int)octaveMode; i++) {
-                oOffset += 12;
-                setNoteOff(message->at(1) + oOffset + offset, timeAccumulator);
-            }
-        }
+    return count;
+}
 
-        if (type == M_ControlChange) {
-            printf("set cc %i to %i\n", message->at(1), message->at(2));
+void printStressLoad(const char* name, InputStats& st) {
+    double mean = 0.0;
+    for (int i = 0; i <= LOAD_BINS; i++) {
+        mean += st.load[i] * (i + 0.5);
+    }
+    mean /= max((double)st.callbacks, 1.0);
 
-            if (message->at(1) == 28) {
-                crushBits = 16.0f - ((message->at(2) / 127.0f) * 16.0f);
-            }
+    printf("  callback load, %s: mean %.1f%%, p99 %.1f%%, max %.1f%%, %u of %u over time\n", name, mean,
+        histogramPercentile(st.load, LOAD_BINS + 1, 99.0), st.maxLoad.load(), st.overruns.load(), st.callbacks.load());
+}
 
-            if (message->at(1) == 21) {
-                volume = (message->at(2) / 127.0f) * 2.0f;
-            }
+void midiStressThread(RtMidiOut* out) {
+    printf("midi stress: %.0fs quiet, then %i events/s for %.0fs%s\n", STRESS_BASELINE_SECONDS, stressRate,
+        stressSeconds, out ? " through a virtual port" : "");
 
-            if (message->at(1) == 22) {
-                unisonDetuneAmount = (message->at(2) / 127.0f) * 0.005f;
-            }
-        }
+    statsPhase = 0;
+    SDL_Delay((Uint32)(STRESS_BASELINE_SECONDS * 1000));
+    statsPhase = 1;
 
-        if (type == M_PitchBend) {
-            // pitch bend uses 14 bits for some reason
-            int val = (message->at(1) & 0b01111111) |
-                      ((message->at(2) & 0b01111111) << 7);
-            pitchBendAmt = (((double)val) / 16384.0) - 0.5;
-            printf("pitch bend: %f\n", pitchBendAmt);
+    unsigned droppedBefore = engineInputsDropped;
+    uint64_t sent = 0;
+    double start = getWallTime();
+
+    while (synthRunning) {
+        double due = start + sent / (double)stressRate;
+        if (due >= start + stressSeconds)
+            break;
 
+        // Sleep while there's time, spin the last bit so spacing stays even
+        double wait = due - getWallTime();
+        if (wait > 0.002)
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait - 0.001));
+        while (getWallTime() < due) {}
+
+        int channel = (sent / 4) % 16;
+        unsigned char note = 48 + (sent / 64) % 24;
+        unsigned char msg[3];
+        switch (sent % 4) {
+        case 0:
+            msg[0] = 0x90 | channel; msg[1] = note; msg[2] = 100;
+            break;
+        case 1:
+            msg[0] = 0xB0 | channel; msg[1] = 74; msg[2] = sent % 128;
+            break;
+        case 2:
+            msg[0] = 0xE0 | channel; msg[1] = 0; msg[2] = 64 + (sent / 16) % 8;
+            break;
+        default:
+            msg[0] = 0x80 | channel; msg[1] = note; msg[2] = 0;
+            break;
         }
+
+        if (out)
+            out->sendMessage(msg, 3);
+        else
+            handleMidiMessage(msg, 3, getWallTime());
+        sent++;
     }
+
+    double took = getWallTime() - start;
+
+    // Let the last of it through
+    SDL_Delay(500);
+    statsPhase = -1;
+
+    InputStats& st = inputStats[1];
+    unsigned applied = st.applied;
+    printf("midi stress results\n");
+    printf("  sent %llu events in %.2fs (%.0f/s), %u applied, %lld lost, %u inputs dropped with the queue full\n",
+        (unsigned long long)sent, took, sent / took, applied, (long long)sent - applied, engineInputsDropped - droppedBefore);
+    printf("  queued to applied: p50 %.2fms, p90 %.2fms, p99 %.2fms, p99.9 %.2fms, max %.2fms\n",
+        histogramPercentile(st.latency, LATENCY_BINS + 1, 50.0) * LATENCY_BIN_SECONDS * 1000.0,
+        histogramPercentile(st.latency, LATENCY_BINS + 1, 90.0) * LATENCY_BIN_SECONDS * 1000.0,
+        histogramPercentile(st.latency, LATENCY_BINS + 1, 99.0) * LATENCY_BIN_SECONDS * 1000.0,
+        histogramPercentile(st.latency, LATENCY_BINS + 1, 99.9) * LATENCY_BIN_SECONDS * 1000.0,
+        st.maxLatency.load() * 1000.0);
+    printf("  input queue high-water: %u of %i\n", st.highWater.load(), ENGINE_INPUT_QUEUE);
+    printStressLoad("quiet", inputStats[0]);
+    printStressLoad("flood", inputStats[1]);
+
+    SDL_Event quit;
+    quit.type = SDL_QUIT;
+    SDL_PushEvent(&quit);
 }
 
+
 void fancyThread(RtMidiOut* launchkeyOut) {
-    while (true) {
+    while (synthRunning) {
+        // Top row is the left channel, bottom row the right, 6dB a pad
+        MeterReadings meters = meterReadings.load();
+        float levelL = gainToDb(meters.truePeak[0]);
+        float levelR = gainToDb(meters.truePeak[meters.channels > 1 ? 1 : 0]);
+
         for (int i = 0; i < 8; i++) {
-            bool on = ((maxAmplitude - (i * 0.125f)) > 0);
+            bool on = levelL > -48.0f + i * 6.0f;
             int vel = on ? 21 : 0;
 
             if (i >= 5) {
@@ -833,7 +7595,7 @@ void fancyThread(RtMidiOut* launchkeyOut) {
         }
 
         for (int i = 0; i < 8; i++) {
-            bool on = ((maxAmplitude - (i * 0.125f)) > 0);
+            bool on = levelR > -48.0f + i * 6.0f;
             int vel = on ? 21 : 0;
 
             if (i >= 5) {
@@ -851,47 +7613,446 @@ void fancyThread(RtMidiOut* launchkeyOut) {
     }
 }
 
+// Frees what the audio thread has retired, and everything still waiting
+// once the synth is shutting down
+void housekeepingThread() {
+    std::vector<std::pair<double, void*>> waiting;
+    double nextDeviceLoss = getWallTime() + injectDeviceLossSeconds;
+    while (synthRunning) {
+        arenaCollect(waiting, getWallTime());
+
+        if (journalDumpRequested.exchange(false))
+            dumpJournal();
+
+        if (injectDeviceLossSeconds > 0.0f && getWallTime() >= nextDeviceLoss) {
+            injectDeviceLoss();
+            nextDeviceLoss += injectDeviceLossSeconds;
+        }
+
+        SDL_Delay(20);
+    }
+
+    arenaCollect(waiting, INFINITY);
+    if (arenaLeaks > 0)
+        fprintf(stderr, "retire queue overflowed, leaked %i resources\n", arenaLeaks.load());
+}
+
+// Headless
+// ========
+// For racks and installations. No window, renderer or fonts, just the
+// audio device and MIDI. The main thread sleeps until it's told to stop,
+// waking up a few times a second to look after the audio device.
+
+#ifdef __linux__
+sigset_t shutdownSignals;
+
+// Has to happen before any other thread starts, so they all inherit the
+// mask and the signals are left for sigtimedwait
+void blockShutdownSignals() {
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGTERM);
+    sigaddset(&shutdownSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, nullptr);
+}
+
+// Waits up to ms milliseconds, true if we've been asked to stop
+bool waitForShutdown(int ms) {
+    timespec timeout = { ms / 1000, (ms % 1000) * 1000000L };
+    int sig = sigtimedwait(&shutdownSignals, nullptr, &timeout);
+    if (sig > 0) {
+        printf("caught signal %i, shutting down\n", sig);
+        return true;
+    }
+
+    return false;
+}
+#else
+std::atomic<bool> shutdownRequested { false };
+
+void onShutdownSignal(int) {
+    shutdownRequested = true;
+}
+
+void blockShutdownSignals() {
+    signal(SIGTERM, onShutdownSignal);
+    signal(SIGINT, onShutdownSignal);
+}
+
+bool waitForShutdown(int ms) {
+    SDL_Delay(ms);
+    return shutdownRequested;
+}
+#endif
+
+void headlessLoop() {
+    printf("running headless\n");
+
+    while (!waitForShutdown(100)) {
+        // Nobody's looking at these, but the queue shouldn't fill up.
+        // Quit can still come from the audio backend going away.
+        SDL_Event evt;
+        bool quit = false;
+        while (SDL_PollEvent(&evt)) {
+            if (evt.type == SDL_QUIT)
+                quit = true;
+            if (evt.type == SDL_AUDIODEVICEREMOVED || evt.type == SDL_AUDIODEVICEADDED)
+                handleAudioDeviceEvent(evt);
+        }
+        if (quit)
+            break;
+
+        serviceAudioDevice();
+    }
+}
+
 int main(int argc, char** argv) {
-    SDL_Init(SDL_INIT_EVERYTHING);
-    TTF_Init();
-    font = TTF_OpenFont("font.ttf", 20);
-    SDL_AudioSpec want;
-    want.format = AUDIO_F32;
-    want.samples = bufSize;
-    want.freq = 44100; 
-    want.userdata = nullptr;
-    want.channels = nChannels;
-    want.callback = audioCallback;
-    want.silence = 0;
+    int clockOutPort = -1;
+    bool headless = false;
+    bool openCapture = false;
+    const char* captureName = nullptr;
+    int captureChannels = 1;
+    bool useJack = false;
+    const char* jackName = "synth";
+    const char* umpName = nullptr;
+    bool useAlsaMidi = false;
+    const char* alsaConnect = nullptr;
+    const char* replayPath = nullptr;
+    const char* replayOut = "replay.wav";
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--idle-suspend") && i + 1 < argc) {
+            idleSuspendSeconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--arp")) {
+            seqMode = SeqMode::Arp;
+        } else if (!strcmp(argv[i], "--step")) {
+            seqMode = SeqMode::Step;
+        } else if (!strcmp(argv[i], "--tempo") && i + 1 < argc) {
+            seqTempo = clamp(atof(argv[++i]), 20.0, 400.0);
+        } else if (!strcmp(argv[i], "--midi-clock-in")) {
+            seqSyncToMidiClock = true;
+        } else if (!strcmp(argv[i], "--clock-out") && i + 1 < argc) {
+            clockOutPort = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "s16"))
+                outputFormat = AUDIO_S16SYS;
+            else if (!strcmp(argv[i], "s32"))
+                outputFormat = AUDIO_S32SYS;
+            else if (!strcmp(argv[i], "f32"))
+                outputFormat = AUDIO_F32SYS;
+            else
+                outputFormat = 0;
+        } else if (!strcmp(argv[i], "--dither") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "off"))
+                ditherMode = D_Off;
+            else if (!strcmp(argv[i], "shaped"))
+                ditherMode = D_Shaped;
+            else
+                ditherMode = D_Tpdf;
+        } else if (!strcmp(argv[i], "--channels") && i + 1 < argc) {
+            nChannels = (int)clamp(atoi(argv[++i]), 1, MAX_CHANNELS);
+        } else if (!strcmp(argv[i], "--spread") && i + 1 < argc) {
+            voiceSpread = clamp(atof(argv[++i]), 0.0, 360.0);
+        } else if (!strcmp(argv[i], "--scl") && i + 1 < argc) {
+            sclPath = argv[++i];
+        } else if (!strcmp(argv[i], "--kbm") && i + 1 < argc) {
+            kbmPath = argv[++i];
+        } else if (!strcmp(argv[i], "--arena-mb") && i + 1 < argc) {
+            arenaMegabytes = max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--huge-pages")) {
+            arenaHugePages = true;
+        } else if (!strcmp(argv[i], "--jack")) {
+            useJack = true;
+        } else if (!strcmp(argv[i], "--jack-name") && i + 1 < argc) {
+            useJack = true;
+            jackName = argv[++i];
+        } else if (!strcmp(argv[i], "--alsa-midi")) {
+            useAlsaMidi = true;
+        } else if (!strcmp(argv[i], "--alsa-connect") && i + 1 < argc) {
+            useAlsaMidi = true;
+            alsaConnect = argv[++i];
+        } else if (!strcmp(argv[i], "--ump") && i + 1 < argc) {
+            umpName = argv[++i];
+        } else if (!strcmp(argv[i], "--rtp") && i + 1 < argc) {
+            rtpEnabled = true;
+            rtpAddress = argv[++i];
+        } else if (!strcmp(argv[i], "--rtp-port") && i + 1 < argc) {
+            rtpPort = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--rtp-bits") && i + 1 < argc) {
+            rtpBits = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--rtp-ptime") && i + 1 < argc) {
+            rtpPacketMs = clamp(atof(argv[++i]), 0.125, 20.0);
+        } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (!strcmp(argv[i], "--replay-out") && i + 1 < argc) {
+            replayOut = argv[++i];
+        } else if (!strcmp(argv[i], "--autosample") && i + 1 < argc) {
+            autosampleDir = argv[++i];
+        } else if (!strcmp(argv[i], "--autosample-notes") && i + 1 < argc) {
+            int* n = autosampleNotes;
+            if (sscanf(argv[++i], "%d,%d,%d", &n[0], &n[1], &n[2]) != 3 || n[0] < 0 || n[1] > 127 || n[0] > n[1] || n[2] < 1) {
+                fprintf(stderr, "--autosample-notes wants LO,HI,STEP with 0 <= LO <= HI <= 127 and STEP >= 1\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--autosample-velocities") && i + 1 < argc) {
+            autosampleLayers = (int)clamp(atoi(argv[++i]), 1, 127);
+        } else if (!strcmp(argv[i], "--autosample-rr") && i + 1 < argc) {
+            autosampleRoundRobins = max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--autosample-hold") && i + 1 < argc) {
+            autosampleHold = max(atof(argv[++i]), 0.0);
+        } else if (!strcmp(argv[i], "--autosample-workers") && i + 1 < argc) {
+            autosampleWorkers = max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--autosample-rate") && i + 1 < argc) {
+            autosampleRate = (int)clamp(atoi(argv[++i]), 8000, 192000);
+        } else if (!strcmp(argv[i], "--render-threads") && i + 1 < argc) {
+            renderThreads = max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--verbose")) {
+            logMidi = true;
+        } else if (!strcmp(argv[i], "--midi-stress") && i + 1 < argc) {
+            stressRate = max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--stress-seconds") && i + 1 < argc) {
+            stressSeconds = max(atof(argv[++i]), 0.1);
+        } else if (!strcmp(argv[i], "--stress-virtual")) {
+            stressVirtual = true;
+        } else if (!strcmp(argv[i], "--headless")) {
+            headless = true;
+        } else if (!strcmp(argv[i], "--device") && i + 1 < argc) {
+            outputDeviceName = argv[++i];
+        } else if (!strcmp(argv[i], "--backup-device") && i + 1 < argc) {
+            backupDeviceName = argv[++i];
+        } else if (!strcmp(argv[i], "--inject-device-loss") && i + 1 < argc) {
+            injectDeviceLossSeconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--ui-server")) {
+            uiServerEnabled = true;
+        } else if (!strcmp(argv[i], "--ui-port") && i + 1 < argc) {
+            uiPort = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--remote") && i + 1 < argc) {
+            remoteHost = argv[++i];
+        } else if (!strcmp(argv[i], "--input")) {
+            openCapture = true;
+        } else if (!strcmp(argv[i], "--input-device") && i + 1 < argc) {
+            openCapture = true;
+            captureName = argv[++i];
+        } else if (!strcmp(argv[i], "--input-channels") && i + 1 < argc) {
+            captureChannels = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--input-gain") && i + 1 < argc) {
+            inputGain = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--sidechain")) {
+            inputSidechain = true;
+        } else if (!strcmp(argv[i], "--voice") && i + 1 < argc) {
+            i++;
+            for (int m = 0; m < V_Count; m++) {
+                if (!strcmp(argv[i], voiceModelNames[m]))
+                    voiceModel = (VoiceModel)m;
+            }
+        } else if (!strcmp(argv[i], "--sample") && i + 1 < argc) {
+            samplePath = argv[++i];
+        } else if (!strcmp(argv[i], "--sample-root") && i + 1 < argc) {
+            sampleRootArg = (int)clamp(atoi(argv[++i]), 0, 127);
+        } else if (!strcmp(argv[i], "--sample-loop") && i + 2 < argc) {
+            sampleLoopArg[0] = max(atoi(argv[++i]), 0);
+            sampleLoopArg[1] = max(atoi(argv[++i]), 0);
+        } else if (!strcmp(argv[i], "--string-decay") && i + 1 < argc) {
+            stringDecay = clamp(atof(argv[++i]), 0.1, 60.0);
+        } else if (!strcmp(argv[i], "--vocoder")) {
+            vocoderEnabled = true;
+        } else if (!strcmp(argv[i], "--vocoder-bands") && i + 1 < argc) {
+            vocoderBands = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--multiband")) {
+            mbEnabled = true;
+        } else if (!strcmp(argv[i], "--harmonizer")) {
+            harmonizerEnabled = true;
+        } else if (!strcmp(argv[i], "--harmony-hq")) {
+            harmonyMode = H_PhaseVocoder;
+        } else if (!strcmp(argv[i], "--harmony-input")) {
+            harmonizeInput = true;
+        } else if (!strcmp(argv[i], "--harmony") && i + 1 < argc) {
+            harmonyVoices = sscanf(argv[++i], "%f,%f,%f,%f", &harmonyShift[0], &harmonyShift[1], &harmonyShift[2], &harmonyShift[3]);
+            harmonyVoices = (int)clamp(harmonyVoices, 1, HARMONY_VOICES);
+        } else if (!strcmp(argv[i], "--mb-crossovers") && i + 1 < argc) {
+            sscanf(argv[++i], "%f,%f,%f", &mbCrossovers[0], &mbCrossovers[1], &mbCrossovers[2]);
+        } else if (!strcmp(argv[i], "--mb-threshold") && i + 1 < argc) {
+            sscanf(argv[++i], "%f,%f,%f,%f", &mbThreshold[0], &mbThreshold[1], &mbThreshold[2], &mbThreshold[3]);
+        } else if (!strcmp(argv[i], "--mb-ratio") && i + 1 < argc) {
+            sscanf(argv[++i], "%f,%f,%f,%f", &mbRatio[0], &mbRatio[1], &mbRatio[2], &mbRatio[3]);
+        } else {
+            fprintf(stderr, "unknown argument: %s\n", argv[i]);
+        }
+    }
 
-    SDL_AudioSpec got;
+    // Offline, nothing to open but the arena
+    if (replayPath) {
+        if (!arenaInit(arenaMegabytes << 20, false))
+            return 1;
+        initStrings();
+        return replayJournal(replayPath, replayOut) ? 0 : 1;
+    }
+
+    if (autosampleDir) {
+        if (!arenaInit(arenaMegabytes << 20, false))
+            return 1;
+        initStrings();
+        return runAutosample() ? 0 : 1;
+    }
 
-    auto devId = SDL_OpenAudioDevice(nullptr, 0, &want, &got, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    // Just the front end, the engine's running somewhere else
+    if (remoteHost) {
+        SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS);
+        TTF_Init();
+        font = TTF_OpenFont("font.ttf", 20);
 
-    if (devId == 0) {
-        fprintf(stderr, "failed to open audio device: %s\n", SDL_GetError()); 
+        if (!connectRemote(remoteHost, uiPort)) {
+            SDL_Quit();
+            return 1;
+        }
+
+        window = SDL_CreateWindow("win", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 800, 600, SDL_WINDOW_RESIZABLE);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        eventLoop();
+
+        if (remoteSocket != NO_SOCKET)
+            closeSocket(remoteSocket);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        TTF_CloseFont(font);
+        TTF_Quit();
+        SDL_Quit();
+        return 0;
     }
 
-    bufSize = got.samples;
-    currentSampleRate = got.freq;
-    nChannels = got.channels;
+    installJournalSignals();
+
+    if (headless) {
+        blockShutdownSignals();
+        SDL_SetHint(SDL_HINT_NO_SIGNAL_HANDLERS, "1");
+        // Probably logging to a pipe, don't sit on output
+        setvbuf(stdout, nullptr, _IOLBF, 0);
+        SDL_Init(SDL_INIT_AUDIO);
+    } else {
+        SDL_Init(SDL_INIT_EVERYTHING);
+        TTF_Init();
+        font = TTF_OpenFont("font.ttf", 20);
+    }
+
+    if (!arenaInit(arenaMegabytes << 20, arenaHugePages))
+        return 1;
+
+    initStrings();
+    if (samplePath)
+        loadSample(samplePath);
 
-    window = SDL_CreateWindow("win", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 800, 600, SDL_WINDOW_RESIZABLE);
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    bool usingJack = false;
+#ifdef SYNTH_WITH_JACK
+    if (useJack) {
+        usingJack = openJack(jackName, nChannels);
+        if (!usingJack)
+            fprintf(stderr, "falling back to SDL output\n");
+    }
+#else
+    if (useJack)
+        fprintf(stderr, "built without JACK support, using SDL output\n");
+    (void)jackName;
+#endif
+
+    if (!usingJack) {
+        outputFormatWanted = outputFormat;
+        bool opened = openOutput(outputDeviceName);
+        if (!opened && backupDeviceName)
+            opened = openOutput(backupDeviceName);
+
+        // Carries on without, and picks one up when it appears
+        if (!opened)
+            audioDeviceLost = true;
+    }
+
+    loadTuning();
+
+    if (openCapture)
+        openInput(captureName, captureChannels);
+
+    // Receivers lose lock if the stream stops, so no suspending
+    std::thread rtpThread;
+    if (rtpEnabled && startRtp()) {
+        idleSuspendSeconds = -1.0f;
+        rtpThread = std::thread(rtpSenderThread);
+    }
+
+    std::thread uiServer;
+    if (uiServerEnabled) {
+        netStartup();
+        uiServerRunning = true;
+        uiServer = std::thread(uiServerThread);
+    }
+
+    if (!headless) {
+        window = SDL_CreateWindow("win", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 800, 600, SDL_WINDOW_RESIZABLE);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    }
 
     RtMidiIn* midiin = new RtMidiIn();
     RtMidiOut* launchkeyOut = new RtMidiOut();
 
-    if (midiin->getPortCount() > 1) {
+    // The stress test's virtual port takes the place of the keyboard
+    RtMidiOut* stressOut = nullptr;
+    unsigned midiInPort = 1;
+    if (stressRate > 0 && stressVirtual && !usingJack) {
+#ifdef _WIN32
+        fprintf(stderr, "no virtual MIDI ports on Windows, stressing the input directly\n");
+#else
+        stressOut = new RtMidiOut();
+        stressOut->openVirtualPort("synth stress");
+        for (unsigned i = 0; i < midiin->getPortCount(); i++) {
+            if (midiin->getPortName(i).find("synth stress") != std::string::npos)
+                midiInPort = i;
+        }
+#endif
+    }
+
+    bool usingAlsaMidi = false;
+#ifdef SYNTH_WITH_ALSA
+    if (useAlsaMidi && !usingJack)
+        usingAlsaMidi = openAlsaMidi(alsaConnect);
+#else
+    if (useAlsaMidi)
+        fprintf(stderr, "built without ALSA support, using RtMidi\n");
+    (void)alsaConnect;
+#endif
+
+    // JACK brings its own MIDI input, with frame offsets
+    if (usingJack) {
+        printf("taking MIDI from JACK\n");
+    } else if (usingAlsaMidi) {
+        printf("taking MIDI from the ALSA sequencer\n");
+    } else if (midiin->getPortCount() > midiInPort) {
         for (int i = 0; i < midiin->getPortCount(); i++) {
             printf("port %i: %s\n", i, midiin->getPortName(i).c_str());
         }
-        midiin->openPort(1);
+        midiin->openPort(midiInPort);
+        // Let clock through, still skip sysex and active sensing
+        midiin->ignoreTypes(true, false, true);
         midiin->setCallback(midiCallback);
     } else {
         fprintf(stderr, "no midi ports!");
     }
 
+#ifdef SYNTH_WITH_ALSA
+    if (umpName)
+        openUmp(umpName);
+#else
+    if (umpName)
+        fprintf(stderr, "built without ALSA support, no UMP input\n");
+#endif
+
+    std::thread housekeeper(housekeepingThread);
+
+    std::thread sampleDecoder;
+    if (sampleData) {
+        sampleDecoderRunning = true;
+        sampleDecoder = std::thread(sampleDecoderThread);
+    }
+
+    std::thread launchkeyThread;
     if (launchkeyOut->getPortCount() > 1) {
         for (int i = 0; i < launchkeyOut->getPortCount(); i++) {
             printf("out port %i: %s\n", i, launchkeyOut->getPortName(i).c_str());
@@ -902,14 +8063,102 @@ int main(int argc, char** argv) {
 
         launchkeyOut->sendMessage(msg, 3);
 
-        std::thread([&]() {fancyThread(launchkeyOut); }).detach();
+        launchkeyThread = std::thread([&]() {fancyThread(launchkeyOut); });
+    }
+
+    RtMidiOut* clockOut = nullptr;
+    std::thread clockThread;
+    if (clockOutPort >= 0) {
+        clockOut = new RtMidiOut();
+        if (clockOutPort < (int)clockOut->getPortCount()) {
+            printf("sending clock to %s\n", clockOut->getPortName(clockOutPort).c_str());
+            clockOut->openPort(clockOutPort);
+            seqSendClock = true;
+            clockOutRunning = true;
+            clockThread = std::thread([=]() { clockOutThread(clockOut); });
+        } else {
+            fprintf(stderr, "no midi out port %i for clock\n", clockOutPort);
+        }
+    }
+
+    // Keyboard notes get stamped with wall time
+    timeAccumulator = getWallTime();
+    if (captureDevice != 0)
+        SDL_PauseAudioDevice(captureDevice, 0);
+#ifdef SYNTH_WITH_JACK
+    if (usingJack && !startJack())
+        closeJack();
+#endif
+    if (!usingJack)
+        SDL_PauseAudioDevice(audioDevice, 0);
+
+    std::thread stressThread;
+    if (stressRate > 0)
+        stressThread = std::thread([=]() { midiStressThread(stressOut); });
+
+    if (headless)
+        headlessLoop();
+    else
+        eventLoop();
+
+    // Stop the inputs first, then audio, then everything else
+    midiin->cancelCallback();
+    midiin->closePort();
+#ifdef SYNTH_WITH_ALSA
+    closeUmp();
+    closeAlsaMidi();
+#endif
+#ifdef SYNTH_WITH_JACK
+    closeJack();
+#endif
+    if (!usingJack)
+        SDL_CloseAudioDevice(audioDevice);
+    if (captureDevice != 0)
+        SDL_CloseAudioDevice(captureDevice);
+
+    synthRunning = false;
+    clockOutRunning = false;
+    rtpRunning = false;
+
+    if (rtpThread.joinable())
+        rtpThread.join();
+    stopRtp();
+
+    uiServerRunning = false;
+    if (uiServer.joinable())
+        uiServer.join();
+
+    if (clockThread.joinable())
+        clockThread.join();
+
+    if (stressThread.joinable())
+        stressThread.join();
+
+    housekeeper.join();
+
+    sampleDecoderRunning = false;
+    if (sampleDecoder.joinable())
+        sampleDecoder.join();
+
+    if (launchkeyThread.joinable()) {
+        launchkeyThread.join();
+
+        unsigned char msg[] = { 0b10011111, 12, 0 };
+        launchkeyOut->sendMessage(msg, 3);
     }
 
-    SDL_PauseAudioDevice(devId, 0);
-    eventLoop();
+    delete midiin;
+    delete stressOut;
+    delete launchkeyOut;
+    delete clockOut;
 
-    unsigned char msg[] = { 0b10011111, 12, 0 };
-    launchkeyOut->sendMessage(msg, 3);
+    if (!headless) {
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        TTF_CloseFont(font);
+        TTF_Quit();
+    }
 
+    SDL_Quit();
     return 0;
 }